@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../fs/fat32.h"
+#include "../fs/block.h"
+#include "../fs/virtul_disk.h"
+#include "../fs/ram_disk.h"
+#include "../fs/mkfs.h"
+#include "../fs/trace.h"
+
+#define BENCH_RAM_SECTORS (512*1024)    // 256MB
+#define BENCH_IO_SIZE 4096
+#define BENCH_PATH_DEPTH 16
+#define BENCH_BATCH_OPS 64     // ops staged before a batch commit.
+
+typedef unsigned long long bench_ns_t;
+
+/*!
+ * @note latencies of one workload.
+ */
+typedef
+struct {
+    const char * name;
+    bench_ns_t * lat;
+    uint32_t cnt;
+    uint32_t cap;
+    bench_ns_t start;
+    bench_ns_t total;
+} bench_t;
+
+typedef
+struct {
+    const char * filter;
+    double scale;
+    uint32_t latency_ns;
+    const char * image;
+    const char * trace;     // path of trace file.
+    bool first_result;
+    unsigned long long rand_state;
+    fs_t * fs;
+} bench_config_t;
+
+static bench_config_t config = {NULL,1.0,0,NULL,NULL,true,0x2021041600000001ULL,NULL};
+
+static inline bench_ns_t _now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return (bench_ns_t)t.tv_sec*1000000000ULL+t.tv_nsec;
+}
+
+static inline uint32_t _rand(){
+    // xorshift64,the sequence is same in every run.
+    config.rand_state ^= config.rand_state<<13;
+    config.rand_state ^= config.rand_state>>7;
+    config.rand_state ^= config.rand_state<<17;
+    return (uint32_t)(config.rand_state>>16);
+}
+
+static inline uint32_t _scaled(uint32_t cnt){
+    uint32_t ret = (uint32_t)(cnt*config.scale);
+    return ret == 0?1:ret;
+}
+
+/*!
+ * @note FNV-1a of bytes,chained by sum.
+ */
+static inline uint32_t _sum(uint32_t sum, const byte * data, uint32_t length){
+    for(uint32_t i = 0;i<length;i++){
+        sum = (sum^data[i])*16777619u;
+    }
+    return sum;
+}
+
+static bool _bench_selected(const char * name){
+    return config.filter == NULL||strstr(name,config.filter)!=NULL;
+}
+
+/*!
+ * @note the setup of a group is skipped when
+ *       all workloads in it are filtered out.
+ */
+static bool _bench_group_selected(const char * prefix, const char * suffix){
+    char name[64];
+    static const char * const ops[] = {"seq_write","seq_read","lend_sum","rand_read","rand_write","create","lookup","remove","batch_create","batch_remove"};
+    if(_bench_selected(prefix)){
+        return true;
+    }
+    for(uint32_t i = 0;i<sizeof(ops)/sizeof(ops[0]);i++){
+        snprintf(name,sizeof(name),"%s%s%s",prefix,ops[i],suffix);
+        if(_bench_selected(name)){
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * @return false when the workload is filtered out.
+ */
+static bool _bench_begin(bench_t * bench, const char * name, uint32_t op_cnt){
+    if(!_bench_selected(name)){
+        return false;
+    }
+    bench->name = name;
+    bench->cnt = 0;
+    bench->cap = op_cnt;
+    bench->total = 0;
+    bench->lat = malloc(sizeof(bench_ns_t)*op_cnt);
+    if(bench->lat == NULL){
+        PANIC("no memory for bench!\n");
+    }
+    return true;
+}
+
+static inline void _op_start(bench_t * bench){
+    bench->start = _now();
+}
+
+static inline void _op_end(bench_t * bench){
+    bench_ns_t lat = _now()-bench->start;
+    bench->total+=lat;
+    if(bench->cnt<bench->cap){
+        bench->lat[bench->cnt++] = lat;
+    }
+}
+
+static int _lat_cmp(const void * a, const void * b){
+    bench_ns_t x = *(const bench_ns_t *)a;
+    bench_ns_t y = *(const bench_ns_t *)b;
+    return x<y?-1:(x>y?1:0);
+}
+
+static bench_ns_t _percentile(bench_t * bench, double p){
+    uint32_t index = (uint32_t)(p*(bench->cnt-1)+0.5);
+    return bench->lat[index];
+}
+
+/*!
+ * @note print result of a workload as a JSON object.
+ */
+static void _bench_end(bench_t * bench){
+    if(bench->cnt == 0){
+        free(bench->lat);
+        return;
+    }
+    qsort(bench->lat,bench->cnt,sizeof(bench_ns_t),_lat_cmp);
+    double seconds = bench->total/1e9;
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %u, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+           "\"lat_ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+           config.first_result?"":",",bench->name,bench->cnt,seconds,seconds>0?bench->cnt/seconds:0.0,
+           _percentile(bench,0.5),_percentile(bench,0.9),_percentile(bench,0.99),_percentile(bench,0.999),
+           bench->lat[bench->cnt-1]);
+    fflush(stdout);
+    config.first_result = false;
+    free(bench->lat);
+}
+
+static void _bench_block(){
+    bench_t bench;
+    int dev_no = config.fs->dev_no;
+    uint32_t base = config.fs->first_data_sec;
+    uint32_t op_cnt = _scaled(1000000);
+    if(_bench_begin(&bench,"block_hit",op_cnt)){
+        for(uint32_t i = 0;i<op_cnt;i++){
+            _op_start(&bench);
+            block_t * block = block_get_read(base+i%64,dev_no);
+            block_put_read(block);
+            _op_end(&bench);
+        }
+        _bench_end(&bench);
+    }
+    op_cnt = _scaled(200000);
+    if(_bench_begin(&bench,"block_miss",op_cnt)){
+        // the working set is 4 times of cache.
+        for(uint32_t i = 0;i<op_cnt;i++){
+            _op_start(&bench);
+            block_t * block = block_get_read(base+i%(CONFIG_FS_BLOCK_CACHE_CNT*4),dev_no);
+            block_put_read(block);
+            _op_end(&bench);
+        }
+        _bench_end(&bench);
+    }
+}
+
+static void _bench_file(uint32_t size, const char * size_name){
+    static byte buffer[BENCH_IO_SIZE];
+    char name[32];
+    char path[32];
+    bench_t bench;
+    uint32_t op_cnt = size/BENCH_IO_SIZE;
+    snprintf(name,sizeof(name),"_%s",size_name);
+    if(!_bench_group_selected("file_",name)){
+        return;
+    }
+    snprintf(path,sizeof(path),"/S%s.DAT",size_name);
+    entry_t * entry = entry_create_write(config.fs->root,path+1,ENTRY_ATTR_ARCHIVE);
+    if(entry == NULL){
+        PANIC("can`t create bench file!\n");
+    }
+    for(uint32_t i = 0;i<BENCH_IO_SIZE;i++){
+        buffer[i] = (byte)i;
+    }
+    snprintf(name,sizeof(name),"file_seq_write_%s",size_name);
+    if(_bench_begin(&bench,name,op_cnt)){
+        for(uint32_t i = 0;i<op_cnt;i++){
+            _op_start(&bench);
+            entry_rw(entry,buffer,i*BENCH_IO_SIZE,BENCH_IO_SIZE,true);
+            _op_end(&bench);
+        }
+        _bench_end(&bench);
+    }
+    else{
+        entry_fallocate(entry,size);
+        for(uint32_t i = 0;i<op_cnt;i++){
+            entry_rw(entry,buffer,i*BENCH_IO_SIZE,BENCH_IO_SIZE,true);
+        }
+    }
+    entry_put_write(entry);
+    entry_flush_all();
+    block_flush_all();
+    entry = parse_path_write(config.fs,path);
+    snprintf(name,sizeof(name),"file_seq_read_%s",size_name);
+    if(_bench_begin(&bench,name,op_cnt)){
+        for(uint32_t i = 0;i<op_cnt;i++){
+            _op_start(&bench);
+            entry_rw(entry,buffer,i*BENCH_IO_SIZE,BENCH_IO_SIZE,false);
+            _op_end(&bench);
+        }
+        _bench_end(&bench);
+    }
+    snprintf(name,sizeof(name),"file_lend_sum_%s",size_name);
+    if(_bench_begin(&bench,name,op_cnt)){
+        // the hasher reads the lent blocks in place,the sum is checked
+        // against the copies of entry_rw after timing.
+        entry_seg_t segs[BENCH_IO_SIZE/CONFIG_FS_BLOCK_SIZE+1];
+        uint32_t lent_sum = 2166136261u;
+        for(uint32_t i = 0;i<op_cnt;i++){
+            _op_start(&bench);
+            uint32_t cnt = entry_read_lend(entry,i*BENCH_IO_SIZE,BENCH_IO_SIZE,segs,sizeof(segs)/sizeof(segs[0]));
+            uint32_t length = 0;
+            for(uint32_t k = 0;k<cnt;k++){
+                lent_sum = _sum(lent_sum,segs[k].data,segs[k].length);
+                length+=segs[k].length;
+            }
+            entry_read_release(segs,cnt);
+            _op_end(&bench);
+            if(length!=BENCH_IO_SIZE){
+                // pins not given back use up the budget.
+                PANIC("can`t lend bench file!\n");
+            }
+        }
+        uint32_t copied_sum = 2166136261u;
+        for(uint32_t i = 0;i<op_cnt;i++){
+            entry_rw(entry,buffer,i*BENCH_IO_SIZE,BENCH_IO_SIZE,false);
+            copied_sum = _sum(copied_sum,buffer,BENCH_IO_SIZE);
+        }
+        if(lent_sum!=copied_sum){
+            PANIC("lent data differs from entry_rw!\n");
+        }
+        _bench_end(&bench);
+    }
+    snprintf(name,sizeof(name),"file_rand_read_%s",size_name);
+    if(_bench_begin(&bench,name,op_cnt)){
+        for(uint32_t i = 0;i<op_cnt;i++){
+            uint32_t offset = (_rand()%op_cnt)*BENCH_IO_SIZE;
+            _op_start(&bench);
+            entry_rw(entry,buffer,offset,BENCH_IO_SIZE,false);
+            _op_end(&bench);
+        }
+        _bench_end(&bench);
+    }
+    snprintf(name,sizeof(name),"file_rand_write_%s",size_name);
+    if(_bench_begin(&bench,name,op_cnt)){
+        for(uint32_t i = 0;i<op_cnt;i++){
+            uint32_t offset = (_rand()%op_cnt)*BENCH_IO_SIZE;
+            _op_start(&bench);
+            entry_rw(entry,buffer,offset,BENCH_IO_SIZE,true);
+            _op_end(&bench);
+        }
+        _bench_end(&bench);
+    }
+    entry_put_write(entry);
+    entry_flush_all();
+    block_flush_all();
+}
+
+static void _bench_dir(){
+    char name[16];
+    char path[32];
+    bench_t bench;
+    uint32_t file_cnt = _scaled(500);
+    if(!_bench_group_selected("dir_","")){
+        return;
+    }
+    entry_t * dir = entry_create_write(config.fs->root,"D.",ENTRY_ATTR_DIR);
+    if(dir == NULL){
+        PANIC("can`t create bench dir!\n");
+    }
+    bool created = _bench_begin(&bench,"dir_create",file_cnt);
+    for(uint32_t i = 0;i<file_cnt;i++){
+        snprintf(name,sizeof(name),"F%05u.TXT",i);
+        if(created){
+            _op_start(&bench);
+        }
+        entry_t * entry = entry_create_write(dir,name,ENTRY_ATTR_ARCHIVE);
+        if(entry == NULL){
+            PANIC("can`t create bench file!\n");
+        }
+        entry_put_write(entry);
+        if(created){
+            _op_end(&bench);
+        }
+    }
+    if(created){
+        _bench_end(&bench);
+    }
+    uint32_t op_cnt = _scaled(2000);
+    // the path walk locks the dir,so it`s held only by the walk.
+    entry_put_write(dir);
+    if(_bench_begin(&bench,"dir_lookup",op_cnt)){
+        for(uint32_t i = 0;i<op_cnt;i++){
+            snprintf(path,sizeof(path),"/D/F%05u.TXT",_rand()%file_cnt);
+            _op_start(&bench);
+            entry_t * entry = parse_path_read(config.fs,path);
+            if(entry == NULL){
+                PANIC("can`t find bench file!\n");
+            }
+            entry_put_read(entry);
+            _op_end(&bench);
+        }
+        _bench_end(&bench);
+    }
+    dir = parse_path_write(config.fs,"/D");
+    if(_bench_begin(&bench,"dir_remove",file_cnt)){
+        for(uint32_t i = 0;i<file_cnt;i++){
+            snprintf(name,sizeof(name),"F%05u.TXT",i);
+            _op_start(&bench);
+            if(!entry_rm_sub(dir,name)){
+                PANIC("can`t remove bench file!\n");
+            }
+            _op_end(&bench);
+        }
+        _bench_end(&bench);
+    }
+    // a batch is timed as a whole and it`s time is shared by the ops in it,
+    // the files are created untimed when only the removes are selected.
+    bool batch_remove = _bench_selected("dir_batch_remove");
+    for(uint32_t pass = 0;pass<2;pass++){
+        entry_batch_t batch;
+        bool timed = _bench_begin(&bench,pass == 0?"dir_batch_create":"dir_batch_remove",file_cnt);
+        if(!timed&&(pass == 1||!batch_remove)){
+            continue;
+        }
+        for(uint32_t i = 0;i<file_cnt;i+=BENCH_BATCH_OPS){
+            uint32_t cnt = file_cnt-i<BENCH_BATCH_OPS?file_cnt-i:BENCH_BATCH_OPS;
+            _op_start(&bench);
+            entry_batch_init(&batch,config.fs);
+            for(uint32_t j = i;j<i+cnt;j++){
+                snprintf(name,sizeof(name),"B%05u.TXT",j);
+                if(pass == 0){
+                    entry_batch_create(&batch,dir,name,ENTRY_ATTR_ARCHIVE);
+                }
+                else{
+                    entry_batch_remove(&batch,dir,name);
+                }
+            }
+            if(entry_batch_commit(&batch)!=cnt){
+                PANIC("can`t commit bench batch!\n");
+            }
+            entry_batch_release(&batch);
+            bench_ns_t lat = (_now()-bench.start)/cnt;
+            for(uint32_t j = 0;timed&&j<cnt;j++){
+                bench.total+=lat;
+                bench.lat[bench.cnt++] = lat;
+            }
+        }
+        if(timed){
+            _bench_end(&bench);
+        }
+    }
+    entry_put_write(dir);
+}
+
+static void _bench_path(){
+    char name[16];
+    char path[BENCH_PATH_DEPTH*4+1];
+    bench_t bench;
+    uint32_t op_cnt = _scaled(20000);
+    if(!_bench_begin(&bench,"path_deep",op_cnt)){
+        return;
+    }
+    entry_t * parent = config.fs->root;
+    path[0] = '\0';
+    for(int i = 0;i<BENCH_PATH_DEPTH;i++){
+        snprintf(name,sizeof(name),"P%d.",i);
+        entry_t * dir = entry_create_write(parent,name,ENTRY_ATTR_DIR);
+        if(dir == NULL){
+            PANIC("can`t create bench dir!\n");
+        }
+        if(parent!=config.fs->root){
+            entry_put_write(parent);
+        }
+        parent = dir;
+        snprintf(path+strlen(path),sizeof(path)-strlen(path),"/P%d",i);
+    }
+    entry_put_write(parent);
+    for(uint32_t i = 0;i<op_cnt;i++){
+        _op_start(&bench);
+        entry_t * entry = parse_path_read(config.fs,path);
+        if(entry == NULL){
+            PANIC("can`t resolve bench path!\n");
+        }
+        entry_put_read(entry);
+        _op_end(&bench);
+    }
+    _bench_end(&bench);
+}
+
+static void _usage(const char * name){
+    printf("usage: %s [--filter name] [--scale x] [--latency ns] [--image path] [--trace path]\n",name);
+}
+
+int main(int argc, char ** argv){
+    for(int i = 1;i<argc;i++){
+        if(i+1<argc&&strcmp(argv[i],"--filter") == 0){
+            config.filter = argv[++i];
+        }
+        else if(i+1<argc&&strcmp(argv[i],"--scale") == 0){
+            config.scale = atof(argv[++i]);
+        }
+        else if(i+1<argc&&strcmp(argv[i],"--latency") == 0){
+            config.latency_ns = atoi(argv[++i]);
+        }
+        else if(i+1<argc&&strcmp(argv[i],"--image") == 0){
+            config.image = argv[++i];
+        }
+        else if(i+1<argc&&strcmp(argv[i],"--trace") == 0){
+            config.trace = argv[++i];
+        }
+        else{
+            _usage(argv[0]);
+            return 1;
+        }
+    }
+    block_module_init();
+    fat32_module_init();
+    int dev_no;
+    if(config.image!=NULL){
+        // the volume in image is formatted,so the workloads start from same state.
+        mkfs_param_t param;
+        memset(&param,0,sizeof(param));
+        param.size = (size_t)BENCH_RAM_SECTORS*CONFIG_FS_BLOCK_SIZE;
+        if(!fat32_mkfs(config.image,&param)){
+            printf("can`t format %s!\n",config.image);
+            return 1;
+        }
+        dev_no = disk_open(config.image,0);
+    }
+    else{
+        mkfs_param_t param;
+        memset(&param,0,sizeof(param));
+        dev_no = ram_disk_create(BENCH_RAM_SECTORS,0);
+        if(dev_no!=DISK_NO_ERROR){
+            fat32_mkfs_dev(dev_no,&param);
+            ram_disk_set_latency(dev_no,config.latency_ns,config.latency_ns);
+        }
+    }
+    if(dev_no == DISK_NO_ERROR||(config.fs = fat32_mount_dev(dev_no)) == NULL){
+        printf("can`t mount bench volume!\n");
+        return 1;
+    }
+    printf("{\n  \"config\": {\"device\": \"%s\", \"latency_ns\": %u, \"scale\": %g, "
+           "\"block_cache_cnt\": %d, \"entry_cache_cnt\": %d},\n  \"results\": [",
+           config.image!=NULL?"file":"ram",config.latency_ns,config.scale,
+           CONFIG_FS_BLOCK_CACHE_CNT,CONFIG_FS_ENTRY_CACHE_CNT);
+    _bench_block();
+    _bench_file(64*1024,"64K");
+    _bench_file(1024*1024,"1M");
+    _bench_file(16*1024*1024,"16M");
+    _bench_dir();
+    _bench_path();
+    printf("\n  ]\n}\n");
+    fat32_umount(config.fs);
+    disk_close(dev_no);
+    if(config.trace!=NULL&&!trace_export(config.trace)){
+        printf("can`t write trace to %s,is CONFIG_FS_TRACE on?\n",config.trace);
+        return 1;
+    }
+    return 0;
+}
@@ -3,3 +3,980 @@
 //
 
 #include "elf64.h"
+#include "../fs/block.h"
+#include "stdlib.h"
+#include "string.h"
+
+static struct {
+    elf_file_t files[CONFIG_ELF64_FILE_CNT];
+    uint32_t stamp;
+    rw_lock_t rw_lock;
+} elf_table;
+
+static inline elf64_addr_t _min(elf64_addr_t a, elf64_addr_t b){
+    return a<b?a:b;
+}
+
+static inline elf64_addr_t _max(elf64_addr_t a, elf64_addr_t b){
+    return a>b?a:b;
+}
+
+/*!
+ * @note check ELF header of a 64-bit little endian executable.
+ */
+static bool _elf_ehdr_check(const elf64_ehdr_t * ehdr, uint32_t file_size){
+    if(ehdr->ident[0]!=0x7F||ehdr->ident[1]!='E'||ehdr->ident[2]!='L'||ehdr->ident[3]!='F'){
+        return false;
+    }
+    // ELFCLASS64,ELFDATA2LSB,EV_CURRENT
+    if(ehdr->ident[4]!=2||ehdr->ident[5]!=1||ehdr->ident[6]!=1||ehdr->version!=1){
+        return false;
+    }
+    if(ehdr->type!=ELF64_ET_EXEC&&ehdr->type!=ELF64_ET_DYN){
+        return false;
+    }
+    if(ehdr->phentsize!=sizeof(elf64_phdr_t)||ehdr->phnum == 0||ehdr->phnum>CONFIG_ELF64_PHDR_MAX){
+        return false;
+    }
+    // phoff is checked first,so the sum can`t wrap.
+    return ehdr->phoff<=file_size&&(elf64_off_t)ehdr->phnum*sizeof(elf64_phdr_t)<=file_size-ehdr->phoff;
+}
+
+/*!
+ * @note check PT_LOAD segments and keep them in elf->segs.
+ *       PT_LOAD segments must be ascending by vaddr and not overlapped.
+ */
+static bool _elf_segs_load(elf_file_t * elf, const elf64_phdr_t * phdrs, uint32_t phnum, uint32_t file_size){
+    elf->seg_cnt = 0;
+    elf->dyn_offset = 0;
+    elf->dyn_size = 0;
+    for(uint32_t i = 0;i<phnum;i++){
+        const elf64_phdr_t * phdr = &phdrs[i];
+        if(phdr->type == ELF64_PT_DYNAMIC&&phdr->offset<=file_size&&phdr->filesz<=file_size-phdr->offset){
+            elf->dyn_offset = phdr->offset;
+            elf->dyn_size = phdr->filesz;
+        }
+        if(phdr->type!=ELF64_PT_LOAD||phdr->memsz == 0){
+            continue;
+        }
+        if(elf->seg_cnt == CONFIG_ELF64_SEG_MAX||phdr->filesz>phdr->memsz){
+            return false;
+        }
+        if(phdr->offset>file_size||phdr->filesz>file_size-phdr->offset){
+            return false;
+        }
+        if(phdr->vaddr+phdr->memsz<phdr->vaddr){
+            // overflow
+            return false;
+        }
+        if(phdr->align>1&&(phdr->vaddr-phdr->offset)%phdr->align!=0){
+            return false;
+        }
+        if(elf->seg_cnt>0&&elf->segs[elf->seg_cnt-1].mem_end>phdr->vaddr){
+            return false;
+        }
+        elf_seg_t * seg = &elf->segs[elf->seg_cnt++];
+        seg->vaddr = phdr->vaddr;
+        seg->mem_end = phdr->vaddr+phdr->memsz;
+        seg->offset = phdr->offset;
+        seg->filesz = phdr->filesz;
+        seg->flags = phdr->flags&(ELF64_PF_R|ELF64_PF_W|ELF64_PF_X);
+    }
+    return elf->seg_cnt>0;
+}
+
+/*!
+ * @note read and check ELF header and program headers,
+ *       with one read each.
+ */
+static bool _elf_headers_load(elf_file_t * elf, entry_t * entry){
+    elf64_phdr_t phdrs[CONFIG_ELF64_PHDR_MAX];
+    if(entry->file_size<sizeof(elf64_ehdr_t)){
+        return false;
+    }
+    entry_rw(entry,&elf->ehdr,0,sizeof(elf64_ehdr_t),false);
+    if(!_elf_ehdr_check(&elf->ehdr,entry->file_size)){
+        return false;
+    }
+    entry_rw(entry,phdrs,elf->ehdr.phoff,elf->ehdr.phnum*sizeof(elf64_phdr_t),false);
+    return _elf_segs_load(elf,phdrs,elf->ehdr.phnum,entry->file_size);
+}
+
+static void _elf_symidx_tables_free(elf_symidx_t * symidx){
+    free(symidx->syms);
+    free(symidx->strs);
+    free(symidx->buckets);
+    free(symidx->chains);
+    free(symidx->bloom);
+    free(symidx->sorted);
+}
+
+/*!
+ * @note free the replaced indexes,when none of
+ *       the symbols got from them is used.
+ */
+static void _elf_symidx_stale_free(elf_symidx_t * symidx){
+    while(symidx->stale!=NULL){
+        elf_symidx_t * stale = symidx->stale;
+        symidx->stale = stale->stale;
+        _elf_symidx_tables_free(stale);
+        free(stale);
+    }
+}
+
+static void _elf_symidx_free(elf_symidx_t * symidx){
+    _elf_symidx_stale_free(symidx);
+    _elf_symidx_tables_free(symidx);
+    memset(symidx,0,sizeof(elf_symidx_t));
+}
+
+/*!
+ * @return index of first segment which ends after vaddr,
+ *         seg_cnt when there is no one.
+ */
+static uint32_t _elf_seg_search(elf_file_t * elf, elf64_addr_t vaddr){
+    uint32_t low = 0;
+    uint32_t high = elf->seg_cnt;
+    while(low<high){
+        uint32_t mid = (low+high)/2;
+        if(elf->segs[mid].mem_end<=vaddr){
+            low = mid+1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void elf64_module_init(){
+    memset(&elf_table,0,sizeof(elf_table));
+    fs_stub_rw_lock_init(&elf_table.rw_lock);
+}
+
+/*!
+ * @note open an ELF64 executable and parse it`s headers,
+ *       the ELF header and program headers are read with
+ *       one read each,the segments are not read.
+ *       the file opened already is shared,and the cached
+ *       one is reused when it`s headers are not changed.
+ * @param fs
+ * @param path
+ * @return NULL when file is not found,not a valid ELF64
+ *         executable or too many files are opened.
+ */
+elf_file_t * elf64_open(fs_t * fs, const char * path){
+    entry_t * entry = parse_path_read(fs,path);
+    if(entry == NULL){
+        return NULL;
+    }
+    if(entry->attr!=ENTRY_ATTR_ARCHIVE){
+        entry_put_read(entry);
+        return NULL;
+    }
+    fs_stub_rw_w_lock_acquire(&elf_table.rw_lock);
+    for(int i = 0;i<CONFIG_ELF64_FILE_CNT;i++){
+        elf_file_t * probe = &elf_table.files[i];
+        if(probe->used&&probe->entry == entry){
+            // opened,the entry is pinned by it already.
+            probe->ref_cnt++;
+            probe->stamp = ++elf_table.stamp;
+            fs_stub_rw_w_lock_release(&elf_table.rw_lock);
+            entry_put_read(entry);
+            return probe;
+        }
+    }
+    fs_stub_rw_w_lock_release(&elf_table.rw_lock);
+
+    elf_file_t head;
+    memset(&head,0,sizeof(elf_file_t));     // the segments are compared by bytes.
+    if(!_elf_headers_load(&head,entry)){
+        entry_put_read(entry);
+        return NULL;
+    }
+    // reuse the cached one,or take a free one,or the least recently used cached one.
+    elf_file_t * cached = NULL;
+    elf_file_t * idle = NULL;
+    fs_stub_rw_w_lock_acquire(&elf_table.rw_lock);
+    for(int i = 0;i<CONFIG_ELF64_FILE_CNT&&cached == NULL;i++){
+        elf_file_t * probe = &elf_table.files[i];
+        if(probe->used&&probe->entry == entry){
+            // opened by others when the headers are read.
+            probe->ref_cnt++;
+            probe->stamp = ++elf_table.stamp;
+            fs_stub_rw_w_lock_release(&elf_table.rw_lock);
+            entry_put_read(entry);
+            return probe;
+        }
+        if(!probe->used){
+            if(idle == NULL||idle->used){
+                idle = probe;
+            }
+        }
+        else if(probe->ref_cnt == 0){
+            if(probe->fs == fs&&probe->first_clus_no == entry->first_clus_no&&probe->file_size == entry->file_size&&
+               memcmp(&probe->ehdr,&head.ehdr,sizeof(elf64_ehdr_t)) == 0&&probe->seg_cnt == head.seg_cnt&&
+               memcmp(probe->segs,head.segs,head.seg_cnt*sizeof(elf_seg_t)) == 0){
+                cached = probe;
+            }
+            else if(idle == NULL||(idle->used&&probe->stamp<idle->stamp)){
+                idle = probe;
+            }
+        }
+    }
+    elf_file_t * elf = cached!=NULL?cached:idle;
+    if(elf == NULL){
+        fs_stub_rw_w_lock_release(&elf_table.rw_lock);
+        entry_put_read(entry);
+        return NULL;
+    }
+    if(elf!=cached){
+        _elf_symidx_free(&elf->symidx);
+        elf->fs = fs;
+        elf->first_clus_no = entry->first_clus_no;
+        elf->file_size = entry->file_size;
+        elf->ehdr = head.ehdr;
+        elf->seg_cnt = head.seg_cnt;
+        memcpy(elf->segs,head.segs,sizeof(head.segs));
+        elf->dyn_offset = head.dyn_offset;
+        elf->dyn_size = head.dyn_size;
+        fs_stub_rw_lock_init(&elf->rw_lock);
+    }
+    elf->used = true;
+    elf->entry = entry_pin(entry);
+    elf->ref_cnt = 1;
+    elf->stamp = ++elf_table.stamp;
+    fs_stub_rw_w_lock_release(&elf_table.rw_lock);
+    // only the ref is kept,the lock is taken by each read.
+    entry_put_read(entry);
+    return elf;
+}
+
+/*!
+ * @note close the ELF file,the file entry is unpinned
+ *       when it is closed by all openers,and the file
+ *       is kept in table as cache.
+ * @warning the ELF files of a volume must be closed
+ *          and dropped by elf64_cache_drop before umount.
+ */
+void elf64_close(elf_file_t * elf){
+    ASSERT(elf!=NULL&&elf->used&&elf->ref_cnt>0,"elf file is invalid!\n");
+    fs_stub_rw_w_lock_acquire(&elf_table.rw_lock);
+    elf->ref_cnt--;
+    if(elf->ref_cnt == 0){
+        entry_unpin(elf->entry);
+        elf->entry = NULL;
+        _elf_symidx_stale_free(&elf->symidx);
+    }
+    fs_stub_rw_w_lock_release(&elf_table.rw_lock);
+}
+
+/*!
+ * @note drop the cached ELF files of a volume.
+ * @warning none of the files can be opened.
+ */
+void elf64_cache_drop(fs_t * fs){
+    fs_stub_rw_w_lock_acquire(&elf_table.rw_lock);
+    for(int i = 0;i<CONFIG_ELF64_FILE_CNT;i++){
+        elf_file_t * probe = &elf_table.files[i];
+        if(probe->used&&probe->fs == fs){
+            ASSERT(probe->ref_cnt == 0,"elf file is opened!\n");
+            _elf_symidx_free(&probe->symidx);
+            probe->used = false;
+            probe->fs = NULL;
+        }
+    }
+    fs_stub_rw_w_lock_release(&elf_table.rw_lock);
+}
+
+/*!
+ * @return the segment holding vaddr,NULL if vaddr is not in any segment.
+ */
+const elf_seg_t * elf64_seg_of(elf_file_t * elf, elf64_addr_t vaddr){
+    uint32_t index = _elf_seg_search(elf,vaddr);
+    if(index<elf->seg_cnt&&elf->segs[index].vaddr<=vaddr){
+        return &elf->segs[index];
+    }
+    return NULL;
+}
+
+/*!
+ * @note fill the page holding vaddr,which is invoked by page fault
+ *       handler on the first touch of the page. only the bytes of
+ *       segments in page are read from file,the others are zero,
+ *       so the bss pages are made without any I/O.
+ * @param elf
+ * @param vaddr : any address in the page.
+ * @param page : ELF64_PAGE_SIZE bytes.
+ * @param flags : the ELF64_PF_* of segments in page.
+ * @return false when the page is not in any segment,
+ *         or the file is shrunk after it is opened.
+ */
+bool elf64_page_load(elf_file_t * elf, elf64_addr_t vaddr, void * page, uint32_t * flags){
+    elf64_addr_t const page_start = vaddr&~(elf64_addr_t)(ELF64_PAGE_SIZE-1);
+    elf64_addr_t const page_end = page_start+ELF64_PAGE_SIZE;
+    elf64_addr_t cursor = page_start;   // bytes before cursor are filled.
+    uint32_t page_flags = 0;
+    bool hit = false;
+    entry_t * entry = entry_get_read(elf->entry);
+    if(entry->file_size<elf->file_size){
+        // the segments may be out of file.
+        entry_put_read(entry);
+        return false;
+    }
+    for(uint32_t i = _elf_seg_search(elf,page_start);i<elf->seg_cnt&&elf->segs[i].vaddr<page_end;i++){
+        const elf_seg_t * seg = &elf->segs[i];
+        elf64_addr_t from = _max(seg->vaddr,page_start);
+        elf64_addr_t to = _min(seg->mem_end,page_end);
+        elf64_addr_t file_end = _min(seg->vaddr+seg->filesz,to);
+        hit = true;
+        page_flags|=seg->flags;
+        if(from<file_end){
+            memset((byte *)page+(cursor-page_start),0,from-cursor);
+            entry_rw(entry,(byte *)page+(from-page_start),seg->offset+(from-seg->vaddr),file_end-from,false);
+            cursor = file_end;
+        }
+    }
+    entry_put_read(entry);
+    if(!hit){
+        return false;
+    }
+    memset((byte *)page+(cursor-page_start),0,page_end-cursor);
+    *flags = page_flags;
+    return true;
+}
+
+/*!
+ * @note a range of file copied to image.
+ */
+typedef
+struct {
+    elf64_off_t offset;
+    elf64_xword_t size;
+    byte * dest;
+} elf_range_t;
+
+/*!
+ * @return the page aligned vaddr where image starts.
+ */
+elf64_addr_t elf64_image_base(elf_file_t * elf){
+    return elf->segs[0].vaddr&~(elf64_addr_t)(ELF64_PAGE_SIZE-1);
+}
+
+/*!
+ * @return bytes of image holding all segments,aligned to page.
+ */
+elf64_xword_t elf64_image_size(elf_file_t * elf){
+    elf64_addr_t end = elf->segs[elf->seg_cnt-1].mem_end;
+    end = (end+ELF64_PAGE_SIZE-1)&~(elf64_addr_t)(ELF64_PAGE_SIZE-1);
+    return end-elf64_image_base(elf);
+}
+
+/*!
+ * @note collect the file ranges of segments sorted by offset,
+ *       the ranges contiguous both in file and image are merged.
+ * @return count of ranges.
+ */
+static uint32_t _elf_image_ranges(elf_file_t * elf, byte * image, elf_range_t * ranges){
+    elf64_addr_t const base = elf64_image_base(elf);
+    uint32_t cnt = 0;
+    for(uint32_t i = 0;i<elf->seg_cnt;i++){
+        const elf_seg_t * seg = &elf->segs[i];
+        if(seg->filesz == 0){
+            continue;
+        }
+        elf_range_t range = {seg->offset,seg->filesz,image+(seg->vaddr-base)};
+        uint32_t pos = cnt;
+        for(;pos>0&&ranges[pos-1].offset>range.offset;pos--){
+            ranges[pos] = ranges[pos-1];
+        }
+        ranges[pos] = range;
+        cnt++;
+    }
+    uint32_t merged = 0;
+    for(uint32_t i = 0;i<cnt;i++){
+        elf_range_t * last = merged>0?&ranges[merged-1]:NULL;
+        if(last!=NULL&&last->offset+last->size == ranges[i].offset&&last->dest+last->size == ranges[i].dest){
+            last->size+=ranges[i].size;
+        }
+        else{
+            ranges[merged++] = ranges[i];
+        }
+    }
+    return merged;
+}
+
+/*!
+ * @note zero the bytes of image not from file,and read the parts
+ *       of ranges not aligned to sector through the cache.
+ *       it runs after the first requests are queued,so it overlaps
+ *       with the read of aligned parts.
+ * @warning must hold entry`s read lock.
+ */
+static void _elf_image_fill(elf_file_t * elf, byte * image, const elf_range_t * ranges, uint32_t range_cnt, uint32_t sec_size){
+    elf64_addr_t const base = elf64_image_base(elf);
+    elf64_addr_t cursor = base;
+    for(uint32_t i = 0;i<elf->seg_cnt;i++){
+        const elf_seg_t * seg = &elf->segs[i];
+        memset(image+(cursor-base),0,seg->vaddr-cursor);
+        memset(image+(seg->vaddr+seg->filesz-base),0,seg->mem_end-seg->vaddr-seg->filesz);
+        cursor = seg->mem_end;
+    }
+    memset(image+(cursor-base),0,base+elf64_image_size(elf)-cursor);
+    for(uint32_t i = 0;i<range_cnt;i++){
+        elf64_off_t const start = ranges[i].offset;
+        elf64_off_t const end = start+ranges[i].size;
+        elf64_off_t const mid_start = (start+sec_size-1)&~(elf64_off_t)(sec_size-1);
+        elf64_off_t const mid_end = end&~(elf64_off_t)(sec_size-1);
+        if(mid_start>=mid_end){
+            entry_rw(elf->entry,ranges[i].dest,start,ranges[i].size,false);
+            continue;
+        }
+        if(start<mid_start){
+            entry_rw(elf->entry,ranges[i].dest,start,mid_start-start,false);
+        }
+        if(mid_end<end){
+            entry_rw(elf->entry,ranges[i].dest+(mid_end-start),mid_end,end-mid_end,false);
+        }
+    }
+}
+
+static int _elf_req_cmp(const void * a, const void * b){
+    uint32_t sec_a = (*(fs_io_req_t * const *)a)->select_no;
+    uint32_t sec_b = (*(fs_io_req_t * const *)b)->select_no;
+    return sec_a<sec_b?-1:sec_a>sec_b;
+}
+
+/*!
+ * @note read all segments to image at once,for the program
+ *       which needs whole binary up front.
+ *       the file ranges of segments are merged and mapped to
+ *       extents of sectors with one chain walk each,and the
+ *       extents are read directly to image by async requests
+ *       in sector order. the bss and the unaligned heads and
+ *       tails of ranges are done while the first requests are
+ *       in flight,the cache reads of them reap only their own
+ *       requests. the entry`s read lock is held through the
+ *       load,so the mapped extents are not moved by defrag.
+ * @param elf : an opened file.
+ * @param image : elf64_image_size bytes aligned to page,
+ *                the segment at vaddr is put at
+ *                image+vaddr-elf64_image_base.
+ * @return false when fail to read,or the file is shrunk
+ *         after it is opened.
+ */
+bool elf64_image_load(elf_file_t * elf, void * image){
+    ASSERT(elf!=NULL&&elf->ref_cnt>0,"elf file is not opened!\n");
+    fs_t * fs = elf->entry->fs;
+    int const dev_no = fs->dev_no;
+    uint32_t const sec_size = fs->bpb.byts_per_sec;
+    elf_range_t ranges[CONFIG_ELF64_SEG_MAX];
+    uint32_t const range_cnt = _elf_image_ranges(elf,image,ranges);
+    uint32_t sec_cnt = 0;
+    for(uint32_t i = 0;i<range_cnt;i++){
+        sec_cnt+=ranges[i].size/sec_size+1;
+    }
+    entry_extent_t * extents = malloc(sec_cnt*sizeof(entry_extent_t));
+    fs_io_req_t * reqs = malloc(sec_cnt*sizeof(fs_io_req_t));
+    fs_io_req_t ** req_ptrs = malloc(sec_cnt*sizeof(fs_io_req_t *));
+    if(extents == NULL||reqs == NULL||req_ptrs == NULL){
+        free(extents);
+        free(reqs);
+        free(req_ptrs);
+        return false;
+    }
+    entry_t * entry = entry_get_read(elf->entry);
+    if(entry->file_size<elf->file_size){
+        entry_put_read(entry);
+        free(extents);
+        free(reqs);
+        free(req_ptrs);
+        return false;
+    }
+    // map the aligned middle of ranges,the parts not mapped are read by cache.
+    uint32_t req_cnt = 0;
+    uint32_t min_sec = BLOCK_NO_ERROR;
+    uint32_t max_sec = 0;
+    for(uint32_t i = 0;i<range_cnt;i++){
+        elf64_off_t const start = ranges[i].offset;
+        elf64_off_t const mid_start = (start+sec_size-1)&~(elf64_off_t)(sec_size-1);
+        elf64_off_t const mid_end = (start+ranges[i].size)&~(elf64_off_t)(sec_size-1);
+        if(mid_start>=mid_end){
+            continue;
+        }
+        uint32_t cnt = entry_extent_map(entry,mid_start,mid_end-mid_start,extents,sec_cnt);
+        elf64_off_t mapped_end = mid_start;
+        for(uint32_t k = 0;k<cnt;k++){
+            fs_io_req_t * req = &reqs[req_cnt];
+            req->buffer = ranges[i].dest+(extents[k].offset-start);
+            req->select_no = extents[k].sec;
+            req->select_cnt = extents[k].sec_cnt;
+            req->write = false;
+            req->result = 0;
+            req->data = NULL;
+            req_ptrs[req_cnt++] = req;
+            mapped_end = extents[k].offset+(elf64_off_t)extents[k].sec_cnt*sec_size;
+            min_sec = extents[k].sec<min_sec?extents[k].sec:min_sec;
+            max_sec = extents[k].sec+extents[k].sec_cnt>max_sec?extents[k].sec+extents[k].sec_cnt:max_sec;
+        }
+        if(mapped_end<mid_end){
+            entry_rw(entry,ranges[i].dest+(mapped_end-start),mapped_end,mid_end-mapped_end,false);
+        }
+    }
+    free(extents);
+    qsort(req_ptrs,req_cnt,sizeof(fs_io_req_t *),_elf_req_cmp);
+    if(req_cnt>0){
+        // the device is read directly,so the newer data in cache is written first.
+        block_flush_range(min_sec,max_sec-min_sec,dev_no);
+    }
+    bool ok = true;
+    bool filled = false;
+    uint32_t submitted = 0;
+    uint32_t in_flight = 0;
+    while(submitted<req_cnt||in_flight>0){
+        while(submitted<req_cnt&&in_flight<CONFIG_FS_AIO_DEPTH){
+            fs_io_req_t * req = req_ptrs[submitted];
+            byte * mapped = fs_stub_source_map(dev_no,req->select_no);
+            if(mapped!=NULL){
+                // no I/O needed for mapped device.
+                memcpy(req->buffer,mapped,(size_t)req->select_cnt*sec_size);
+                submitted++;
+                continue;
+            }
+            uint32_t cnt = req_cnt-submitted;
+            if(cnt>CONFIG_FS_AIO_DEPTH-in_flight){
+                cnt = CONFIG_FS_AIO_DEPTH-in_flight;
+            }
+            uint32_t queued = fs_stub_source_submit(dev_no,reqs,&req_ptrs[submitted],cnt);
+            if(queued == 0){
+                if(in_flight>0){
+                    break;
+                }
+                // nothing in flight,engine can`t take it.
+                for(uint32_t k = 0;k<req->select_cnt;k++){
+                    read_select(dev_no,(byte *)req->buffer+(size_t)k*sec_size,req->select_no+k);
+                }
+                submitted++;
+                continue;
+            }
+            submitted+=queued;
+            in_flight+=queued;
+        }
+        if(!filled){
+            _elf_image_fill(elf,image,ranges,range_cnt,sec_size);
+            filled = true;
+        }
+        if(in_flight == 0){
+            continue;
+        }
+        fs_io_req_t * done[CONFIG_FS_AIO_DEPTH];
+        uint32_t reaped = fs_stub_source_reap(dev_no,reqs,done,CONFIG_FS_AIO_DEPTH,1);
+        for(uint32_t k = 0;k<reaped;k++){
+            if(done[k]->result!=(int)(done[k]->select_cnt*sec_size)){
+                ok = false;
+            }
+        }
+        in_flight-=reaped;
+    }
+    if(!filled){
+        _elf_image_fill(elf,image,ranges,range_cnt,sec_size);
+    }
+    entry_put_read(entry);
+    free(reqs);
+    free(req_ptrs);
+    return ok;
+}
+
+/*!
+ * @note copy a range of file to a new buffer.
+ * @warning must hold entry`s read lock.
+ * @param extra : bytes of zero appended to buffer.
+ * @return NULL when range is out of file.
+ */
+static void * _elf_read_alloc(elf_file_t * elf, elf64_off_t offset, elf64_xword_t size, uint32_t extra){
+    if(offset>elf->file_size||size>elf->file_size-offset){
+        return NULL;
+    }
+    byte * buffer = malloc(size+extra);
+    if(buffer == NULL){
+        return NULL;
+    }
+    if(size>0){
+        entry_rw(elf->entry,buffer,offset,size,false);
+    }
+    memset(buffer+size,0,extra);
+    return buffer;
+}
+
+/*!
+ * @note get file offset of the range [vaddr,vaddr+size) in a segment.
+ * @return false when the range is not in file part of any segment.
+ */
+static bool _elf_offset_of_vaddr(elf_file_t * elf, elf64_addr_t vaddr, elf64_xword_t size, elf64_off_t * offset){
+    const elf_seg_t * seg = elf64_seg_of(elf,vaddr);
+    if(seg == NULL||vaddr-seg->vaddr>seg->filesz||size>seg->filesz-(vaddr-seg->vaddr)){
+        return false;
+    }
+    *offset = seg->offset+(vaddr-seg->vaddr);
+    return true;
+}
+
+/*!
+ * @note load dynamic symbols and .gnu.hash or DT_HASH
+ *       found by PT_DYNAMIC.
+ * @return false when there is no hash table.
+ */
+static bool _elf_symidx_hash_build(elf_file_t * elf, elf_symidx_t * symidx){
+    if(elf->dyn_size == 0){
+        return false;
+    }
+    elf64_dyn_t * dyns = _elf_read_alloc(elf,elf->dyn_offset,elf->dyn_size,0);
+    if(dyns == NULL){
+        return false;
+    }
+    elf64_addr_t gnu_hash = 0;
+    elf64_addr_t hash = 0;
+    elf64_addr_t symtab = 0;
+    elf64_addr_t strtab = 0;
+    elf64_xword_t strsz = 0;
+    elf64_xword_t syment = sizeof(elf64_sym_t);
+    for(uint32_t i = 0;i<elf->dyn_size/sizeof(elf64_dyn_t)&&dyns[i].tag!=ELF64_DT_NULL;i++){
+        switch(dyns[i].tag){
+            case ELF64_DT_GNU_HASH:
+                gnu_hash = dyns[i].val;
+                break;
+            case ELF64_DT_HASH:
+                hash = dyns[i].val;
+                break;
+            case ELF64_DT_SYMTAB:
+                symtab = dyns[i].val;
+                break;
+            case ELF64_DT_STRTAB:
+                strtab = dyns[i].val;
+                break;
+            case ELF64_DT_STRSZ:
+                strsz = dyns[i].val;
+                break;
+            case ELF64_DT_SYMENT:
+                syment = dyns[i].val;
+                break;
+            default:
+                break;
+        }
+    }
+    free(dyns);
+    elf64_off_t offset;
+    if((gnu_hash == 0&&hash == 0)||symtab == 0||strtab == 0||syment!=sizeof(elf64_sym_t)){
+        return false;
+    }
+    if(!_elf_offset_of_vaddr(elf,strtab,strsz,&offset)||
+       (symidx->strs = _elf_read_alloc(elf,offset,strsz,1)) == NULL){
+        return false;
+    }
+    symidx->str_size = strsz;
+    if(gnu_hash!=0){
+        uint32_t head[4];   // bucket cnt,sym offset,bloom cnt,bloom shift
+        if(!_elf_offset_of_vaddr(elf,gnu_hash,sizeof(head),&offset)){
+            return false;
+        }
+        entry_rw(elf->entry,head,offset,sizeof(head),false);
+        symidx->bucket_cnt = head[0];
+        symidx->sym_offset = head[1];
+        symidx->bloom_cnt = head[2];
+        symidx->bloom_shift = head[3];
+        if(symidx->bucket_cnt == 0||symidx->bloom_cnt == 0||(symidx->bloom_cnt&(symidx->bloom_cnt-1))!=0){
+            return false;
+        }
+        elf64_xword_t bloom_size = (elf64_xword_t)symidx->bloom_cnt*sizeof(elf64_xword_t);
+        elf64_xword_t bucket_size = (elf64_xword_t)symidx->bucket_cnt*sizeof(uint32_t);
+        if(!_elf_offset_of_vaddr(elf,gnu_hash,sizeof(head)+bloom_size+bucket_size,&offset)){
+            return false;
+        }
+        symidx->bloom = _elf_read_alloc(elf,offset+sizeof(head),bloom_size,0);
+        symidx->buckets = _elf_read_alloc(elf,offset+sizeof(head)+bloom_size,bucket_size,0);
+        if(symidx->bloom == NULL||symidx->buckets == NULL){
+            return false;
+        }
+        // count of symbols is the end of the last chain.
+        elf64_off_t const chain_offset = offset+sizeof(head)+bloom_size+bucket_size;
+        uint32_t sym_cnt = symidx->sym_offset;
+        for(uint32_t i = 0;i<symidx->bucket_cnt;i++){
+            if(symidx->buckets[i]>=sym_cnt){
+                sym_cnt = symidx->buckets[i]+1;
+            }
+        }
+        if(sym_cnt>symidx->sym_offset){
+            for(uint32_t value = 0;;sym_cnt++){
+                elf64_off_t at = chain_offset+(elf64_off_t)(sym_cnt-1-symidx->sym_offset)*sizeof(uint32_t);
+                if(at+sizeof(uint32_t)>elf->file_size){
+                    return false;
+                }
+                entry_rw(elf->entry,&value,at,sizeof(uint32_t),false);
+                if(value&1){
+                    break;
+                }
+            }
+            symidx->chains = _elf_read_alloc(elf,chain_offset,(elf64_xword_t)(sym_cnt-symidx->sym_offset)*sizeof(uint32_t),0);
+            if(symidx->chains == NULL){
+                return false;
+            }
+        }
+        symidx->sym_cnt = sym_cnt;
+        symidx->kind = ELF_SYMIDX_GNU_HASH;
+    }
+    else{
+        uint32_t head[2];   // bucket cnt,chain cnt
+        if(!_elf_offset_of_vaddr(elf,hash,sizeof(head),&offset)){
+            return false;
+        }
+        entry_rw(elf->entry,head,offset,sizeof(head),false);
+        symidx->bucket_cnt = head[0];
+        symidx->sym_cnt = head[1];
+        if(symidx->bucket_cnt == 0){
+            return false;
+        }
+        symidx->buckets = _elf_read_alloc(elf,offset+sizeof(head),(elf64_xword_t)head[0]*sizeof(uint32_t),0);
+        symidx->chains = _elf_read_alloc(elf,offset+sizeof(head)+(elf64_xword_t)head[0]*sizeof(uint32_t),
+                                         (elf64_xword_t)head[1]*sizeof(uint32_t),0);
+        if(symidx->buckets == NULL||symidx->chains == NULL){
+            return false;
+        }
+        symidx->kind = ELF_SYMIDX_HASH;
+    }
+    elf64_xword_t const syms_size = (elf64_xword_t)symidx->sym_cnt*sizeof(elf64_sym_t);
+    if(!_elf_offset_of_vaddr(elf,symtab,syms_size,&offset)||
+       (symidx->syms = _elf_read_alloc(elf,offset,syms_size,0)) == NULL){
+        symidx->kind = ELF_SYMIDX_NONE;
+        return false;
+    }
+    return true;
+}
+
+static int _elf_sym_name_cmp(const void * a, const void * b){
+    return strcmp(((const elf_sym_name_t *)a)->name,((const elf_sym_name_t *)b)->name);
+}
+
+/*!
+ * @note load .symtab,or .dynsym when it is stripped,
+ *       and sort the names of defined symbols.
+ */
+static bool _elf_symidx_sorted_build(elf_file_t * elf, elf_symidx_t * symidx){
+    if(elf->ehdr.shnum == 0||elf->ehdr.shentsize!=sizeof(elf64_shdr_t)){
+        return false;
+    }
+    elf64_shdr_t * shdrs = _elf_read_alloc(elf,elf->ehdr.shoff,(elf64_xword_t)elf->ehdr.shnum*sizeof(elf64_shdr_t),0);
+    if(shdrs == NULL){
+        return false;
+    }
+    elf64_shdr_t * symtab = NULL;
+    for(uint32_t i = 0;i<elf->ehdr.shnum;i++){
+        if(shdrs[i].type == ELF64_SHT_SYMTAB||(shdrs[i].type == ELF64_SHT_DYNSYM&&symtab == NULL)){
+            symtab = &shdrs[i];
+        }
+    }
+    bool ret = symtab!=NULL&&symtab->entsize == sizeof(elf64_sym_t)&&symtab->link<elf->ehdr.shnum;
+    if(ret){
+        elf64_shdr_t * strtab = &shdrs[symtab->link];
+        symidx->sym_cnt = symtab->size/sizeof(elf64_sym_t);
+        symidx->syms = _elf_read_alloc(elf,symtab->offset,(elf64_xword_t)symidx->sym_cnt*sizeof(elf64_sym_t),0);
+        symidx->strs = _elf_read_alloc(elf,strtab->offset,strtab->size,1);
+        symidx->str_size = strtab->size;
+        symidx->sorted = malloc((elf64_xword_t)symidx->sym_cnt*sizeof(elf_sym_name_t)+1);
+        ret = symidx->syms!=NULL&&symidx->strs!=NULL&&symidx->sorted!=NULL;
+    }
+    free(shdrs);
+    if(!ret){
+        return false;
+    }
+    symidx->sorted_cnt = 0;
+    for(uint32_t i = 0;i<symidx->sym_cnt;i++){
+        elf64_sym_t * sym = &symidx->syms[i];
+        if(sym->shndx!=ELF64_SHN_UNDEF&&sym->name!=0&&sym->name<symidx->str_size){
+            symidx->sorted[symidx->sorted_cnt].name = symidx->strs+sym->name;
+            symidx->sorted[symidx->sorted_cnt].index = i;
+            symidx->sorted_cnt++;
+        }
+    }
+    qsort(symidx->sorted,symidx->sorted_cnt,sizeof(elf_sym_name_t),_elf_sym_name_cmp);
+    symidx->kind = ELF_SYMIDX_SORTED;
+    return true;
+}
+
+/*!
+ * @note build symbol index of file under entry`s read lock,
+ *       the hash tables are used when there are. the index
+ *       built before is replaced and kept as stale one.
+ * @warning must hold elf`s write lock.
+ */
+static void _elf_symidx_build(elf_file_t * elf){
+    elf_symidx_t symidx;
+    memset(&symidx,0,sizeof(elf_symidx_t));
+    entry_t * entry = entry_get_read(elf->entry);
+    // a shrunk file has no symbol,the tables may be out of it.
+    if(entry->file_size>=elf->file_size&&!_elf_symidx_hash_build(elf,&symidx)){
+        _elf_symidx_free(&symidx);
+        if(!_elf_symidx_sorted_build(elf,&symidx)){
+            _elf_symidx_free(&symidx);
+        }
+    }
+    symidx.write_stamp = entry->write_stamp;
+    entry_put_read(entry);
+    symidx.built = true;
+    if(elf->symidx.built){
+        // the symbols got from old one may be used by others.
+        elf_symidx_t * stale = malloc(sizeof(elf_symidx_t));
+        if(stale == NULL){
+            _elf_symidx_free(&symidx);
+            return;
+        }
+        *stale = elf->symidx;
+        symidx.stale = stale;
+    }
+    elf->symidx = symidx;
+}
+
+/*!
+ * @return true when the index is not built,or the file
+ *         is written after it is built.
+ * @warning must hold elf`s lock.
+ */
+static inline bool _elf_symidx_stale(elf_file_t * elf){
+    return !elf->symidx.built||elf->symidx.write_stamp!=__atomic_load_n(&elf->entry->write_stamp,__ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t _elf_gnu_hash(const char * name){
+    uint32_t h = 5381;
+    for(;*name!='\0';name++){
+        h = (h<<5)+h+(byte)*name;
+    }
+    return h;
+}
+
+static inline uint32_t _elf_sysv_hash(const char * name){
+    uint32_t h = 0;
+    for(;*name!='\0';name++){
+        h = (h<<4)+(byte)*name;
+        uint32_t g = h&0xF0000000;
+        if(g!=0){
+            h^=g>>24;
+        }
+        h&=~g;
+    }
+    return h;
+}
+
+static inline bool _elf_sym_match(elf_symidx_t * symidx, uint32_t index, const char * name){
+    elf64_sym_t * sym = &symidx->syms[index];
+    return sym->shndx!=ELF64_SHN_UNDEF&&sym->name<symidx->str_size&&strcmp(symidx->strs+sym->name,name) == 0;
+}
+
+static const elf64_sym_t * _elf_gnu_hash_lookup(elf_symidx_t * symidx, const char * name){
+    uint32_t const h = _elf_gnu_hash(name);
+    // bloom filter rejects most of missing names with one word.
+    elf64_xword_t const word = symidx->bloom[(h/64)&(symidx->bloom_cnt-1)];
+    elf64_xword_t const mask = (1ULL<<(h%64))|(1ULL<<((h>>symidx->bloom_shift)%64));
+    if((word&mask)!=mask){
+        return NULL;
+    }
+    uint32_t index = symidx->buckets[h%symidx->bucket_cnt];
+    if(index<symidx->sym_offset){
+        return NULL;
+    }
+    for(;index<symidx->sym_cnt;index++){
+        uint32_t const chain_h = symidx->chains[index-symidx->sym_offset];
+        if((chain_h|1) == (h|1)&&_elf_sym_match(symidx,index,name)){
+            return &symidx->syms[index];
+        }
+        if(chain_h&1){
+            break;
+        }
+    }
+    return NULL;
+}
+
+static const elf64_sym_t * _elf_hash_lookup(elf_symidx_t * symidx, const char * name){
+    uint32_t index = symidx->buckets[_elf_sysv_hash(name)%symidx->bucket_cnt];
+    // the chain is limited by count of symbols,so a bad table can`t loop forever.
+    for(uint32_t step = 0;index!=0&&index<symidx->sym_cnt&&step<symidx->sym_cnt;step++){
+        if(_elf_sym_match(symidx,index,name)){
+            return &symidx->syms[index];
+        }
+        index = symidx->chains[index];
+    }
+    return NULL;
+}
+
+static const elf64_sym_t * _elf_sorted_lookup(elf_symidx_t * symidx, const char * name){
+    uint32_t low = 0;
+    uint32_t high = symidx->sorted_cnt;
+    while(low<high){
+        uint32_t mid = (low+high)/2;
+        int cmp = strcmp(symidx->sorted[mid].name,name);
+        if(cmp == 0){
+            return &symidx->syms[symidx->sorted[mid].index];
+        }
+        if(cmp<0){
+            low = mid+1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+static const elf64_sym_t * _elf_symidx_lookup(elf_symidx_t * symidx, const char * name){
+    switch(symidx->kind){
+        case ELF_SYMIDX_GNU_HASH:
+            return _elf_gnu_hash_lookup(symidx,name);
+        case ELF_SYMIDX_HASH:
+            return _elf_hash_lookup(symidx,name);
+        case ELF_SYMIDX_SORTED:
+            return _elf_sorted_lookup(symidx,name);
+        default:
+            return NULL;
+    }
+}
+
+/*!
+ * @note find a defined symbol by name.
+ *       the symbol index is built at first lookup of file,
+ *       rebuilt at the lookup after the file is written,
+ *       and kept after the file closed,it is one of:
+ *       .gnu.hash with bloom filter,DT_HASH,or the sorted
+ *       names of .symtab when there is no hash table.
+ * @param elf : an opened file.
+ * @param name
+ * @return NULL when not found. the symbol is valid
+ *         until the file is closed by all openers.
+ */
+const elf64_sym_t * elf64_sym_lookup(elf_file_t * elf, const char * name){
+    ASSERT(elf!=NULL&&elf->ref_cnt>0,"elf file is not opened!\n");
+    const elf64_sym_t * sym;
+    fs_stub_rw_r_lock_acquire(&elf->rw_lock);
+    if(!_elf_symidx_stale(elf)){
+        sym = _elf_symidx_lookup(&elf->symidx,name);
+        fs_stub_rw_r_lock_release(&elf->rw_lock);
+        return sym;
+    }
+    fs_stub_rw_r_lock_release(&elf->rw_lock);
+    fs_stub_rw_w_lock_acquire(&elf->rw_lock);
+    if(_elf_symidx_stale(elf)){
+        _elf_symidx_build(elf);
+    }
+    sym = _elf_symidx_lookup(&elf->symidx,name);
+    fs_stub_rw_w_lock_release(&elf->rw_lock);
+    return sym;
+}
+
+const char * elf64_sym_name(elf_file_t * elf, const elf64_sym_t * sym){
+    fs_stub_rw_r_lock_acquire(&elf->rw_lock);
+    // the symbol may be got from a stale index.
+    elf_symidx_t * symidx = &elf->symidx;
+    while(symidx!=NULL&&(sym<symidx->syms||sym>=symidx->syms+symidx->sym_cnt)){
+        symidx = symidx->stale;
+    }
+    const char * name = symidx!=NULL&&sym->name<symidx->str_size?symidx->strs+sym->name:"";
+    fs_stub_rw_r_lock_release(&elf->rw_lock);
+    return name;
+}
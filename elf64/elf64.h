@@ -5,10 +5,184 @@
 #ifndef OPENBHOS_FS_ELF64_H
 #define OPENBHOS_FS_ELF64_H
 
+#include "../fs/fat32.h"
+
+#define CONFIG_ELF64_FILE_CNT 16
+#define CONFIG_ELF64_SEG_MAX 16
+#define CONFIG_ELF64_PHDR_MAX 64
+#define ELF64_PAGE_SIZE 4096
+
+#define ELF64_ET_EXEC 2
+#define ELF64_ET_DYN 3
+#define ELF64_PT_LOAD 1
+#define ELF64_PT_DYNAMIC 2
+#define ELF64_PF_X 0x1
+#define ELF64_PF_W 0x2
+#define ELF64_PF_R 0x4
+#define ELF64_SHT_SYMTAB 2
+#define ELF64_SHT_DYNSYM 11
+#define ELF64_SHN_UNDEF 0
+#define ELF64_DT_NULL 0
+#define ELF64_DT_HASH 4
+#define ELF64_DT_STRTAB 5
+#define ELF64_DT_SYMTAB 6
+#define ELF64_DT_STRSZ 10
+#define ELF64_DT_SYMENT 11
+#define ELF64_DT_GNU_HASH 0x6FFFFEF5
+
+typedef unsigned long long elf64_addr_t;
+typedef unsigned long long elf64_off_t;
+typedef unsigned long long elf64_xword_t;
+
 typedef
-struct{
+struct {
+    byte ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    elf64_addr_t entry;
+    elf64_off_t phoff;
+    elf64_off_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} elf64_ehdr_t;
+
+typedef
+struct {
+    uint32_t type;
+    uint32_t flags;
+    elf64_off_t offset;
+    elf64_addr_t vaddr;
+    elf64_addr_t paddr;
+    elf64_xword_t filesz;
+    elf64_xword_t memsz;
+    elf64_xword_t align;
+} elf64_phdr_t;
+
+typedef
+struct {
+    uint32_t name;
+    uint32_t type;
+    elf64_xword_t flags;
+    elf64_addr_t addr;
+    elf64_off_t offset;
+    elf64_xword_t size;
+    uint32_t link;
+    uint32_t info;
+    elf64_xword_t addralign;
+    elf64_xword_t entsize;
+} elf64_shdr_t;
 
+typedef
+struct {
+    uint32_t name;      // offset in string table.
+    uint8_t info;
+    uint8_t other;
+    uint16_t shndx;
+    elf64_addr_t value;
+    elf64_xword_t size;
+} elf64_sym_t;
+
+typedef
+struct {
+    long long tag;
+    elf64_xword_t val;
+} elf64_dyn_t;
+
+/*!
+ * @note a PT_LOAD segment,the bytes in [vaddr+filesz,mem_end) are zero.
+ */
+typedef
+struct {
+    elf64_addr_t vaddr;
+    elf64_addr_t mem_end;
+    elf64_off_t offset;
+    elf64_xword_t filesz;
+    uint32_t flags;     // ELF64_PF_*
+} elf_seg_t;
+
+typedef
+enum {
+    ELF_SYMIDX_NONE,        // no symbol table.
+    ELF_SYMIDX_GNU_HASH,    // .gnu.hash of dynamic symbols.
+    ELF_SYMIDX_HASH,        // DT_HASH of dynamic symbols.
+    ELF_SYMIDX_SORTED,      // names of .symtab or .dynsym sorted.
+} elf_symidx_kind_t;
+
+typedef
+struct {
+    const char * name;
+    uint32_t index;
+} elf_sym_name_t;
+
+/*!
+ * @note symbol index of a file,built at first lookup.
+ *       the tables are copied from file to memory.
+ */
+typedef
+struct elf_symidx_s{
+    bool built;
+    uint32_t write_stamp;   // of file entry when it is built.
+    struct elf_symidx_s * stale;    // the replaced ones,the symbols got from them are kept until file is closed by all.
+    elf_symidx_kind_t kind;
+    elf64_sym_t * syms;
+    uint32_t sym_cnt;
+    char * strs;            // ended with an extra '\0'.
+    uint32_t str_size;
+    uint32_t bucket_cnt;
+    uint32_t * buckets;
+    uint32_t * chains;      // GNU hash: from sym_offset.
+    uint32_t sym_offset;    // GNU hash: index of first hashed symbol.
+    uint32_t bloom_cnt;
+    uint32_t bloom_shift;
+    elf64_xword_t * bloom;
+    elf_sym_name_t * sorted;
+    uint32_t sorted_cnt;
+} elf_symidx_t;
+
+/*!
+ * @note an ELF file,the segments are sorted by vaddr.
+ *       the pages are read from file when they are touched,
+ *       so a ref of file entry is held while it is opened,
+ *       and it`s lock is taken by each read only. the file
+ *       can be written and moved by others between reads,
+ *       and the symbol index is rebuilt after it is written.
+ *       a closed file keeps it`s headers and symbol index
+ *       in table,and they are reused by next open of same file.
+ */
+typedef
+struct{
+    bool used;
+    uint32_t ref_cnt;       // count of openers,0 when it is cached only.
+    uint32_t stamp;         // time of last open.
+    entry_t * entry;        // pinned without lock,NULL when it is cached only.
+    fs_t * fs;
+    uint32_t first_clus_no;
+    uint32_t file_size;
+    elf64_ehdr_t ehdr;
+    uint32_t seg_cnt;
+    elf_seg_t segs[CONFIG_ELF64_SEG_MAX];
+    elf64_off_t dyn_offset;
+    elf64_xword_t dyn_size;
+    rw_lock_t rw_lock;
+    elf_symidx_t symidx;
 }elf_file_t;
 
+void elf64_module_init();
+elf_file_t * elf64_open(fs_t * fs, const char * path);
+void elf64_close(elf_file_t * elf);
+const elf_seg_t * elf64_seg_of(elf_file_t * elf, elf64_addr_t vaddr);
+bool elf64_page_load(elf_file_t * elf, elf64_addr_t vaddr, void * page, uint32_t * flags);
+elf64_addr_t elf64_image_base(elf_file_t * elf);
+elf64_xword_t elf64_image_size(elf_file_t * elf);
+bool elf64_image_load(elf_file_t * elf, void * image);
+const elf64_sym_t * elf64_sym_lookup(elf_file_t * elf, const char * name);
+const char * elf64_sym_name(elf_file_t * elf, const elf64_sym_t * sym);
+void elf64_cache_drop(fs_t * fs);
 
-#endif //OPENBHOS_FS_ELF64_H
\ No newline at end of file
+#endif //OPENBHOS_FS_ELF64_H
@@ -0,0 +1,460 @@
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+#include "aio.h"
+
+#if CONFIG_FS_AIO_IO_URING && defined(__linux__)
+#include "linux/io_uring.h"
+#define AIO_HAVE_IO_URING 1
+#else
+#define AIO_HAVE_IO_URING 0
+#endif
+
+struct aio_engine{
+    int fd;
+    uint32_t select_size;
+    uint32_t depth;
+    uint32_t inflight;
+    aio_backend_t backend;
+#if AIO_HAVE_IO_URING
+    // io_uring
+    pthread_mutex_t sq_lock;
+    pthread_mutex_t cq_lock;
+    int ring_fd;
+    void * sq_ptr;
+    size_t sq_size;
+    void * cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe * sqes;
+    size_t sqes_size;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+#endif
+    // thread pool
+    pthread_t workers[CONFIG_FS_AIO_WORKER_CNT];
+    pthread_mutex_t mutex;
+    pthread_cond_t submit_cond;
+    pthread_cond_t complete_cond;
+    fs_io_req_t ** submit_queue;
+    uint32_t submit_head;
+    uint32_t submit_cnt;
+    fs_io_req_t ** complete_queue;
+    uint32_t complete_head;
+    uint32_t complete_cnt;
+    bool stop;
+};
+
+/*!
+ * @note do a request synchronously.
+ * @return count of bytes or -errno.
+ */
+static int _aio_do_req(aio_engine_t * engine, fs_io_req_t * req){
+    size_t length = (size_t)req->select_cnt * engine->select_size;
+    off_t offset = (off_t)req->select_no * engine->select_size;
+    size_t done = 0;
+    while(done<length){
+        ssize_t ret;
+        if(req->write){
+            ret = pwrite(engine->fd,(byte *)req->buffer+done,length-done,offset+done);
+        }
+        else{
+            ret = pread(engine->fd,(byte *)req->buffer+done,length-done,offset+done);
+        }
+        if(ret<0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -errno;
+        }
+        if(ret == 0){
+            break;
+        }
+        done+=ret;
+    }
+    return (int)done;
+}
+
+#if AIO_HAVE_IO_URING
+/*!
+ * @note check the ops used by requests are supported,
+ *       the kernels before IORING_OP_READ and IORING_OP_WRITE
+ *       create the ring but fail every request with -EINVAL.
+ */
+static bool _uring_probe(int ring_fd){
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe * probe = malloc(size);
+    if(probe == NULL){
+        return false;
+    }
+    memset(probe,0,size);
+    bool supported = false;
+    if(syscall(__NR_io_uring_register,ring_fd,IORING_REGISTER_PROBE,probe,IORING_OP_LAST)>=0
+       &&probe->last_op>=IORING_OP_WRITE&&probe->last_op>=IORING_OP_READ){
+        supported = (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+                &&(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+static bool _uring_init(aio_engine_t * engine){
+    struct io_uring_params params;
+    memset(&params,0,sizeof(params));
+    int ring_fd = (int)syscall(__NR_io_uring_setup,engine->depth,&params);
+    if(ring_fd<0){
+        return false;
+    }
+    if(!_uring_probe(ring_fd)){
+        // fall back to thread pool.
+        close(ring_fd);
+        return false;
+    }
+    engine->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    engine->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(engine->cq_size>engine->sq_size){
+            engine->sq_size = engine->cq_size;
+        }
+        engine->cq_size = engine->sq_size;
+    }
+    engine->sq_ptr = mmap(NULL,engine->sq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQ_RING);
+    if(engine->sq_ptr == MAP_FAILED){
+        close(ring_fd);
+        return false;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        engine->cq_ptr = engine->sq_ptr;
+    }
+    else{
+        engine->cq_ptr = mmap(NULL,engine->cq_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_CQ_RING);
+        if(engine->cq_ptr == MAP_FAILED){
+            munmap(engine->sq_ptr,engine->sq_size);
+            close(ring_fd);
+            return false;
+        }
+    }
+    engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    engine->sqes = mmap(NULL,engine->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQES);
+    if(engine->sqes == MAP_FAILED){
+        if(engine->cq_ptr!=engine->sq_ptr){
+            munmap(engine->cq_ptr,engine->cq_size);
+        }
+        munmap(engine->sq_ptr,engine->sq_size);
+        close(ring_fd);
+        return false;
+    }
+    engine->sq_tail = (unsigned *)((byte *)engine->sq_ptr + params.sq_off.tail);
+    engine->sq_mask = (unsigned *)((byte *)engine->sq_ptr + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned *)((byte *)engine->sq_ptr + params.sq_off.array);
+    engine->cq_head = (unsigned *)((byte *)engine->cq_ptr + params.cq_off.head);
+    engine->cq_tail = (unsigned *)((byte *)engine->cq_ptr + params.cq_off.tail);
+    engine->cq_mask = (unsigned *)((byte *)engine->cq_ptr + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *)((byte *)engine->cq_ptr + params.cq_off.cqes);
+    if(engine->depth>params.sq_entries){
+        engine->depth = params.sq_entries;
+    }
+    engine->ring_fd = ring_fd;
+    pthread_mutex_init(&engine->sq_lock,NULL);
+    pthread_mutex_init(&engine->cq_lock,NULL);
+    return true;
+}
+
+static void _uring_destroy(aio_engine_t * engine){
+    munmap(engine->sqes,engine->sqes_size);
+    if(engine->cq_ptr!=engine->sq_ptr){
+        munmap(engine->cq_ptr,engine->cq_size);
+    }
+    munmap(engine->sq_ptr,engine->sq_size);
+    close(engine->ring_fd);
+    pthread_mutex_destroy(&engine->cq_lock);
+    pthread_mutex_destroy(&engine->sq_lock);
+}
+
+static uint32_t _uring_submit(aio_engine_t * engine, fs_io_req_t ** reqs, uint32_t cnt){
+    uint32_t submitted = 0;
+    pthread_mutex_lock(&engine->sq_lock);
+    unsigned tail = *engine->sq_tail;
+    // inflight is only decreased by reap,so the check holds until enter.
+    uint32_t inflight = __atomic_load_n(&engine->inflight,__ATOMIC_ACQUIRE);
+    for(;submitted<cnt&&inflight+submitted<engine->depth;submitted++,tail++){
+        fs_io_req_t * req = reqs[submitted];
+        unsigned index = tail & *engine->sq_mask;
+        struct io_uring_sqe * sqe = &engine->sqes[index];
+        memset(sqe,0,sizeof(*sqe));
+        sqe->opcode = req->write?IORING_OP_WRITE:IORING_OP_READ;
+        sqe->fd = engine->fd;
+        sqe->addr = (unsigned long)req->buffer;
+        sqe->len = req->select_cnt * engine->select_size;
+        sqe->off = (unsigned long long)req->select_no * engine->select_size;
+        sqe->user_data = (unsigned long long)(unsigned long)req;
+        engine->sq_array[index] = index;
+    }
+    if(submitted == 0){
+        pthread_mutex_unlock(&engine->sq_lock);
+        return 0;
+    }
+    __atomic_store_n(engine->sq_tail,tail,__ATOMIC_RELEASE);
+    uint32_t left = submitted;
+    while(left>0){
+        int ret = (int)syscall(__NR_io_uring_enter,engine->ring_fd,left,0,0,NULL,0);
+        if(ret<0){
+            if(errno == EINTR||errno == EAGAIN){
+                continue;
+            }
+            PANIC("io_uring submit fail!\n");
+        }
+        left-=ret;
+    }
+    __atomic_add_fetch(&engine->inflight,submitted,__ATOMIC_RELEASE);
+    pthread_mutex_unlock(&engine->sq_lock);
+    return submitted;
+}
+
+static uint32_t _uring_reap(aio_engine_t * engine, fs_io_req_t ** done, uint32_t max, uint32_t min){
+    uint32_t got = 0;
+    pthread_mutex_lock(&engine->cq_lock);
+    while(got<max){
+        unsigned head = *engine->cq_head;
+        unsigned tail = __atomic_load_n(engine->cq_tail,__ATOMIC_ACQUIRE);
+        if(head == tail){
+            if(got>=min||__atomic_load_n(&engine->inflight,__ATOMIC_ACQUIRE) == 0){
+                break;
+            }
+            int ret = (int)syscall(__NR_io_uring_enter,engine->ring_fd,0,min-got,IORING_ENTER_GETEVENTS,NULL,0);
+            if(ret<0&&errno!=EINTR&&errno!=EAGAIN){
+                PANIC("io_uring wait fail!\n");
+            }
+            continue;
+        }
+        struct io_uring_cqe * cqe = &engine->cqes[head & *engine->cq_mask];
+        fs_io_req_t * req = (fs_io_req_t *)(unsigned long)cqe->user_data;
+        req->result = cqe->res;
+        __atomic_store_n(engine->cq_head,head+1,__ATOMIC_RELEASE);
+        __atomic_sub_fetch(&engine->inflight,1,__ATOMIC_RELEASE);
+        done[got++] = req;
+    }
+    pthread_mutex_unlock(&engine->cq_lock);
+    return got;
+}
+#endif
+
+static void * _pool_worker(void * arg){
+    aio_engine_t * engine = arg;
+    pthread_mutex_lock(&engine->mutex);
+    for(;;){
+        while(!engine->stop&&engine->submit_cnt == 0){
+            pthread_cond_wait(&engine->submit_cond,&engine->mutex);
+        }
+        if(engine->submit_cnt == 0){
+            // stop
+            break;
+        }
+        fs_io_req_t * req = engine->submit_queue[engine->submit_head];
+        engine->submit_head = (engine->submit_head+1)%engine->depth;
+        engine->submit_cnt--;
+        pthread_mutex_unlock(&engine->mutex);
+        int result = _aio_do_req(engine,req);
+        pthread_mutex_lock(&engine->mutex);
+        req->result = result;
+        engine->complete_queue[(engine->complete_head+engine->complete_cnt)%engine->depth] = req;
+        engine->complete_cnt++;
+        pthread_cond_signal(&engine->complete_cond);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    return NULL;
+}
+
+/*!
+ * @note stop the workers and free the pool.
+ * @param worker_cnt : count of workers created.
+ */
+static void _pool_stop(aio_engine_t * engine, int worker_cnt){
+    pthread_mutex_lock(&engine->mutex);
+    engine->stop = true;
+    pthread_cond_broadcast(&engine->submit_cond);
+    pthread_mutex_unlock(&engine->mutex);
+    for(int i = 0;i<worker_cnt;i++){
+        pthread_join(engine->workers[i],NULL);
+    }
+    pthread_cond_destroy(&engine->complete_cond);
+    pthread_cond_destroy(&engine->submit_cond);
+    pthread_mutex_destroy(&engine->mutex);
+    free(engine->submit_queue);
+    free(engine->complete_queue);
+}
+
+static bool _pool_init(aio_engine_t * engine){
+    engine->submit_queue = malloc(sizeof(fs_io_req_t *) * engine->depth);
+    engine->complete_queue = malloc(sizeof(fs_io_req_t *) * engine->depth);
+    if(engine->submit_queue == NULL||engine->complete_queue == NULL){
+        free(engine->submit_queue);
+        free(engine->complete_queue);
+        return false;
+    }
+    engine->submit_head = 0;
+    engine->submit_cnt = 0;
+    engine->complete_head = 0;
+    engine->complete_cnt = 0;
+    engine->stop = false;
+    pthread_mutex_init(&engine->mutex,NULL);
+    pthread_cond_init(&engine->submit_cond,NULL);
+    pthread_cond_init(&engine->complete_cond,NULL);
+    for(int i = 0;i<CONFIG_FS_AIO_WORKER_CNT;i++){
+        if(pthread_create(&engine->workers[i],NULL,_pool_worker,engine)!=0){
+            // only the created workers are joined.
+            _pool_stop(engine,i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _pool_destroy(aio_engine_t * engine){
+    _pool_stop(engine,CONFIG_FS_AIO_WORKER_CNT);
+}
+
+static uint32_t _pool_submit(aio_engine_t * engine, fs_io_req_t ** reqs, uint32_t cnt){
+    uint32_t submitted = 0;
+    pthread_mutex_lock(&engine->mutex);
+    for(;submitted<cnt&&engine->inflight<engine->depth;submitted++){
+        engine->submit_queue[(engine->submit_head+engine->submit_cnt)%engine->depth] = reqs[submitted];
+        engine->submit_cnt++;
+        engine->inflight++;
+    }
+    pthread_cond_broadcast(&engine->submit_cond);
+    pthread_mutex_unlock(&engine->mutex);
+    return submitted;
+}
+
+static uint32_t _pool_reap(aio_engine_t * engine, fs_io_req_t ** done, uint32_t max, uint32_t min){
+    uint32_t got = 0;
+    pthread_mutex_lock(&engine->mutex);
+    while(got<max){
+        if(engine->complete_cnt == 0){
+            if(got>=min||engine->inflight == 0){
+                break;
+            }
+            pthread_cond_wait(&engine->complete_cond,&engine->mutex);
+            continue;
+        }
+        done[got++] = engine->complete_queue[engine->complete_head];
+        engine->complete_head = (engine->complete_head+1)%engine->depth;
+        engine->complete_cnt--;
+        engine->inflight--;
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    return got;
+}
+
+/*!
+ * @note create an async I/O engine for a file.
+ *       io_uring is used when it is supported,otherwise
+ *       a pool of worker threads do the I/O.
+ * @param fd : file descriptor of device image.
+ * @param select_size : bytes of a selector.
+ * @param depth : max count of requests in flight.
+ * @return engine or NULL when fail.
+ */
+aio_engine_t * aio_engine_create(int fd, uint32_t select_size, uint32_t depth){
+    aio_engine_t * engine = malloc(sizeof(aio_engine_t));
+    if(engine == NULL){
+        return NULL;
+    }
+    memset(engine,0,sizeof(aio_engine_t));
+    engine->fd = fd;
+    engine->select_size = select_size;
+    engine->depth = depth;
+    engine->inflight = 0;
+#if AIO_HAVE_IO_URING
+    if(_uring_init(engine)){
+        engine->backend = AIO_BACKEND_IO_URING;
+        return engine;
+    }
+#endif
+    if(_pool_init(engine)){
+        engine->backend = AIO_BACKEND_THREAD_POOL;
+        return engine;
+    }
+    free(engine);
+    return NULL;
+}
+
+/*!
+ * @warning all requests must be reaped before destroy.
+ */
+void aio_engine_destroy(aio_engine_t * engine){
+    if(engine == NULL){
+        return;
+    }
+#if AIO_HAVE_IO_URING
+    if(engine->backend == AIO_BACKEND_IO_URING){
+        _uring_destroy(engine);
+    }
+    else{
+        _pool_destroy(engine);
+    }
+#else
+    _pool_destroy(engine);
+#endif
+    free(engine);
+}
+
+aio_backend_t aio_engine_backend(aio_engine_t * engine){
+    return engine->backend;
+}
+
+/*!
+ * @note queue requests,they are completed in any order.
+ *       the requests and buffers must be valid until reaped.
+ *       the threads submit at same time,the completions of all
+ *       of them are in one queue,disk_reap gives them back to
+ *       their submitters.
+ * @return count of requests queued,which is less than cnt
+ *         when too many requests in flight.
+ */
+uint32_t aio_submit(aio_engine_t * engine, fs_io_req_t ** reqs, uint32_t cnt){
+    uint32_t queued;
+#if AIO_HAVE_IO_URING
+    if(engine->backend == AIO_BACKEND_IO_URING){
+        queued = _uring_submit(engine,reqs,cnt);
+    }
+    else{
+        queued = _pool_submit(engine,reqs,cnt);
+    }
+#else
+    queued = _pool_submit(engine,reqs,cnt);
+#endif
+    return queued;
+}
+
+/*!
+ * @note get completed requests from completion queue,
+ *       they may be submitted by any thread.
+ * @param done : completed requests,req->result is count of bytes or -errno.
+ * @param max : size of done.
+ * @param min : wait until min requests completed,
+ *              or no request in flight.
+ * @return count of completed requests.
+ */
+uint32_t aio_reap(aio_engine_t * engine, fs_io_req_t ** done, uint32_t max, uint32_t min){
+    uint32_t got;
+#if AIO_HAVE_IO_URING
+    if(engine->backend == AIO_BACKEND_IO_URING){
+        got = _uring_reap(engine,done,max,min);
+    }
+    else{
+        got = _pool_reap(engine,done,max,min);
+    }
+#else
+    got = _pool_reap(engine,done,max,min);
+#endif
+    return got;
+}
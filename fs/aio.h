@@ -0,0 +1,20 @@
+#ifndef OPENBHOS_FS_AIO_H
+#define OPENBHOS_FS_AIO_H
+
+#include "fs_common.h"
+
+typedef
+enum {
+    AIO_BACKEND_IO_URING,
+    AIO_BACKEND_THREAD_POOL,
+} aio_backend_t;
+
+typedef struct aio_engine aio_engine_t;
+
+aio_engine_t * aio_engine_create(int fd, uint32_t select_size, uint32_t depth);
+void aio_engine_destroy(aio_engine_t * engine);
+aio_backend_t aio_engine_backend(aio_engine_t * engine);
+uint32_t aio_submit(aio_engine_t * engine, fs_io_req_t ** reqs, uint32_t cnt);
+uint32_t aio_reap(aio_engine_t * engine, fs_io_req_t ** done, uint32_t max, uint32_t min);
+
+#endif //OPENBHOS_FS_AIO_H
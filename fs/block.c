@@ -4,18 +4,121 @@
 
 #include "fs_common.h"
 #include "block.h"
+#include "trace.h"
 #include "string.h"
+#include "stdlib.h"
 
+// a block is locked only by the holders of it`s ref,and the ref is
+// dropped after the lock is released,so a block without ref is never
+// locked and can be recycled under the cache lock at once.
+// the lock of a held block is waited after the cache lock is released.
 static block_cache_t block_cache;
 
+#define BLOCK_HASH_END 0xFFFF
+
+static inline uint32_t _block_hash(uint32_t block_no, int dev_no){
+    uint32_t hash = (block_no+(uint32_t)dev_no*0x9E3779B9u)*2654435761u;
+    return (hash^(hash>>16))&(CONFIG_FS_BLOCK_HASH_CNT-1);
+}
+
+/*!
+ * @note set the id of a block with it`s packed copy in cache,
+ *       and move the block to the hash chain of new id.
+ * @warning must hold cache`s write lock.
+ */
+static inline void _block_set_id(block_t * block, int dev_no, uint32_t block_no){
+    uint16_t const index = block-block_cache.buffer;
+    if(block->block_no!=BLOCK_NO_ERROR){
+        uint16_t * link = &block_cache.hash_heads[_block_hash(block->block_no,block->dev_no)];
+        while(*link!=index){
+            link = &block_cache.hash_next[*link];
+        }
+        *link = block_cache.hash_next[index];
+    }
+    block->dev_no = dev_no;
+    block->block_no = block_no;
+    block_cache.dev_nos[index] = dev_no;
+    block_cache.block_nos[index] = block_no;
+    if(block_no!=BLOCK_NO_ERROR){
+        uint16_t * head = &block_cache.hash_heads[_block_hash(block_no,dev_no)];
+        block_cache.hash_next[index] = *head;
+        *head = index;
+    }
+}
+
+/*!
+ * @note find a block in cache by the packed ids.
+ * @warning must hold cache`s lock.
+ * @return NULL when the block is not cached.
+ */
+static inline block_t * _block_find(uint32_t block_no, int dev_no){
+    uint16_t index = block_cache.hash_heads[_block_hash(block_no,dev_no)];
+    for(;index!=BLOCK_HASH_END;index = block_cache.hash_next[index]){
+        if(block_cache.block_nos[index] == block_no&&block_cache.dev_nos[index] == dev_no){
+            return &block_cache.buffer[index];
+        }
+    }
+    return NULL;
+}
+
 static inline void _block_init(block_t * block , int dev_no){
     block->block_no = BLOCK_NO_ERROR;
+    _block_set_id(block,dev_no,BLOCK_NO_ERROR);
     fs_stub_rw_lock_init(&block->rw_lock);
     block->dirty = false;
-    block->dev_no = dev_no;
+    block->ref_cnt = 0;
+    block->hit_cnt = 0;
+    block->data = block->buf;
     block->dnode.data = block;
 }
 
+/*!
+ * @note load block data from device,a clean read block
+ *       uses device`s mapping directly if it has one.
+ * @warning must hold block`s write lock.
+ */
+static inline void _block_load(block_t * block , bool write){
+    byte * mapped = fs_stub_source_map(block->dev_no,block->block_no);
+    if(mapped == NULL){
+        fs_stub_source_read(block);
+    }
+    else if(write){
+        memcpy(block->buf,mapped,CONFIG_FS_BLOCK_SIZE);
+    }
+    else{
+        block->data = mapped;
+    }
+}
+
+/*!
+ * @note make block data writable,a mapped block is
+ *       copied to it`s own buffer before changing.
+ * @warning must hold block`s write lock.
+ */
+static inline void _block_stage(block_t * block){
+    if(block->data!=block->buf){
+        memcpy(block->buf,block->data,CONFIG_FS_BLOCK_SIZE);
+        block->data = block->buf;
+    }
+}
+
+static inline void _block_ref(block_t * block){
+    __atomic_add_fetch(&block->ref_cnt,1,__ATOMIC_RELAXED);
+}
+
+/*!
+ * @note release the lock of a block and then drop the ref.
+ */
+static inline void _block_put(block_t * block, bool write){
+    if(write){
+        fs_stub_rw_w_lock_release(&block->rw_lock);
+    }
+    else{
+        fs_stub_rw_r_lock_release(&block->rw_lock);
+    }
+    __atomic_sub_fetch(&block->ref_cnt,1,__ATOMIC_RELEASE);
+}
+
 /*!
  * @note LRU.
  * @param block
@@ -37,50 +140,95 @@ static inline void _block_flush_no_check(block_t * block){
 }
 
 
-static inline block_t * _block_get(uint32_t block_no , int dev_no , bool write){
-    // search in cache
-    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
-    dnode_t * probe = block_cache.dlink.head;
-    for(;probe!=NULL;probe=probe->next){
-        block_t * block_probe = (block_t *)probe->data;
-        fs_stub_rw_w_lock_acquire(&block_probe->rw_lock);
-        if(block_probe->block_no == block_no&&block_probe->dev_no == dev_no){
-            // cache hit!
-            // move to head
-            if(block_cache.dlink.head!=&block_probe->dnode){
-                _block_move_to_head(&block_cache.dlink,block_probe);
-            }
-            if(!write){
-                // block cache must lock when change w_lock to r_lock.
-                // otherwise,the target block will recycle probably.
-                fs_stub_rw_w_lock_release(&block_probe->rw_lock);
-                fs_stub_rw_r_lock_acquire(&block_probe->rw_lock);
-            }
-            fs_stub_rw_w_lock_release(&block_cache.rw_lock);
-            return block_probe;
+/*!
+ * @note pick the LRU block which is not pinned,write back it
+ *       and move it to head.
+ * @warning must hold cache`s write lock.
+ * @return the block with write lock.
+ */
+static block_t * _block_recycle(){
+    block_t * block_tail = NULL;
+    for(dnode_t * probe = block_cache.dlink.tail;probe!=NULL;probe=probe->prev){
+        block_t * block_probe = probe->data;
+        // the refs only increase under cache lock,so a block without ref stays idle.
+        if(__atomic_load_n(&block_probe->ref_cnt,__ATOMIC_ACQUIRE) == 0
+           &&fs_stub_rw_w_lock_try_acquire(&block_probe->rw_lock)){
+            block_tail = block_probe;
+            break;
         }
     }
-    // no hit
-    // load in device
-    // LRU
-    block_t * block_tail= block_cache.dlink.tail->data;
-    fs_stub_rw_w_lock_acquire(&block_tail->rw_lock);
-    if(block_tail->block_no!=BLOCK_NO_ERROR){
+    if(block_tail == NULL){
+        PANIC("All blocks are pinned!\n");
+    }
+    if(block_tail->block_no!=BLOCK_NO_ERROR&&block_tail->dirty){
         // write back this
+        FS_TRACE_BEGIN(trace_start);
         block_flush(block_tail);
+        FS_TRACE_END(trace_start,"block_evict_flush",block_tail->block_no);
     }
+    block_tail->data = block_tail->buf;
     if(&block_tail->dnode!=block_cache.dlink.head){
         _block_move_to_head(&block_cache.dlink,block_tail);
     }
-    block_tail->dev_no = dev_no;
-    block_tail->block_no = block_no;
+    return block_tail;
+}
+
+/*!
+ * @note get a block from cache or load it from device.
+ *       the block is held with a ref until put,
+ *       so it won`t be recycled.
+ * @param load : read data from device when miss,
+ *               the caller must overwrite whole block if not load.
+ */
+static inline block_t * _block_get(uint32_t block_no , int dev_no , bool write , bool load){
+    // search in cache
+    for(;;){
+        fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+        block_t * block_probe = _block_find(block_no,dev_no);
+        if(block_probe == NULL){
+            break;
+        }
+        // cache hit!
+        block_probe->hit_cnt++;
+        // move to head
+        if(block_cache.dlink.head!=&block_probe->dnode){
+            _block_move_to_head(&block_cache.dlink,block_probe);
+        }
+        _block_ref(block_probe);
+        fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+        if(write){
+            fs_stub_rw_w_lock_acquire(&block_probe->rw_lock);
+        }
+        else{
+            fs_stub_rw_r_lock_acquire(&block_probe->rw_lock);
+        }
+        if(block_probe->block_no == block_no&&block_probe->dev_no == dev_no){
+            if(write){
+                _block_stage(block_probe);
+            }
+            return block_probe;
+        }
+        // the block is dropped when waiting,search again.
+        _block_put(block_probe,write);
+    }
+    // no hit
+    // load in device
+    FS_TRACE_BEGIN(trace_start);
+    block_t * block_tail = _block_recycle();
+    _block_set_id(block_tail,dev_no,block_no);
     block_tail->dirty = false;
-    fs_stub_source_read(block_tail);
+    block_tail->hit_cnt = 0;
+    _block_ref(block_tail);
+    // the others getting this block wait for it`s lock until loaded.
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+    if(load){
+        _block_load(block_tail,write);
+    }
     if(!write){
         fs_stub_rw_w_lock_release(&block_tail->rw_lock);
         fs_stub_rw_r_lock_acquire(&block_tail->rw_lock);
     }
-    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+    FS_TRACE_END(trace_start,"block_miss",block_no);
     return block_tail;
 }
 
@@ -101,50 +249,544 @@ void block_flush(block_t * block){
     return;
 }
 
-void block_flush_all(){
+/*!
+ * @note write back blocks with async requests and wait for them.
+ *       requests are submitted in the order of blocks.
+ *       the blocks are written synchronously when device
+ *       has no async I/O,or the async write of block fails.
+ * @warning must hold blocks` read lock,and blocks must be in one device.
+ */
+static void _block_flush_batch(block_t ** blocks, uint32_t cnt){
+    if(cnt == 0){
+        return;
+    }
+    FS_TRACE_BEGIN(trace_start);
+    int const dev_no = blocks[0]->dev_no;
+    fs_io_req_t reqs[CONFIG_FS_AIO_DEPTH];
+    fs_io_req_t * free_reqs[CONFIG_FS_AIO_DEPTH];
+    fs_io_req_t * done_reqs[CONFIG_FS_AIO_DEPTH];
+    uint32_t free_cnt = CONFIG_FS_AIO_DEPTH;
+    for(uint32_t i = 0;i<CONFIG_FS_AIO_DEPTH;i++){
+        free_reqs[i] = &reqs[i];
+    }
+    uint32_t submitted = 0;
+    while(submitted<cnt||free_cnt<CONFIG_FS_AIO_DEPTH){
+        for(;submitted<cnt&&free_cnt>0;submitted++){
+            fs_io_req_t * req = free_reqs[free_cnt-1];
+            req->buffer = blocks[submitted]->data;
+            req->select_no = blocks[submitted]->block_no;
+            req->select_cnt = 1;
+            req->write = true;
+            req->data = blocks[submitted];
+            if(fs_stub_source_submit(dev_no,reqs,&req,1) == 0){
+                if(free_cnt == CONFIG_FS_AIO_DEPTH){
+                    // nothing in flight,engine can`t take it.
+                    _block_flush_no_check(blocks[submitted]);
+                    continue;
+                }
+                break;
+            }
+            free_cnt--;
+        }
+        if(free_cnt == CONFIG_FS_AIO_DEPTH){
+            continue;
+        }
+        uint32_t reaped = fs_stub_source_reap(dev_no,reqs,done_reqs,CONFIG_FS_AIO_DEPTH,1);
+        for(uint32_t i = 0;i<reaped;i++){
+            block_t * block = done_reqs[i]->data;
+            if(done_reqs[i]->result == CONFIG_FS_BLOCK_SIZE){
+                block->dirty = false;
+            }
+            else{
+                // short or failed write,retry in the synchronous path.
+                _block_flush_no_check(block);
+            }
+            free_reqs[free_cnt++] = done_reqs[i];
+        }
+    }
+    FS_TRACE_END(trace_start,"block_flush_batch",cnt);
+}
+
+static int _block_no_cmp(const void * a, const void * b){
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x<y?-1:(x>y?1:0);
+}
+
+/*!
+ * @note write back the dirty blocks of a device in [from,to),
+ *       the block numbers are collected in one scan of cache
+ *       and written back in order by block_flush_sorted.
+ */
+static void _block_flush_range(int dev_no, uint32_t from, uint32_t to){
+    uint32_t block_nos[CONFIG_FS_BLOCK_CACHE_CNT];
+    uint32_t cnt = 0;
     fs_stub_rw_r_lock_acquire(&block_cache.rw_lock);
     for(dnode_t * probe = block_cache.dlink.head;probe!=NULL;probe = probe->next){
         block_t * block_probe = probe->data;
-        fs_stub_rw_r_lock_acquire(&block_probe->rw_lock);
-        block_flush(block_probe);
-        fs_stub_rw_r_lock_release(&block_probe->rw_lock);
+        if(!block_probe->dirty||block_probe->block_no == BLOCK_NO_ERROR||block_probe->dev_no!=dev_no||
+           block_probe->block_no<from||block_probe->block_no>=to){
+            continue;
+        }
+        block_nos[cnt++] = block_probe->block_no;
+    }
+    fs_stub_rw_r_lock_release(&block_cache.rw_lock);
+    qsort(block_nos,cnt,sizeof(uint32_t),_block_no_cmp);
+    block_flush_sorted(block_nos,cnt,dev_no);
+}
+
+/*!
+ * @note write back all dirty blocks of a device.
+ */
+void block_flush_dev(int dev_no){
+    FS_TRACE_BEGIN(trace_start);
+    _block_flush_range(dev_no,0,BLOCK_NO_ERROR);
+    FS_TRACE_END(trace_start,"block_flush_dev",dev_no);
+}
+
+/*!
+ * @note write back the dirty blocks in [block_no,block_no+cnt),
+ *       so the device can be read directly without cache.
+ */
+void block_flush_range(uint32_t block_no, uint32_t cnt, int dev_no){
+    _block_flush_range(dev_no,block_no,block_no+cnt);
+}
+
+/*!
+ * @note write back all dirty blocks.
+ */
+void block_flush_all(){
+    for(int dev_no = 0;dev_no<CONFIG_FS_DEV_CNT;dev_no++){
+        block_flush_dev(dev_no);
+    }
+}
+
+/*!
+ * @note write back and drop all blocks of a device,
+ *       so the device can be closed.
+ * @warning no block of device can be pinned.
+ */
+void block_drop_dev(int dev_no){
+    block_flush_dev(dev_no);
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    for(dnode_t * probe = block_cache.dlink.head;probe!=NULL;probe = probe->next){
+        block_t * block_probe = probe->data;
+        if(block_probe->dev_no!=dev_no||block_probe->block_no == BLOCK_NO_ERROR){
+            continue;
+        }
+        fs_stub_rw_w_lock_acquire(&block_probe->rw_lock);
+        ASSERT(block_probe->ref_cnt == 0,"block of dropped device is pinned!\n");
+        _block_set_id(block_probe,dev_no,BLOCK_NO_ERROR);
+        block_probe->dirty = false;
+        block_probe->data = block_probe->buf;
+        fs_stub_rw_w_lock_release(&block_probe->rw_lock);
     }
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+}
 
+/*!
+ * @note load the blocks not in cache with async requests,
+ *       so the following block_get will hit.
+ * @param block_nos
+ * @param cnt : must not bigger than CONFIG_FS_AIO_DEPTH.
+ * @param dev_no
+ */
+void block_prefetch(const uint32_t * block_nos, uint32_t cnt, int dev_no){
+    ASSERT(cnt<=CONFIG_FS_AIO_DEPTH,"too many blocks to prefetch!\n");
+    fs_io_req_t reqs[CONFIG_FS_AIO_DEPTH];
+    fs_io_req_t * req_ptrs[CONFIG_FS_AIO_DEPTH];
+    uint32_t req_cnt = 0;
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    for(uint32_t i = 0;i<cnt;i++){
+        if(_block_find(block_nos[i],dev_no)!=NULL){
+            continue;
+        }
+        block_t * block = _block_recycle();
+        _block_set_id(block,dev_no,block_nos[i]);
+        block->dirty = false;
+        block->hit_cnt = 0;
+        byte * mapped = fs_stub_source_map(dev_no,block_nos[i]);
+        if(mapped!=NULL){
+            // no I/O needed for mapped device.
+            block->data = mapped;
+            fs_stub_rw_w_lock_release(&block->rw_lock);
+            continue;
+        }
+        // the ref keeps the block from the recycles below until loaded.
+        _block_ref(block);
+        reqs[req_cnt].buffer = block->data;
+        reqs[req_cnt].select_no = block_nos[i];
+        reqs[req_cnt].select_cnt = 1;
+        reqs[req_cnt].write = false;
+        reqs[req_cnt].data = block;
+        req_ptrs[req_cnt] = &reqs[req_cnt];
+        req_cnt++;
+    }
+    uint32_t submitted = fs_stub_source_submit(dev_no,reqs,req_ptrs,req_cnt);
+    fs_io_req_t * done_reqs[CONFIG_FS_AIO_DEPTH];
+    for(uint32_t done = 0;done<submitted;){
+        uint32_t reaped = fs_stub_source_reap(dev_no,reqs,done_reqs,CONFIG_FS_AIO_DEPTH,submitted-done);
+        for(uint32_t i = 0;i<reaped;i++){
+            if(done_reqs[i]->result!=CONFIG_FS_BLOCK_SIZE){
+                // drop the block,so the next get reads it again.
+                _block_set_id(done_reqs[i]->data,dev_no,BLOCK_NO_ERROR);
+            }
+        }
+        done+=reaped;
+    }
+    for(uint32_t i = submitted;i<req_cnt;i++){
+        // engine is busy,read synchronously.
+        fs_stub_source_read(reqs[i].data);
+    }
+    for(uint32_t i = 0;i<req_cnt;i++){
+        _block_put(reqs[i].data,true);
+    }
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+}
+
+typedef
+struct {
+    uint32_t block_no;
+    uint32_t hit_cnt;
+    uint32_t rank;      // position in LRU list,for the blocks with same hits.
+} block_hot_t;
+
+static int _block_hot_cmp(const void * a, const void * b){
+    const block_hot_t * x = a;
+    const block_hot_t * y = b;
+    if(x->hit_cnt!=y->hit_cnt){
+        return x->hit_cnt>y->hit_cnt?-1:1;
+    }
+    return x->rank<y->rank?-1:(x->rank>y->rank?1:0);
+}
+
+/*!
+ * @note get the hot set of a device,which is the cached blocks
+ *       hit most since they are loaded. the blocks hit never
+ *       are not hot,they are mostly streamed data.
+ * @param dev_no
+ * @param block_nos : the hot blocks,hottest first.
+ * @param max : max count of block_nos.
+ * @return count of hot blocks.
+ */
+uint32_t block_hot_set(int dev_no, uint32_t * block_nos, uint32_t max){
+    block_hot_t hots[CONFIG_FS_BLOCK_CACHE_CNT];
+    uint32_t cnt = 0;
+    fs_stub_rw_r_lock_acquire(&block_cache.rw_lock);
+    for(dnode_t * probe = block_cache.dlink.head;probe!=NULL;probe = probe->next){
+        block_t * block_probe = probe->data;
+        if(block_probe->dev_no!=dev_no||block_probe->block_no == BLOCK_NO_ERROR||block_probe->hit_cnt == 0){
+            continue;
+        }
+        hots[cnt].block_no = block_probe->block_no;
+        hots[cnt].hit_cnt = block_probe->hit_cnt;
+        hots[cnt].rank = cnt;
+        cnt++;
+    }
     fs_stub_rw_r_lock_release(&block_cache.rw_lock);
+    qsort(hots,cnt,sizeof(block_hot_t),_block_hot_cmp);
+    cnt = cnt<max?cnt:max;
+    for(uint32_t i = 0;i<cnt;i++){
+        block_nos[i] = hots[i].block_no;
+    }
+    return cnt;
 }
 
-void block_module_init(int dev_no){
-    fs_stub_source_init();
+/*!
+ * @note load a set of blocks into cache in block order,
+ *       the contiguous blocks are read by one request and
+ *       the requests are in flight together.
+ *       the blocks in cache already are skipped.
+ * @param block_nos : in any order,may have duplicates.
+ * @param cnt : not bigger than CONFIG_FS_WARM_BLOCK_CNT.
+ * @param dev_no
+ */
+void block_warm(const uint32_t * block_nos, uint32_t cnt, int dev_no){
+    ASSERT(cnt<=CONFIG_FS_WARM_BLOCK_CNT,"too many blocks to warm!\n");
+    FS_TRACE_BEGIN(trace_start);
+    uint32_t sorted[CONFIG_FS_WARM_BLOCK_CNT];
+    byte * bounce = malloc(CONFIG_FS_WARM_IO_SEC_CNT*CONFIG_FS_BLOCK_SIZE);
+    if(bounce == NULL){
+        return;
+    }
+    memcpy(sorted,block_nos,cnt*sizeof(uint32_t));
+    qsort(sorted,cnt,sizeof(uint32_t),_block_no_cmp);
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    uint32_t n = 0;
+    for(uint32_t i = 0;i<cnt;i++){
+        if(n>0&&sorted[n-1] == sorted[i]){
+            continue;
+        }
+        if(_block_find(sorted[i],dev_no) == NULL){
+            sorted[n++] = sorted[i];
+        }
+    }
+    if(n>0&&fs_stub_source_map(dev_no,sorted[0])!=NULL){
+        // no I/O needed for mapped device.
+        for(uint32_t i = 0;i<n;i++){
+            block_t * block = _block_recycle();
+            _block_set_id(block,dev_no,sorted[i]);
+            block->dirty = false;
+            block->hit_cnt = 0;
+            block->data = fs_stub_source_map(dev_no,sorted[i]);
+            fs_stub_rw_w_lock_release(&block->rw_lock);
+        }
+        n = 0;
+    }
+    for(uint32_t i = 0;i<n;){
+        fs_io_req_t reqs[CONFIG_FS_AIO_DEPTH];
+        fs_io_req_t * req_ptrs[CONFIG_FS_AIO_DEPTH];
+        uint32_t req_cnt = 0;
+        uint32_t sec_cnt = 0;
+        // the runs fitting bounce buffer are read together.
+        while(i<n&&req_cnt<CONFIG_FS_AIO_DEPTH&&sec_cnt<CONFIG_FS_WARM_IO_SEC_CNT){
+            uint32_t len = 1;
+            while(i+len<n&&sorted[i+len] == sorted[i]+len&&sec_cnt+len<CONFIG_FS_WARM_IO_SEC_CNT){
+                len++;
+            }
+            reqs[req_cnt].buffer = bounce+sec_cnt*CONFIG_FS_BLOCK_SIZE;
+            reqs[req_cnt].select_no = sorted[i];
+            reqs[req_cnt].select_cnt = len;
+            reqs[req_cnt].write = false;
+            reqs[req_cnt].result = 0;
+            reqs[req_cnt].data = NULL;
+            req_ptrs[req_cnt] = &reqs[req_cnt];
+            req_cnt++;
+            sec_cnt+=len;
+            i+=len;
+        }
+        uint32_t submitted = fs_stub_source_submit(dev_no,reqs,req_ptrs,req_cnt);
+        for(uint32_t done = 0;done<submitted;){
+            done+=fs_stub_source_reap(dev_no,reqs,req_ptrs,CONFIG_FS_AIO_DEPTH,submitted-done);
+        }
+        for(uint32_t k = submitted;k<req_cnt;k++){
+            // engine is busy,read by selectors.
+            for(uint32_t j = 0;j<reqs[k].select_cnt;j++){
+                read_select(dev_no,(byte *)reqs[k].buffer+j*CONFIG_FS_BLOCK_SIZE,reqs[k].select_no+j);
+            }
+            reqs[k].result = reqs[k].select_cnt*CONFIG_FS_BLOCK_SIZE;
+        }
+        for(uint32_t k = 0;k<req_cnt;k++){
+            if(reqs[k].result!=(int)(reqs[k].select_cnt*CONFIG_FS_BLOCK_SIZE)){
+                continue;
+            }
+            for(uint32_t j = 0;j<reqs[k].select_cnt;j++){
+                block_t * block = _block_recycle();
+                _block_set_id(block,dev_no,reqs[k].select_no+j);
+                block->dirty = false;
+                block->hit_cnt = 0;
+                memcpy(block->data,(byte *)reqs[k].buffer+j*CONFIG_FS_BLOCK_SIZE,CONFIG_FS_BLOCK_SIZE);
+                fs_stub_rw_w_lock_release(&block->rw_lock);
+            }
+        }
+    }
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+    free(bounce);
+    FS_TRACE_END(trace_start,"block_warm",n);
+}
+
+/*!
+ * @note write back some blocks in the order of block_nos,
+ *       the blocks not in cache or not dirty are skipped.
+ *       the blocks are found by hash and held in chunks,
+ *       their locks are waited without the cache lock.
+ * @param block_nos : block numbers sorted ascending.
+ * @param cnt
+ * @param dev_no
+ */
+void block_flush_sorted(const uint32_t * block_nos, uint32_t cnt, int dev_no){
+    for(uint32_t first = 0;first<cnt;first+=CONFIG_FS_AIO_DEPTH){
+        uint32_t const chunk = cnt-first<CONFIG_FS_AIO_DEPTH?cnt-first:CONFIG_FS_AIO_DEPTH;
+        block_t * hit[CONFIG_FS_AIO_DEPTH];
+        uint32_t hit_cnt = 0;
+        fs_stub_rw_r_lock_acquire(&block_cache.rw_lock);
+        for(uint32_t i = 0;i<chunk;i++){
+            block_t * block_probe = _block_find(block_nos[first+i],dev_no);
+            if(block_probe!=NULL&&block_probe->dirty){
+                _block_ref(block_probe);
+                hit[hit_cnt++] = block_probe;
+            }
+        }
+        fs_stub_rw_r_lock_release(&block_cache.rw_lock);
+        uint32_t flush_cnt = 0;
+        for(uint32_t i = 0;i<hit_cnt;i++){
+            fs_stub_rw_r_lock_acquire(&hit[i]->rw_lock);
+            if(hit[i]->block_no == BLOCK_NO_ERROR||!hit[i]->dirty){
+                // dropped or written back when waiting.
+                _block_put(hit[i],false);
+                continue;
+            }
+            hit[flush_cnt++] = hit[i];
+        }
+        _block_flush_batch(hit,flush_cnt);
+        for(uint32_t i = 0;i<flush_cnt;i++){
+            _block_put(hit[i],false);
+        }
+    }
+}
+
+/*!
+ * @note init the block cache shared by all devices.
+ */
+void block_module_init(){
     block_cache.dirty = false;
     // clear cache
     bzero(&block_cache, sizeof(block_cache_t));
     fs_stub_rw_lock_init(&block_cache.rw_lock);
+    memset(block_cache.hash_heads,0xFF,sizeof(block_cache.hash_heads));
     for(int i =0;i<CONFIG_FS_BLOCK_CACHE_CNT;i++){
-        _block_init(&block_cache.buffer[i], dev_no);
+        _block_init(&block_cache.buffer[i], -1);
         dlink_add_tail(&block_cache.dlink,&block_cache.buffer[i].dnode);
     }
 }
 
 
 block_t * block_get_read(uint32_t block_no , int dev_no){
-    return _block_get(block_no,dev_no,false);
+    return _block_get(block_no,dev_no,false,true);
 }
 
 block_t * block_get_write(uint32_t block_no , int dev_no){
-    block_t * ret =  _block_get(block_no,dev_no,true);
+    block_t * ret =  _block_get(block_no,dev_no,true,true);
+    ret->dirty = true;
+    return ret;
+}
+
+/*!
+ * @note get a block with write lock without reading
+ *       it from device when miss.
+ * @warning the caller must overwrite the whole block data.
+ */
+block_t * block_get_overwrite(uint32_t block_no , int dev_no){
+    block_t * ret =  _block_get(block_no,dev_no,true,false);
     ret->dirty = true;
     return ret;
 }
 
 void block_put_read(block_t * block){
-    fs_stub_rw_r_lock_release(&block->rw_lock);
+    _block_put(block,false);
 }
 
-void block_put_write(block_t * block){
+/*!
+ * @note get a block with read lock and pin it in cache,
+ *       so the caller can use block->data directly
+ *       until block_put_read_pinned.
+ * @return the block or NULL when CONFIG_FS_BLOCK_PIN_MAX
+ *         pins are in use,so the lenders can`t pin the
+ *         whole cache.
+ */
+block_t * block_get_read_pinned(uint32_t block_no , int dev_no){
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    if(block_cache.pin_cnt>=CONFIG_FS_BLOCK_PIN_MAX){
+        fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+        return NULL;
+    }
+    block_cache.pin_cnt++;
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+    return _block_get(block_no,dev_no,false,true);
+}
+
+void block_put_read_pinned(block_t * block){
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    ASSERT(block->ref_cnt>0,"block is not pinned!\n");
+    block_cache.pin_cnt--;
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+    _block_put(block,false);
+}
+
+/*!
+ * @note pin a block which is already pinned by caller,
+ *       and get it`s read lock.
+ *       released by block_put_read_pinned.
+ * @return false when CONFIG_FS_BLOCK_PIN_MAX pins are in use.
+ */
+bool block_pin_read(block_t * block){
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    ASSERT(block->ref_cnt>0,"block is not pinned!\n");
+    if(block_cache.pin_cnt>=CONFIG_FS_BLOCK_PIN_MAX){
+        fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+        return false;
+    }
+    block_cache.pin_cnt++;
+    _block_ref(block);
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+    fs_stub_rw_r_lock_acquire(&block->rw_lock);
+    return true;
+}
+
+/*!
+ * @note get a pinned block which has no block number,
+ *       the data is filled with zero.
+ *       the block is owned by caller until bound to a
+ *       block number or put,so it`s lock is not held.
+ * @return anonymous block or NULL when too many anonymous
+ *         blocks are in use.
+ */
+block_t * block_get_anon(){
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    if(block_cache.anon_cnt>=CONFIG_FS_BLOCK_ANON_MAX){
+        fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+        return NULL;
+    }
+    block_t * block = _block_recycle();
+    _block_set_id(block,block->dev_no,BLOCK_NO_ERROR);
+    block->dirty = false;
+    block->ref_cnt = 1;
+    block->data = block->buf;
+    memset(block->data,0,CONFIG_FS_BLOCK_SIZE);
+    block_cache.anon_cnt++;
     fs_stub_rw_w_lock_release(&block->rw_lock);
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+    return block;
+}
+
+/*!
+ * @note give an anonymous block a block number,and unpin it.
+ *       the block becomes a normal dirty block,and the old
+ *       cached copy of the same block is dropped.
+ * @param block : block from block_get_anon.
+ * @param block_no
+ * @param dev_no
+ */
+void block_bind_anon(block_t * block , uint32_t block_no , int dev_no){
+    // the lent readers of block are waited without cache lock.
+    fs_stub_rw_w_lock_acquire(&block->rw_lock);
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    for(block_t * block_probe = _block_find(block_no,dev_no);block_probe!=NULL;block_probe = _block_find(block_no,dev_no)){
+        // the old copy may be held,wait for it`s holders with a ref.
+        _block_ref(block_probe);
+        fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+        fs_stub_rw_w_lock_acquire(&block_probe->rw_lock);
+        fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+        if(block_probe->block_no == block_no&&block_probe->dev_no == dev_no){
+            _block_set_id(block_probe,dev_no,BLOCK_NO_ERROR);
+            block_probe->dirty = false;
+            block_probe->data = block_probe->buf;
+        }
+        _block_put(block_probe,true);
+    }
+    _block_set_id(block,dev_no,block_no);
+    block->dirty = true;
+    block->hit_cnt = 0;
+    block_cache.anon_cnt--;
+    _block_put(block,true);
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+}
+
+/*!
+ * @note drop an anonymous block.
+ */
+void block_put_anon(block_t * block){
+    fs_stub_rw_w_lock_acquire(&block_cache.rw_lock);
+    __atomic_sub_fetch(&block->ref_cnt,1,__ATOMIC_RELEASE);
+    block_cache.anon_cnt--;
+    fs_stub_rw_w_lock_release(&block_cache.rw_lock);
+}
+
+void block_put_write(block_t * block){
+    _block_put(block,true);
 }
 
 void block_put_write_with_flush(block_t * block){
     _block_flush_no_check(block);
-    fs_stub_rw_w_lock_release(&block->rw_lock);
+    _block_put(block,true);
 }
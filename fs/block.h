@@ -10,14 +10,42 @@ void block_flush(block_t * block);
 
 void block_flush_all();
 
-void block_module_init(int dev_no);
+void block_flush_dev(int dev_no);
+
+void block_drop_dev(int dev_no);
+
+void block_prefetch(const uint32_t * block_nos, uint32_t cnt, int dev_no);
+
+uint32_t block_hot_set(int dev_no, uint32_t * block_nos, uint32_t max);
+
+void block_warm(const uint32_t * block_nos, uint32_t cnt, int dev_no);
+
+void block_flush_sorted(const uint32_t * block_nos, uint32_t cnt, int dev_no);
+
+void block_flush_range(uint32_t block_no, uint32_t cnt, int dev_no);
+
+void block_module_init();
 
 block_t * block_get_read(uint32_t block_no , int dev_no);
 
 block_t * block_get_write(uint32_t block_no , int dev_no);
 
+block_t * block_get_overwrite(uint32_t block_no , int dev_no);
+
 void block_put_read(block_t * block);
 
+block_t * block_get_read_pinned(uint32_t block_no , int dev_no);
+
+void block_put_read_pinned(block_t * block);
+
+bool block_pin_read(block_t * block);
+
+block_t * block_get_anon();
+
+void block_bind_anon(block_t * block , uint32_t block_no , int dev_no);
+
+void block_put_anon(block_t * block);
+
 void block_put_write(block_t * block);
 
 void block_put_write_with_flush(block_t * block);
@@ -4,86 +4,485 @@
 
 #include "fat32.h"
 #include "block.h"
+#include "virtul_disk.h"
+#include "trace.h"
+#include "stdlib.h"
 #include "string.h"
+#include "time.h"
+#include "sched.h"
+#include "unistd.h"
+#include "fcntl.h"
 
-static fs_t fat32;
+static fs_t fs_table[CONFIG_FS_DEV_CNT];
+// locks are taken from parent entry to sub entry,then the cache lock,
+// the dirent lock of a dir and the block layer. the cache lock guards
+// the ref cnt,keys and parent of entries,so an entry is locked only by
+// the holders of it`s ref and an idle entry is never locked,the locks
+// of entries are only tried under the cache lock.
 static entry_cache_t entry_cache;
-static entry_t * root;
-static inline uint32_t _fat_sec_no_of_clus(uint32_t clus_no, uint8_t fat_no)
+static inline uint32_t _fat_sec_no_of_clus(fs_t * fs, uint32_t clus_no, uint8_t fat_no)
 {
-    return fat32.bpb.rsvd_sec_cnt + (clus_no << 2) / fat32.bpb.byts_per_sec + fat32.bpb.fat_sz * fat_no;
+    return fs->bpb.rsvd_sec_cnt + (clus_no >> fs->geo.fat_shift) + fs->bpb.fat_sz * fat_no;
 }
 
-static inline uint32_t _first_sec_in_clus(uint32_t clus_no){
-    return ((clus_no - 2) * fat32.bpb.sec_per_clus) + fat32.first_data_sec;
+static inline uint32_t _first_sec_in_clus(fs_t * fs, uint32_t clus_no){
+    return ((clus_no - 2) << fs->geo.spc_shift) + fs->first_data_sec;
 }
 
-static inline uint32_t _fat_offset_in_sec_of_clus(uint32_t clus_no){
-    return clus_no%(fat32.bpb.byts_per_sec>>2);
+static inline uint32_t _fat_offset_in_sec_of_clus(fs_t * fs, uint32_t clus_no){
+    return clus_no&fs->geo.fat_mask;
 }
 
-static inline void _clus_clear(uint32_t clus_no){
-    uint32_t sec= _first_sec_in_clus(clus_no);
-    for(int i = 0;i<fat32.bpb.sec_per_clus;i++,sec++){
-        block_t * block = block_get_write(sec,CONFIG_FS_FAT32_DEV_NO);
+/*!
+ * @return count of clusters to hold size bytes.
+ */
+static inline uint32_t _clus_cnt_of_size(fs_t * fs, uint32_t size){
+    return (size>>fs->geo.clus_shift)+((size&fs->geo.clus_mask)!=0);
+}
+
+/*!
+ * @note get log2 of a power of 2.
+ * @return -1 when x is not a power of 2.
+ */
+static inline int _log2_exact(uint32_t x){
+    if(x == 0||(x&(x-1))!=0){
+        return -1;
+    }
+    int shift = 0;
+    while((1u<<shift)!=x){
+        shift++;
+    }
+    return shift;
+}
+
+/*!
+ * @note compute the shifts and masks of geometry once at mount,
+ *       the hot paths only use them instead of division.
+ * @return false when sector size is not the size of block in cache,
+ *         or cluster size is not a power of 2 or has more than one sector.
+ */
+static bool _fs_geo_init(fs_t * fs){
+    int sec_shift = _log2_exact(fs->bpb.byts_per_sec);
+    int spc_shift = _log2_exact(fs->bpb.sec_per_clus);
+    if(fs->bpb.byts_per_sec!=CONFIG_FS_BLOCK_SIZE||spc_shift<0){
+        // the blocks and selectors are CONFIG_FS_BLOCK_SIZE bytes,
+        // a sector of other size can`t be read as one block.
+        return false;
+    }
+    if(spc_shift!=0){
+        // Not support:the cluster of some sectors.
+        return false;
+    }
+    fs->geo.sec_shift = sec_shift;
+    fs->geo.spc_shift = spc_shift;
+    fs->geo.clus_shift = sec_shift+spc_shift;
+    fs->geo.fat_shift = sec_shift-2;
+    fs->geo.sec_mask = (1u<<fs->geo.sec_shift)-1;
+    fs->geo.clus_mask = (1u<<fs->geo.clus_shift)-1;
+    fs->geo.spc_mask = (1u<<fs->geo.spc_shift)-1;
+    fs->geo.fat_mask = (1u<<fs->geo.fat_shift)-1;
+    return true;
+}
+
+/*!
+ * @note write back the sectors tracked by entry in sector order.
+ * @warning must hold entry`s write lock.
+ */
+static void _entry_sync_secs(entry_t * entry){
+    block_flush_sorted(entry->sync_secs,entry->sync_sec_cnt,entry->fs->dev_no);
+    entry->sync_sec_cnt = 0;
+}
+
+/*!
+ * @note record a sector dirtied for entry,so entry_fsync
+ *       can write back it without flushing whole cache.
+ *       the tracked sectors are kept in order,and they are
+ *       written back at once when the track list is full.
+ * @param entry : NULL when no entry to track.
+ * @param sec
+ */
+static void _entry_track_sec(entry_t * entry, uint32_t sec){
+    if(entry == NULL){
+        return;
+    }
+    if(entry->batch != NULL){
+        // the batch flushes all of it`s sectors at commit.
+        entry_batch_t * batch = entry->batch;
+        if(batch->sec_cnt == batch->sec_cap){
+            uint32_t cap = batch->sec_cap == 0?64:batch->sec_cap*2;
+            uint32_t * secs = realloc(batch->secs,cap*sizeof(uint32_t));
+            if(secs == NULL){
+                batch->sec_lost = true;
+                return;
+            }
+            batch->secs = secs;
+            batch->sec_cap = cap;
+        }
+        batch->secs[batch->sec_cnt++] = sec;
+        return;
+    }
+    uint32_t low = 0;
+    uint32_t high = entry->sync_sec_cnt;
+    while(low<high){
+        uint32_t mid = (low+high)/2;
+        if(entry->sync_secs[mid]<sec){
+            low = mid+1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    if(low<entry->sync_sec_cnt&&entry->sync_secs[low] == sec){
+        return;
+    }
+    if(entry->sync_sec_cnt == CONFIG_FS_ENTRY_SYNC_SEC_CNT){
+        _entry_sync_secs(entry);
+        low = 0;
+    }
+    for(uint32_t i = entry->sync_sec_cnt;i>low;i--){
+        entry->sync_secs[i] = entry->sync_secs[i-1];
+    }
+    entry->sync_secs[low] = sec;
+    entry->sync_sec_cnt++;
+}
+
+static inline void _clus_clear(fs_t * fs, uint32_t clus_no, entry_t * owner){
+    uint32_t sec= _first_sec_in_clus(fs,clus_no);
+    for(int i = 0;i<fs->bpb.sec_per_clus;i++,sec++){
+        block_t * block = block_get_overwrite(sec,fs->dev_no);
         memset(block->data,0,CONFIG_FS_BLOCK_SIZE);
         block_put_write(block);
+        _entry_track_sec(owner,sec);
     }
 }
 
-static uint32_t _fat_read(uint32_t clus_no)
+static uint32_t _fat_read(fs_t * fs, uint32_t clus_no)
 {
     if (clus_no >= FAT32_EOC) {
         return clus_no;
     }
-    if (clus_no > fat32.data_clus_cnt + 1) {
+    if (clus_no > fs->data_clus_cnt + 1) {
         return 0;
     }
-    uint32_t fat_sec = _fat_sec_no_of_clus(clus_no, 0);
-    block_t * block = block_get_read(fat_sec,0);
-    uint32_t next_clus = *((uint32_t *)block->data + _fat_offset_in_sec_of_clus(clus_no));
+    uint32_t fat_sec = _fat_sec_no_of_clus(fs,clus_no, 0);
+    block_t * block = block_get_read(fat_sec,fs->dev_no);
+    uint32_t next_clus = *((uint32_t *)block->data + _fat_offset_in_sec_of_clus(fs,clus_no));
     block_put_read(block);
     return next_clus;
 }
 
-static uint32_t _fat_write(uint32_t clus_no, uint32_t data){
-    if (clus_no >= FAT32_EOC) {
+/*!
+ * @note walk of a chain in FAT.
+ *       the FAT sector is held until the next item
+ *       falls in another sector,so the items of a
+ *       contiguous chain cost one block get for a sector.
+ * @warning no other block is got before the walk ends.
+ */
+typedef
+struct {
+    fs_t * fs;
+    block_t * block;
+} fat_walk_t;
+
+/*!
+ * @return the same as _fat_read.
+ */
+static uint32_t _fat_walk_next(fat_walk_t * walk, uint32_t clus_no){
+    fs_t * fs = walk->fs;
+    if(clus_no >= FAT32_EOC){
         return clus_no;
     }
-    if (clus_no > fat32.data_clus_cnt + 1) {
+    if(clus_no > fs->data_clus_cnt + 1){
         return 0;
     }
-    uint32_t fat_sec = _fat_sec_no_of_clus(clus_no, 0);
-    block_t * block = block_get_write(fat_sec,0);
-    uint32_t pre_data = *((uint32_t *)block->data + _fat_offset_in_sec_of_clus(clus_no));
-    *((uint32_t *)block->data + _fat_offset_in_sec_of_clus(clus_no)) = data;
-    block_put_write(block);
-    return pre_data;
-}
-
-static uint32_t _clus_alloc(){
-    block_t *block;
-    uint32_t sec = fat32.bpb.rsvd_sec_cnt;
-    uint32_t const ent_per_sec = fat32.bpb.byts_per_sec / sizeof(uint32_t);
-    for (uint32_t i = 0; i < fat32.bpb.fat_sz; i++, sec++) {
-        block = block_get_write(sec,0);
-        for (uint32_t j = 0; j < ent_per_sec; j++) {
-            if (((uint32_t *)(block->data))[j] == 0) {
-                ((uint32_t *)(block->data))[j] = FAT32_FILE_END;
-                block_put_write(block);
-                uint32_t clus = i * ent_per_sec + j;
-                _clus_clear(clus);
-                return clus;
+    uint32_t fat_sec = _fat_sec_no_of_clus(fs,clus_no,0);
+    if(walk->block!=NULL&&walk->block->block_no!=fat_sec){
+        block_put_read(walk->block);
+        walk->block = NULL;
+    }
+    if(walk->block==NULL){
+        walk->block = block_get_read(fat_sec,fs->dev_no);
+    }
+    return *((uint32_t *)walk->block->data + _fat_offset_in_sec_of_clus(fs,clus_no));
+}
+
+static inline void _fat_walk_end(fat_walk_t * walk){
+    if(walk->block!=NULL){
+        block_put_read(walk->block);
+        walk->block = NULL;
+    }
+}
+
+/*!
+ * @note batch of FAT updates.
+ *       the FAT sector is held until the next
+ *       update falls in another sector,so the updates
+ *       in the same sector cost only one block get.
+ *       the updates are made in FAT 0,and the sector
+ *       is copied to the other FATs when it is released.
+ */
+typedef
+struct {
+    fs_t * fs;
+    block_t * block;
+    entry_t * owner;    // the entry to track FAT sectors,can be NULL.
+} fat_batch_t;
+
+/*!
+ * @note release the FAT sector of batch,and copy it to the
+ *       same sector of mirror FATs.
+ *       the copies are made under write lock of the sector
+ *       in FAT 0,so the mirrors get the updates in same order.
+ */
+static void _fat_batch_put(fat_batch_t * batch){
+    fs_t * fs = batch->fs;
+    for(uint8_t fat_no = 1;fat_no<fs->bpb.fat_cnt;fat_no++){
+        block_t * mirror = block_get_overwrite(batch->block->block_no+fs->bpb.fat_sz*fat_no,fs->dev_no);
+        memcpy(mirror->data,batch->block->data,fs->bpb.byts_per_sec);
+        block_put_write(mirror);
+    }
+    block_put_write(batch->block);
+    batch->block = NULL;
+}
+
+/*!
+ * @note get the FAT item of a clus in batch.
+ * @return pointer to the FAT item,valid until next batch operation.
+ */
+static uint32_t * _fat_batch_item(fat_batch_t * batch, uint32_t clus_no){
+    fs_t * fs = batch->fs;
+    uint32_t fat_sec = _fat_sec_no_of_clus(fs,clus_no, 0);
+    if(batch->block!=NULL&&batch->block->block_no!=fat_sec){
+        _fat_batch_put(batch);
+    }
+    if(batch->block==NULL){
+        // track first,the sync of owner`s sectors may flush this sector.
+        for(uint8_t fat_no = 0;fat_no<fs->bpb.fat_cnt;fat_no++){
+            _entry_track_sec(batch->owner,fat_sec+fs->bpb.fat_sz*fat_no);
+        }
+        batch->block = block_get_write(fat_sec,fs->dev_no);
+    }
+    return (uint32_t *)batch->block->data + _fat_offset_in_sec_of_clus(fs,clus_no);
+}
+
+static inline void _fat_batch_end(fat_batch_t * batch){
+    if(batch->block!=NULL){
+        _fat_batch_put(batch);
+    }
+}
+
+/*!
+ * @note find free clusters,contiguous as possible.
+ *       the search wraps around,a run doesn`t cross the wrap.
+ *       the items are only read,the run must be claimed
+ *       by _clus_claim_run before use.
+ * @param from : clus to start the search,0 for the free hint of volume.
+ * @param want : count of clusters wanted.
+ * @param run_len : count of contiguous free clusters found,
+ *                  which is less than want when there is no
+ *                  long enough run. 0 when volume is full.
+ * @return first clus of the run.
+ */
+static uint32_t _clus_find_run(fs_t * fs, uint32_t from, uint32_t want, uint32_t * run_len){
+    FS_TRACE_BEGIN(trace_start);
+    uint32_t const max_clus = fs->data_clus_cnt + 1;
+    uint32_t best_start = 0;
+    uint32_t best_len = 0;
+    uint32_t start = 0;
+    uint32_t len = 0;
+    block_t * block = NULL;
+    uint32_t clus = from!=0?from:__atomic_load_n(&fs->free_hint,__ATOMIC_RELAXED);
+    if(clus<2||clus>max_clus){
+        clus = 2;
+    }
+    for(uint32_t left = max_clus-1;left>0;left--,clus++){
+        if(clus>max_clus){
+            clus = 2;
+            len = 0;
+        }
+        if(block==NULL||(clus&fs->geo.fat_mask)==0||clus==2){
+            if(block!=NULL){
+                block_put_read(block);
             }
+            block = block_get_read(_fat_sec_no_of_clus(fs,clus,0),fs->dev_no);
         }
-        block_put_write(block);
+        if(((uint32_t *)block->data)[_fat_offset_in_sec_of_clus(fs,clus)] == 0){
+            if(len == 0){
+                start = clus;
+            }
+            len++;
+            if(len>best_len){
+                best_start = start;
+                best_len = len;
+            }
+            if(len == want){
+                break;
+            }
+        }
+        else{
+            len = 0;
+        }
+    }
+    if(block!=NULL){
+        block_put_read(block);
+    }
+    *run_len = best_len;
+    FS_TRACE_END(trace_start,"clus_find_run",want);
+    return best_start;
+}
+
+/*!
+ * @note claim the head of a run found by _clus_find_run.
+ *       every item is checked again under the write lock of
+ *       it`s FAT sector,so a clus taken by another allocator
+ *       since the search ends the claim.
+ *       the claimed items are set to FAT32_FILE_END.
+ * @param batch : FAT batch,ended by caller.
+ * @return count of clusters claimed from run,0 on conflict
+ *         at the first clus.
+ */
+static uint32_t _clus_claim_run(fat_batch_t * batch, uint32_t run, uint32_t run_len){
+    uint32_t claimed = 0;
+    for(;claimed<run_len;claimed++){
+        uint32_t * item = _fat_batch_item(batch,run+claimed);
+        if(*item!=0){
+            break;
+        }
+        *item = FAT32_FILE_END;
+    }
+    if(claimed>0){
+        // the next search starts behind the run.
+        __atomic_store_n(&batch->fs->free_hint,run+claimed,__ATOMIC_RELAXED);
     }
-    PANIC("no clusters to alloc!\n");
-    return 0;
+    return claimed;
 }
 
-static inline void _clus_free(uint32_t clus_no){
-    _fat_write(clus_no ,0);
+/*!
+ * @note alloc clusters and link them after a chain,
+ *       contiguous runs are preferred and the FAT
+ *       items are updated in batch.
+ * @param last_clus : last clus of the chain,0 for a new chain.
+ * @param cnt : count of clusters to alloc.
+ * @param keep_from
+ * @param keep_to : the new clusters in [keep_from,keep_to) will
+ *                  be overwritten totally by caller,so they are
+ *                  not cleared. others are filled with zero.
+ *                  index 0 is the first new clus.
+ * @param owner : the entry to track dirty sectors,can be NULL.
+ * @param from : clus to start the search of first run,
+ *               0 for the free hint of volume.
+ * @return first new clus.
+ */
+static uint32_t _clus_chain_extend_at(fs_t * fs, uint32_t from, uint32_t last_clus, uint32_t cnt, uint32_t keep_from, uint32_t keep_to, entry_t * owner){
+    FS_TRACE_BEGIN(trace_start);
+    uint32_t first = 0;
+    uint32_t index = 0;
+    fat_batch_t batch = {fs,NULL,owner};
+    while(cnt>0){
+        uint32_t run_len;
+        uint32_t run = _clus_find_run(fs,from,cnt,&run_len);
+        from = 0;
+        if(run_len == 0){
+            PANIC("no clusters to alloc!\n");
+        }
+        run_len = _clus_claim_run(&batch,run,run_len);
+        if(run_len == 0){
+            // lost the race of first clus,search again.
+            _fat_batch_end(&batch);
+            continue;
+        }
+        if(first == 0){
+            first = run;
+        }
+        if(last_clus!=0){
+            *_fat_batch_item(&batch,last_clus) = run;
+        }
+        for(uint32_t clus = run;clus+1<run+run_len;clus++){
+            *_fat_batch_item(&batch,clus) = clus+1;
+        }
+        last_clus = run+run_len-1;
+        cnt-=run_len;
+        // the runs found later must see the items above.
+        _fat_batch_end(&batch);
+        for(uint32_t clus = run;clus<run+run_len;clus++,index++){
+            if(index<keep_from||index>=keep_to){
+                _clus_clear(fs,clus,owner);
+            }
+        }
+    }
+    FS_TRACE_END(trace_start,"clus_alloc",index);
+    return first;
+}
+
+static inline uint32_t _clus_chain_extend(fs_t * fs, uint32_t last_clus, uint32_t cnt, uint32_t keep_from, uint32_t keep_to, entry_t * owner){
+    return _clus_chain_extend_at(fs,0,last_clus,cnt,keep_from,keep_to,owner);
+}
+
+/*!
+ * @note alloc a cleared clus.
+ * @param owner : the entry to track dirty sectors,can be NULL.
+ */
+static inline uint32_t _clus_alloc(fs_t * fs, entry_t * owner){
+    return _clus_chain_extend(fs,0,1,0,0,owner);
+}
+
+/*!
+ * @note alloc clusters which are chains of one clus,
+ *       they are not cleared and must be overwritten by caller.
+ * @param cnt : count of clusters to alloc.
+ * @param clus_nos : the clusters allocated.
+ * @param owner : the entry to track FAT sectors,can be NULL.
+ */
+static void _clus_alloc_many(fs_t * fs, uint32_t cnt, uint32_t * clus_nos, entry_t * owner){
+    FS_TRACE_BEGIN(trace_start);
+    uint32_t index = 0;
+    fat_batch_t batch = {fs,NULL,owner};
+    while(index<cnt){
+        uint32_t run_len;
+        uint32_t run = _clus_find_run(fs,0,cnt-index,&run_len);
+        if(run_len == 0){
+            PANIC("no clusters to alloc!\n");
+        }
+        run_len = _clus_claim_run(&batch,run,run_len);
+        for(uint32_t clus = run;clus<run+run_len;clus++){
+            clus_nos[index++] = clus;
+        }
+        // the runs found later must see the items above.
+        _fat_batch_end(&batch);
+    }
+    FS_TRACE_END(trace_start,"clus_alloc_many",cnt);
+}
+
+/*!
+ * @note free a clus chain from clus_no to the end.
+ * @param batch : FAT batch,ended by caller.
+ */
+static void _clus_chain_free(fat_batch_t * batch, uint32_t clus_no){
+    fs_t * fs = batch->fs;
+    while(clus_no>=2&&clus_no<FAT32_VALID_MAX&&clus_no<=fs->data_clus_cnt+1){
+        uint32_t * item = _fat_batch_item(batch,clus_no);
+        clus_no = *item;
+        *item = 0;
+    }
+}
+
+/*!
+ * @note walk a chain to the end.
+ * @param cnt : count of clusters in chain.
+ * @return last clus of chain.
+ */
+static uint32_t _clus_chain_last(fs_t * fs, uint32_t clus_no, uint32_t * cnt){
+    fat_walk_t walk = {fs,NULL};
+    *cnt = 1;
+    for(uint32_t next = _fat_walk_next(&walk,clus_no);next<FAT32_EOC;next = _fat_walk_next(&walk,clus_no)){
+        if(next<2||next>=FAT32_VALID_MAX){
+            PANIC("broken clus chain!\n");
+        }
+        clus_no = next;
+        (*cnt)++;
+    }
+    _fat_walk_end(&walk);
+    return clus_no;
 }
 
 
@@ -94,27 +493,30 @@ static inline void _clus_free(uint32_t clus_no){
  * @param offset
  * @param length
  * @param write
+ * @param owner : the entry to track written sectors,can be NULL.
  */
-static void _clus_rw(uint32_t clus_no, void * buffer, uint32_t offset, uint32_t length , bool write){
-    ASSERT(offset<fat32.byts_per_clus,"error in offset!\n");
-    if(offset+length>fat32.byts_per_clus){
-        length = fat32.byts_per_clus-offset;
+static void _clus_rw(fs_t * fs, uint32_t clus_no, void * buffer, uint32_t offset, uint32_t length , bool write , entry_t * owner){
+    ASSERT(offset<fs->byts_per_clus,"error in offset!\n");
+    if(offset+length>fs->byts_per_clus){
+        length = fs->byts_per_clus-offset;
     }
-    uint32_t first_sec =_first_sec_in_clus(clus_no);
-    uint32_t max_sec = first_sec+fat32.bpb.sec_per_clus;
-    uint32_t sec_shift = offset/fat32.bpb.byts_per_sec;
-    uint32_t offset_in_sec = offset%fat32.bpb.byts_per_sec;
+    uint32_t first_sec =_first_sec_in_clus(fs,clus_no);
+    uint32_t max_sec = first_sec+fs->bpb.sec_per_clus;
+    uint32_t sec_index = offset>>fs->geo.sec_shift;
+    uint32_t offset_in_sec = offset&fs->geo.sec_mask;
     uint32_t buffer_offset = 0;
-    for(uint32_t probe_sec = first_sec+sec_shift; probe_sec < max_sec; probe_sec++,offset_in_sec = 0){
-        if(offset_in_sec+length>fat32.bpb.byts_per_sec){
-            uint32_t cpy_len = fat32.bpb.byts_per_sec - offset_in_sec;
+    for(uint32_t probe_sec = first_sec+sec_index; probe_sec < max_sec; probe_sec++,offset_in_sec = 0){
+        if(offset_in_sec+length>fs->bpb.byts_per_sec){
+            uint32_t cpy_len = fs->bpb.byts_per_sec - offset_in_sec;
             if(write){
-                block_t * block = block_get_write(probe_sec,0);
+                // don`t load the sector which will be overwritten.
+                block_t * block = offset_in_sec==0?block_get_overwrite(probe_sec,fs->dev_no):block_get_write(probe_sec,fs->dev_no);
                 memcpy(block->data+offset_in_sec,buffer + buffer_offset,  cpy_len);
                 block_put_write(block);
+                _entry_track_sec(owner,probe_sec);
             }
             else{
-                block_t * block = block_get_read(probe_sec,0);
+                block_t * block = block_get_read(probe_sec,fs->dev_no);
                 memcpy(buffer + buffer_offset, block->data+offset_in_sec, cpy_len);
                 block_put_read(block);
             }
@@ -123,51 +525,123 @@ static void _clus_rw(uint32_t clus_no, void * buffer, uint32_t offset, uint32_t
         }
         else{
             if(write){
-                block_t * block = block_get_write(probe_sec,0);
+                block_t * block = (offset_in_sec==0&&length==fs->bpb.byts_per_sec)?
+                        block_get_overwrite(probe_sec,fs->dev_no):block_get_write(probe_sec,fs->dev_no);
                 memcpy( block->data+offset_in_sec,buffer + buffer_offset, length);
                 block_put_write(block);
+                _entry_track_sec(owner,probe_sec);
             }
             else{
-                block_t * block = block_get_read(probe_sec,0);
+                block_t * block = block_get_read(probe_sec,fs->dev_no);
                 memcpy(buffer + buffer_offset, block->data+offset_in_sec, length);
                 block_put_read(block);
             }
+            // is the last sec
+            break;
+        }
+    }
+}
+
+/*!
+ * @note prefetch the sectors of a range in chain with async reads.
+ *       at most CONFIG_FS_READAHEAD_CNT sectors are prefetched.
+ * @param clus_no : the clus where range starts.
+ * @param offset : offset in clus_no.
+ * @param length
+ * @return bytes of the range covered by prefetch.
+ */
+static uint32_t _clus_readahead(fs_t * fs, uint32_t clus_no, uint32_t offset, uint32_t length){
+    uint32_t secs[CONFIG_FS_READAHEAD_CNT];
+    uint32_t cnt = 0;
+    uint32_t covered = 0;
+    while(length>0&&cnt<CONFIG_FS_READAHEAD_CNT){
+        secs[cnt++] = _first_sec_in_clus(fs,clus_no) + (offset>>fs->geo.sec_shift);
+        uint32_t len = fs->bpb.byts_per_sec - (offset&fs->geo.sec_mask);
+        if(len>length){
+            len = length;
+        }
+        covered+=len;
+        length-=len;
+        offset+=len;
+        if(length>0&&offset==fs->byts_per_clus){
+            clus_no = _fat_read(fs,clus_no);
+            if(clus_no>=FAT32_VALID_MAX){
+                break;
+            }
+            offset = 0;
         }
     }
+    block_prefetch(secs,cnt,fs->dev_no);
+    return covered;
 }
 
-static bool _multi_clus_rw(uint32_t start_clus_no, void * buffer , uint32_t offset, uint32_t length,bool write){
+/*!
+ * @note read or write clus chain with a group of buffers.
+ *       the chain is walked only once for all buffers.
+ * @param start_clus_no
+ * @param iov
+ * @param iov_cnt
+ * @param offset : offset from start of the chain.
+ * @param write
+ * @param owner : the entry to track written sectors,can be NULL.
+ * @return false when the chain end before all buffers done.
+ */
+static bool _multi_clus_rwv(fs_t * fs, uint32_t start_clus_no, const fs_iovec_t * iov, uint32_t iov_cnt, uint32_t offset, bool write, entry_t * owner){
     // relocate the start_clus_no and start offset
-    uint32_t clus_no_offset = offset/fat32.byts_per_clus;
+    uint32_t clus_no_offset = offset>>fs->geo.clus_shift;
+    fat_walk_t walk = {fs,NULL};
     for(;clus_no_offset>0;clus_no_offset--){
-        start_clus_no = _fat_read(start_clus_no);
+        start_clus_no = _fat_walk_next(&walk,start_clus_no);
         if(start_clus_no>=FAT32_VALID_MAX){
+            _fat_walk_end(&walk);
             return false;
         }
     }
-    offset %=fat32.byts_per_clus;
-    uint32_t buffer_offset = 0;
+    _fat_walk_end(&walk);
+    offset &=fs->geo.clus_mask;
+    uint32_t length = 0;
+    for(uint32_t i = 0;i<iov_cnt;i++){
+        length+=iov[i].length;
+    }
+    uint32_t iov_index = 0;
+    uint32_t iov_offset = 0;
+    uint32_t readahead_left = 0;
     for(uint32_t probe_clus = start_clus_no;length>0;){
-        _clus_rw(probe_clus,buffer+buffer_offset,offset,length,write);
-        if(length>fat32.byts_per_clus - offset){
-            // have other clus
-            buffer_offset+=(fat32.byts_per_clus-offset);
-            length-=(fat32.byts_per_clus-offset);
-            offset=0;
+        if(iov_offset == iov[iov_index].length){
+            iov_index++;
+            iov_offset = 0;
+            continue;
+        }
+        uint32_t rw_len = iov[iov_index].length - iov_offset;
+        if(rw_len>fs->byts_per_clus - offset){
+            rw_len = fs->byts_per_clus - offset;
+        }
+        if(!write&&readahead_left == 0&&length>fs->bpb.byts_per_sec){
+            // the read covers many sectors,load them with a batch of async reads.
+            readahead_left = _clus_readahead(fs,probe_clus,offset,length);
+        }
+        readahead_left = readahead_left>rw_len?readahead_left-rw_len:0;
+        _clus_rw(fs,probe_clus,(byte *)iov[iov_index].base+iov_offset,offset,rw_len,write,owner);
+        iov_offset+=rw_len;
+        offset+=rw_len;
+        length-=rw_len;
+        if(length>0&&offset==fs->byts_per_clus){
             // get next clus
-            probe_clus = _fat_read(probe_clus);
+            offset = 0;
+            probe_clus = _fat_read(fs,probe_clus);
             if(probe_clus>=FAT32_VALID_MAX){
                 return false;
             }
         }
-        else{
-            // is the last clus
-            break;
-        }
     }
     return true;
 }
 
+static bool _multi_clus_rw(fs_t * fs, uint32_t start_clus_no, void * buffer , uint32_t offset, uint32_t length,bool write, entry_t * owner){
+    fs_iovec_t iov = {buffer,length};
+    return _multi_clus_rwv(fs,start_clus_no,&iov,1,offset,write,owner);
+}
+
 static inline bool _char_is_upper_or_num(char c){
     return (c>=0x41&&c<=0x5A)||(c>=0x30&&c<=0x39);
 }
@@ -257,24 +731,106 @@ static void _full_name_get_from_data(entry_data_t * entry_data, char * name){
     name[i] = '\0';
 }
 
+static inline uint32_t _entry_name_hash(const char * name){
+    uint32_t hash = 2166136261u;
+    for(;*name!='\0';name++){
+        hash = (hash^(uint8_t)*name)*16777619u;
+    }
+    return hash;
+}
+
+#define ENTRY_HASH_END 0xFFFF
+
+static inline uint32_t _entry_hash(entry_t * parent, uint32_t name_hash){
+    uint32_t hash = ((uint32_t)((size_t)parent>>4)^name_hash)*2654435761u;
+    return (hash^(hash>>16))&(CONFIG_FS_ENTRY_HASH_CNT-1);
+}
+
+/*!
+ * @note sync the packed key of entry after it`s parent or name changes,
+ *       and move the entry to the hash chain of new key.
+ *       entries without parent are in no chain.
+ * @warning must hold cache`s write lock.
+ */
+static inline void _entry_key_update(entry_t * entry){
+    uint16_t const index = entry-entry_cache.buffer;
+    entry_key_t * key = &entry_cache.keys[index];
+    if(key->parent!=NULL){
+        uint16_t * link = &entry_cache.hash_heads[_entry_hash(key->parent,key->name_hash)];
+        while(*link!=index){
+            link = &entry_cache.hash_next[*link];
+        }
+        *link = entry_cache.hash_next[index];
+    }
+    key->parent = entry->parent;
+    key->name_hash = entry->parent == NULL?0:_entry_name_hash(entry->filename);
+    if(key->parent!=NULL){
+        uint16_t * head = &entry_cache.hash_heads[_entry_hash(key->parent,key->name_hash)];
+        entry_cache.hash_next[index] = *head;
+        *head = index;
+    }
+}
+
+/*!
+ * @note drop the refs taken on cached entries under cache lock.
+ * @warning the locks of entries must be released before.
+ */
+static void _entry_unpin(entry_t ** entries, uint32_t cnt){
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    for(uint32_t i = 0;i<cnt;i++){
+        entries[i]->ref_cnt--;
+    }
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+}
+
+/*!
+ * @note give entry a new write stamp,which is never given before,
+ *       so the copies of it`s data made under the old one are stale.
+ *       the stamp is read without entry`s lock by the holders of ref.
+ * @warning must hold entry`s write lock,or the entry is not shared yet.
+ */
+static inline void _entry_stamp(entry_t * entry){
+    __atomic_store_n(&entry->write_stamp,__atomic_add_fetch(&entry_cache.write_stamp,1,__ATOMIC_RELAXED),__ATOMIC_RELEASE);
+}
+
+/*!
+ * @note find a cached sub entry by the packed keys.
+ * @warning must hold cache`s lock.
+ * @return NULL when the entry is not cached.
+ */
+static entry_t * _entry_cache_find(entry_t * parent, const char * name){
+    uint32_t const hash = _entry_name_hash(name);
+    uint16_t index = entry_cache.hash_heads[_entry_hash(parent,hash)];
+    for(;index!=ENTRY_HASH_END;index = entry_cache.hash_next[index]){
+        if(entry_cache.keys[index].parent == parent&&entry_cache.keys[index].name_hash == hash
+           &&strcmp(entry_cache.buffer[index].filename,name) == 0){
+            return &entry_cache.buffer[index];
+        }
+    }
+    return NULL;
+}
+
 /*!
  * @note load entry to cache.
  * @warning Must Invoking With Holding
- *          entry Write Lock and parent`s
- *          Read or Write Lock.
+ *          entry Write Lock,parent`s
+ *          Read or Write Lock and cache`s
+ *          Write Lock.
  * @param entry
  * @param first_clus_no : the entry`s first cluster number.
  */
 static bool _entry_load(entry_t * parent, const char * name, entry_t * entry){
+    fs_t * fs = parent->fs;
     if(parent->attr!=ENTRY_ATTR_DIR){
         PANIC("Parent is not a dir!\n");
     }
+    FS_TRACE_BEGIN(trace_start);
     char name_buffer[MAX_FULL_NAME];
     entry_data_t entry_data;
     uint32_t clus_no = parent->first_clus_no;
     uint32_t offset = 0;
     for (;;offset += 32) {
-        if (!_multi_clus_rw(clus_no, &entry_data, offset, 32, false)) {
+        if (!_multi_clus_rw(fs,clus_no, &entry_data, offset, 32, false, NULL)) {
             goto not_find;
         }
         bool all_zero_flag = true;
@@ -298,9 +854,12 @@ static bool _entry_load(entry_t * parent, const char * name, entry_t * entry){
         }
     }
     not_find:
+    FS_TRACE_END(trace_start,"entry_load",offset);
     return false;
     success_get:
+    FS_TRACE_END(trace_start,"entry_load",offset);
     strncpy(entry->filename,name_buffer,MAX_FULL_NAME);
+    entry->fs = fs;
     entry->dirty = false;
     entry->first_clus_no = (entry_data.first_clus_high<<16)|entry_data.first_clus_low;
     entry->parent = parent;
@@ -308,165 +867,251 @@ static bool _entry_load(entry_t * parent, const char * name, entry_t * entry){
     entry->file_size = entry_data.file_size;
     entry->attr = entry_data.attr;
     entry->offset_in_dir = offset;
+    entry->tomb_cnt = 0;
+    entry->batch = NULL;
+    entry->sync_sec_cnt = 0;
+    entry->delay_cnt = 0;
+    _entry_stamp(entry);
+    _entry_key_update(entry);
     return true;
 }
 
 
+/*!
+ * @note alloc one contiguous extent for the delayed blocks
+ *       of a file and bind the blocks to its sectors in order.
+ *       the blocks become normal dirty blocks of the file.
+ * @warning must hold entry`s write lock.
+ * @param entry
+ */
+static void _entry_delay_flush(entry_t * entry){
+    fs_t * fs = entry->fs;
+    if(entry->delay_cnt == 0){
+        return;
+    }
+    uint32_t const sec_per_clus = fs->bpb.sec_per_clus;
+    uint32_t clus_cnt = (entry->delay_cnt+sec_per_clus-1)>>fs->geo.spc_shift;
+    uint32_t last_clus = 0;
+    if(entry->first_clus_no!=0){
+        uint32_t chain_cnt;
+        last_clus = _clus_chain_last(fs,entry->first_clus_no,&chain_cnt);
+    }
+    // the clusters filled by delayed blocks totally don`t need clear.
+    uint32_t clus_no = _clus_chain_extend(fs,last_clus,clus_cnt,0,entry->delay_cnt>>fs->geo.spc_shift,entry);
+    if(entry->first_clus_no == 0){
+        entry->first_clus_no = clus_no;
+    }
+    for(uint32_t i = 0;i<entry->delay_cnt;i++){
+        if(i>0&&(i&fs->geo.spc_mask) == 0){
+            clus_no = _fat_read(fs,clus_no);
+        }
+        uint32_t sec = _first_sec_in_clus(fs,clus_no)+(i&fs->geo.spc_mask);
+        block_bind_anon(entry->delay_blocks[i],sec,fs->dev_no);
+        entry->delay_blocks[i] = NULL;
+        _entry_track_sec(entry,sec);
+    }
+    entry->delay_base+=clus_cnt*fs->byts_per_clus;
+    entry->delay_cnt = 0;
+    entry->dirty = true;
+}
+
+/*!
+ * @note drop the delayed blocks of a file without writing.
+ * @warning must hold entry`s write lock.
+ */
+static void _entry_delay_drop(entry_t * entry){
+    for(uint32_t i = 0;i<entry->delay_cnt;i++){
+        block_put_anon(entry->delay_blocks[i]);
+        entry->delay_blocks[i] = NULL;
+    }
+    entry->delay_cnt = 0;
+}
+
 /*!
  * @note store entry from cache to block layer.
- * @warning Must Invoking With Holding Entry`s Write
- *          And Parent`s Write Lock.
+ *       the dirent is changed under parent`s dirent lock,
+ *       so it isn`t lost in a rewrite of parent`s dirents.
+ * @warning Must Invoking With Holding Entry`s Write Lock,
+ *          And Not Holding Parent`s Dirent Lock.
  * @param entry
  */
 static bool _entry_flush(entry_t * entry){
+    fs_t * fs = entry->fs;
     if(entry->parent==NULL||entry->parent == ROOT_PARENT||(!entry->dirty)){
         return false;
     }
     entry_t * parent = entry->parent;
     entry_data_t data;
-    if(!_multi_clus_rw(parent->first_clus_no,&data,entry->offset_in_dir,32,false)){
-        return false;
-    }
-
-    data.file_size = entry->file_size;
-    data.attr = entry->attr;
-    data.first_clus_low = entry->first_clus_no<<16>>16;
-    data.first_clus_high = entry->first_clus_no>>16;
-    if(!_full_name_put_to_data(&data,entry->filename)){
-        // filename is invalid
-        return false;
+    bool ret = false;
+    fs_stub_rw_w_lock_acquire(&parent->dirent_lock);
+    if(_multi_clus_rw(fs,parent->first_clus_no,&data,entry->offset_in_dir,32,false,NULL)){
+        data.file_size = entry->file_size;
+        data.attr = entry->attr;
+        data.first_clus_low = entry->first_clus_no<<16>>16;
+        data.first_clus_high = entry->first_clus_no>>16;
+        // an invalid filename is not written.
+        ret = _full_name_put_to_data(&data,entry->filename)
+              &&_multi_clus_rw(fs,parent->first_clus_no,&data,entry->offset_in_dir,32,true,entry);
     }
-    return _multi_clus_rw(parent->first_clus_no,&data,entry->offset_in_dir,32,true);
+    fs_stub_rw_w_lock_release(&parent->dirent_lock);
+    return ret;
 }
 
 /*!
  * @note write back all of dirty entry in cache to block layer.
+ *       every entry is held by a ref when it`s lock is waited.
  * @warning don`t hold any entry`s lock.
  */
 void entry_flush_all(){
-    fs_stub_rw_r_lock_acquire(&entry_cache.rw_lock);
-    entry_t * probe_entry;
-    for(dnode_t * probe = entry_cache.dlink.head;probe!=NULL;probe = probe->next){
-        probe_entry = probe->data;
-        if(probe_entry->dirty){
-            if(probe_entry->parent!=NULL&&probe_entry->parent!=ROOT_PARENT){
-                fs_stub_rw_w_lock_acquire(&probe_entry->parent->rw_lock);
-                fs_stub_rw_w_lock_acquire(&probe_entry->rw_lock);
-                probe_entry->parent->dirty = true;
-                _entry_flush(probe_entry);
-                fs_stub_rw_w_lock_release(&probe_entry->rw_lock);
-                fs_stub_rw_w_lock_release(&probe_entry->parent->rw_lock);
-            }
+    FS_TRACE_BEGIN(trace_start);
+    for(uint32_t i = 0;i<CONFIG_FS_ENTRY_CACHE_CNT;i++){
+        entry_t * probe_entry = &entry_cache.buffer[i];
+        fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+        bool flush = (probe_entry->dirty||probe_entry->delay_cnt>0)
+                     &&probe_entry->parent!=NULL&&probe_entry->parent!=ROOT_PARENT;
+        if(flush){
+            probe_entry->ref_cnt++;
+        }
+        fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+        if(flush){
+            fs_stub_rw_w_lock_acquire(&probe_entry->rw_lock);
+            _entry_delay_flush(probe_entry);
+            _entry_flush(probe_entry);
+            fs_stub_rw_w_lock_release(&probe_entry->rw_lock);
+            _entry_unpin(&probe_entry,1);
+        }
+    }
+    FS_TRACE_END(trace_start,"entry_flush_all",0);
+}
+
+/*!
+ * @note write back the dirent and the dirty sectors of one entry
+ *       in sector order,including data,FAT and directory sectors
+ *       dirtied for it,and then sync the device.
+ *       the other dirty blocks in cache are not touched.
+ * @warning must hold entry`s write lock.
+ * @param entry
+ */
+void entry_fsync(entry_t * entry){
+    ASSERT(entry!=NULL,"entry is invalid!\n");
+    FS_TRACE_BEGIN(trace_start);
+    _entry_delay_flush(entry);
+    _entry_flush(entry);
+    _entry_sync_secs(entry);
+    fs_stub_source_sync(entry->fs->dev_no);
+    FS_TRACE_END(trace_start,"entry_fsync",entry->file_size);
+}
+
+/*!
+ * @note take the idle entry nearest to tail and write it back,
+ *       with the sectors tracked for it`s fsync.
+ *       the evicted entry can`t be found by it`s old name.
+ *       an idle entry is locked by nobody,so it`s lock is only
+ *       tried and the parent is not locked.
+ * @warning must hold cache`s write lock.
+ * @return idle entry with write lock or NULL when all entries are busy.
+ */
+static entry_t * _entry_evict_idle(){
+    for(dnode_t * probe = entry_cache.dlink.tail;probe!=NULL;probe=probe->prev){
+        entry_t * entry = probe->data;
+        if(entry->ref_cnt!=0||!fs_stub_rw_w_lock_try_acquire(&entry->rw_lock)){
+            continue;
+        }
+        if(entry->parent!=NULL){
+            // root can`t be idle entry, so don`t consider this case.
+            _entry_delay_flush(entry);
+            _entry_flush(entry);
+            // the tracked sectors are lost with the entry,so they are
+            // written now,the fsync after it`s reload can`t find them.
+            _entry_sync_secs(entry);
+            entry->parent->ref_cnt--;
+            entry->parent = NULL;
+            entry->filename[0] = '\0';
+            _entry_key_update(entry);
         }
+        return entry;
     }
-    fs_stub_rw_r_lock_release(&entry_cache.rw_lock);
+    return NULL;
 }
 
 /*!
  * @note get a idle entry with holding it`s write lock.
  *       generally invoking by entry_new.
- * @return idle entry or NULL when idle entry not find.
+ * @return idle entry with ref cnt 1 or NULL when idle entry not find.
  */
 entry_t * _entry_get_idle_write(){
-    entry_t * ret = NULL;
     fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
     entry_cache.dirty = true;
-    for(dnode_t * probe = entry_cache.dlink.head;probe!=NULL;probe=probe->prev){
-        entry_t * entry = probe->data;
-        // get entry write lock
-        fs_stub_rw_w_lock_acquire(&entry->rw_lock);
-        if(entry->ref_cnt == 0){
-            // get idle
-            if(entry->parent!=NULL){
-                fs_stub_rw_w_lock_acquire(&entry->parent->rw_lock);
-                entry->parent->dirty = true;
-                _entry_flush(entry);
-                entry->parent->ref_cnt--;
-                fs_stub_rw_w_lock_release(&entry->parent->rw_lock);
-            }
-            ret = entry;
-            break;
-        }
-        fs_stub_rw_w_lock_release(&entry->rw_lock);
+    entry_t * ret = _entry_evict_idle();
+    if(ret!=NULL){
+        ret->ref_cnt = 1;
     }
     fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
     return ret;
 }
 
-static entry_t * _entry_sub_get(entry_t * parent, char * name, bool write){
+/*!
+ * @warning must hold parent`s read or write lock,
+ *          so the sub entry is loaded only once.
+ * @param wait : false to return NULL instead of waiting
+ *               when the entry is held by others.
+ */
+static entry_t * _entry_sub_get(entry_t * parent, char * name, bool write, bool wait){
     //first: search subdir in entry cache
-    fs_stub_rw_r_lock_acquire(&entry_cache.rw_lock);
-    entry_t * entry;
-    entry_t * entry_idle=NULL;
-    for(dnode_t * node_probe = entry_cache.dlink.head;node_probe!=NULL;node_probe=node_probe->next){
-        entry= node_probe->data;
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    entry_t * entry = _entry_cache_find(parent,name);
+    if(entry!=NULL&&!wait){
+        // the lock is only tried,so it`s done under cache lock.
+        bool got = write?fs_stub_rw_w_lock_try_acquire(&entry->rw_lock)
+                        :fs_stub_rw_r_lock_try_acquire(&entry->rw_lock);
+        if(got){
+            entry->ref_cnt++;
+        }
+        fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+        return got?entry:NULL;
+    }
+    if(entry!=NULL){
+        // cache hit!
+        // the ref keeps entry in cache,so it`s lock is waited without cache lock.
+        entry->ref_cnt++;
+        fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
         if(write){
             fs_stub_rw_w_lock_acquire(&entry->rw_lock);
         }
         else{
             fs_stub_rw_r_lock_acquire(&entry->rw_lock);
         }
-        if((strcmp(entry->filename , name) == 0)&&(entry->parent == parent)){
-            // cache hit!
-            fs_stub_rw_r_lock_release(&entry_cache.rw_lock);
-            return entry;
-        }
-        if(entry->ref_cnt == 0){
-            entry_idle = entry;
-        }
-        if(write){
-            fs_stub_rw_w_lock_release(&entry->rw_lock);
-        }
-        else{
-            fs_stub_rw_r_lock_release(&entry->rw_lock);
-        }
+        return entry;
     }
     // not hit !!!
     // load from block
-    if(entry_idle!=NULL){
-        fs_stub_rw_w_lock_acquire(&entry_idle->rw_lock);
-        if(entry_idle->parent!=NULL){
-            // root can`t be idle entry, so don`t consider this case.
-            fs_stub_rw_w_lock_acquire(&entry_idle->parent->rw_lock);
-            entry_idle->parent->dirty = true;
-            _entry_flush(entry_idle);
-            entry_idle->parent->ref_cnt--;
-            fs_stub_rw_w_lock_release(&entry_idle->parent->rw_lock);
-        }
-        fs_stub_rw_w_lock_acquire(&parent->rw_lock);
-        parent->dirty = true;
-        if(!_entry_load(parent, name, entry_idle)){
-            fs_stub_rw_w_lock_release(&parent->rw_lock);
-            if(write){
-                fs_stub_rw_w_lock_release(&entry_idle->rw_lock);
-            }
-            else{
-                fs_stub_rw_r_lock_release(&entry_idle->rw_lock);
-            }
-            fs_stub_rw_r_lock_release(&entry_cache.rw_lock);
-            return NULL;
-        }
-        parent->ref_cnt++;
-        fs_stub_rw_w_lock_release(&parent->rw_lock);
-        if(!write){
-            fs_stub_rw_w_lock_release(&entry_idle->rw_lock);
-            fs_stub_rw_r_lock_acquire(&entry_idle->rw_lock);
-        }
-        fs_stub_rw_r_lock_release(&entry_cache.rw_lock);
-        return entry_idle;
-    }
-    else{
+    entry_t * entry_idle = _entry_evict_idle();
+    if(entry_idle == NULL){
         PANIC("All entries are busy!\n");
         return NULL;
     }
+    if(!_entry_load(parent, name, entry_idle)){
+        fs_stub_rw_w_lock_release(&entry_idle->rw_lock);
+        fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+        return NULL;
+    }
+    parent->ref_cnt++;
+    if(!write){
+        // nobody finds the entry before cache lock is released,
+        // so the read lock is got at once even when not waiting.
+        fs_stub_rw_w_lock_release(&entry_idle->rw_lock);
+        fs_stub_rw_r_lock_acquire(&entry_idle->rw_lock);
+    }
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    return entry_idle;
 }
 
 entry_t * entry_get_sub_read(entry_t * parent, char * name){
-    return _entry_sub_get(parent, name, false);
+    return _entry_sub_get(parent, name, false, true);
 };
 
 entry_t *  entry_get_sub_write(entry_t * parent, char * name){
-    entry_t * entry = _entry_sub_get(parent, name, true);
+    entry_t * entry = _entry_sub_get(parent, name, true, true);
     if(entry == NULL){
         return NULL;
     }
@@ -481,10 +1126,10 @@ entry_t *  entry_get_sub_write(entry_t * parent, char * name){
  * @return
  */
 entry_t * entry_get_read(entry_t * entry){
-    fs_stub_rw_w_lock_acquire(&entry->rw_lock);
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
     entry->ref_cnt++;
-    fs_stub_rw_w_lock_release(&entry->rw_lock);
-    // if the write lock is release here.the ref cnt is not zero,
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    // the ref cnt is not zero,
     // so the cache of this entry can`t be switch.
     fs_stub_rw_r_lock_acquire(&entry->rw_lock);
     return entry;
@@ -497,214 +1142,1642 @@ entry_t * entry_get_read(entry_t * entry){
  * @return
  */
 void entry_get_write(entry_t * entry){
-    fs_stub_rw_w_lock_acquire(&entry->rw_lock);
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
     entry->ref_cnt++;
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    fs_stub_rw_w_lock_acquire(&entry->rw_lock);
     entry->dirty = true;
 }
 
+/*!
+ * @note let ref cnt of entry increase without lock,the entry
+ *       stays in cache,but it can be written,moved and resized
+ *       by others. it can`t be removed until entry_unpin.
+ * @warning must hold entry`s lock or ref.
+ * @param entry
+ * @return
+ */
+entry_t * entry_pin(entry_t * entry){
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    entry->ref_cnt++;
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    return entry;
+}
+
+void entry_unpin(entry_t * entry){
+    _entry_unpin(&entry,1);
+}
+
+// the lock is released before the ref,so an idle entry is never locked.
 void entry_put_read(entry_t * entry) {
     fs_stub_rw_r_lock_release(&entry->rw_lock);
-    fs_stub_rw_w_lock_acquire(&entry->rw_lock);
-    entry->ref_cnt--;
-    fs_stub_rw_w_lock_release(&entry->rw_lock);
+    _entry_unpin(&entry,1);
 }
 
 void entry_put_write(entry_t * entry){
-    entry->ref_cnt--;
+    // the delayed data get clusters when the file is closed.
+    _entry_delay_flush(entry);
     fs_stub_rw_w_lock_release(&entry->rw_lock);
+    _entry_unpin(&entry,1);
 }
 
+/*!
+ * @note scan a dir to the end of dirents,
+ *       the deleted dirents are counted on the way.
+ * @return bytes of dirents in dir.
+ */
 static uint32_t _get_dir_file_size(entry_t * entry){
     ASSERT(entry!=NULL&&entry->attr!=ENTRY_ATTR_ARCHIVE,"entry is not dir!\n");
+    fs_t * fs = entry->fs;
     char data_buffer[32];
     int off = 0;
+    uint32_t tomb_cnt = 0;
     for(;;off+=32){
         bool all_zero_flag = true;
-        if(_multi_clus_rw(entry->first_clus_no, data_buffer,off,32,false)){
+        if(_multi_clus_rw(fs,entry->first_clus_no, data_buffer,off,32,false,NULL)){
             for(int i = 0;i<32;i++){
                 if(data_buffer[i]!='\0'){
                     all_zero_flag = false;
                 }
             }
-            if(all_zero_flag){
-                break;
+            if(all_zero_flag){
+                break;
+            }
+            if((uint8_t)data_buffer[0] == 0xE5){
+                tomb_cnt++;
+            }
+        }
+        else{
+            break;
+        }
+    }
+    entry->tomb_cnt = tomb_cnt;
+    return off;
+}
+
+/*!
+ * @note check the range of read or write,and alloc
+ *       clusters for the range when write out of
+ *       allocated size.
+ * @warning must hold writing lock when write and read lock when reading.
+ * @param entry
+ * @param offset : start offset of the range.
+ * @param end : end offset of the range.
+ * @param write
+ */
+static void _entry_rw_prepare(entry_t * entry, uint32_t offset, uint32_t end, bool write){
+    fs_t * fs = entry->fs;
+    uint32_t file_size;
+    if(entry->attr==ENTRY_ATTR_ARCHIVE){
+        file_size = entry->file_size;
+    }
+    else{
+        file_size = _get_dir_file_size(entry);
+    }
+    uint32_t clus_cnt = _clus_cnt_of_size(fs,file_size);
+    if(entry->first_clus_no == 0){
+        // this is a new create file with no cluster allocating.
+        clus_cnt = 0;
+    }
+    else if(clus_cnt == 0){
+        // the first clus is always allocated.
+        clus_cnt = 1;
+    }
+    uint32_t allocated_size = clus_cnt * fs->byts_per_clus;
+    uint32_t last_clus = 0;
+    if(write&&end > allocated_size&&entry->first_clus_no!=0){
+        // the chain may be longer than file size when preallocated,
+        // so count the clusters in chain.
+        last_clus = _clus_chain_last(fs,entry->first_clus_no,&clus_cnt);
+        allocated_size = clus_cnt * fs->byts_per_clus;
+    }
+    if(end > allocated_size){
+        if(write){
+            // alloc more cluster
+            uint32_t alloc_clus_cnt = _clus_cnt_of_size(fs,end - allocated_size);
+            // the clusters covered totally by this write don`t need clear.
+            // for file,the gap before offset is filled by _entry_fill_zero.
+            uint32_t cover_start = offset;
+            if(entry->attr==ENTRY_ATTR_ARCHIVE&&cover_start>allocated_size){
+                cover_start = allocated_size;
+            }
+            uint32_t keep_from = _clus_cnt_of_size(fs,cover_start);
+            uint32_t keep_to = end>>fs->geo.clus_shift;
+            keep_from = keep_from>clus_cnt?keep_from-clus_cnt:0;
+            keep_to = keep_to>clus_cnt?keep_to-clus_cnt:0;
+            uint32_t first_new = _clus_chain_extend(fs,last_clus,alloc_clus_cnt,keep_from,keep_to,entry);
+            if(entry->first_clus_no == 0){
+                entry->first_clus_no = first_new;
+            }
+        }
+        else{
+            // if read out of the file size,panic
+            PANIC("Read Out Of File!\n");
+        }
+    }
+    if(write&&entry->attr == ENTRY_ATTR_ARCHIVE&&end>entry->file_size){
+        entry->file_size = end;
+    }
+}
+
+/*!
+ * @note fill a range of file with zero.
+ * @warning must hold entry`s write lock,and the range
+ *          must be allocated.
+ */
+static void _entry_fill_zero(entry_t * entry, uint32_t from, uint32_t to){
+    fs_t * fs = entry->fs;
+    static const byte zero[CONFIG_FS_BLOCK_SIZE];
+    while(from<to){
+        uint32_t len = to-from;
+        if(len>CONFIG_FS_BLOCK_SIZE){
+            len = CONFIG_FS_BLOCK_SIZE;
+        }
+        _multi_clus_rw(fs,entry->first_clus_no,(void *)zero,from,len,true,entry);
+        from+=len;
+    }
+}
+
+/*!
+ * @note cut a group of buffers to [skip,skip+length).
+ * @param out : must have iov_cnt items.
+ * @return count of buffers in out.
+ */
+static uint32_t _iov_slice(const fs_iovec_t * iov, uint32_t iov_cnt, uint32_t skip, uint32_t length, fs_iovec_t * out){
+    uint32_t out_cnt = 0;
+    for(uint32_t i = 0;i<iov_cnt&&length>0;i++){
+        if(skip>=iov[i].length){
+            skip-=iov[i].length;
+            continue;
+        }
+        uint32_t len = iov[i].length-skip;
+        if(len>length){
+            len = length;
+        }
+        out[out_cnt].base = (byte *)iov[i].base+skip;
+        out[out_cnt].length = len;
+        out_cnt++;
+        length-=len;
+        skip = 0;
+    }
+    return out_cnt;
+}
+
+/*!
+ * @note copy between a group of buffers at skip and data.
+ * @param to_data : copy from buffers to data when true.
+ */
+static void _iov_copy(const fs_iovec_t * iov, uint32_t iov_cnt, uint32_t skip, byte * data, uint32_t length, bool to_data){
+    for(uint32_t i = 0;i<iov_cnt&&length>0;i++){
+        if(skip>=iov[i].length){
+            skip-=iov[i].length;
+            continue;
+        }
+        uint32_t len = iov[i].length-skip;
+        if(len>length){
+            len = length;
+        }
+        if(to_data){
+            memcpy(data,(byte *)iov[i].base+skip,len);
+        }
+        else{
+            memcpy((byte *)iov[i].base+skip,data,len);
+        }
+        data+=len;
+        length-=len;
+        skip = 0;
+    }
+}
+
+/*!
+ * @note read or write the clusters of a file directly.
+ * @param skip : bytes to skip in buffers.
+ */
+static void _entry_rwv_direct(entry_t * entry, const fs_iovec_t * iov, uint32_t iov_cnt, uint32_t skip, uint32_t offset, uint32_t length, bool write){
+    fs_t * fs = entry->fs;
+    fs_iovec_t slice[iov_cnt];
+    uint32_t slice_cnt = _iov_slice(iov,iov_cnt,skip,length,slice);
+    uint32_t file_size = entry->file_size;
+    _entry_rw_prepare(entry,offset,offset+length,write);
+    if(write&&entry->attr==ENTRY_ATTR_ARCHIVE&&offset>file_size){
+        // the gap may be in clusters which are not cleared.
+        _entry_fill_zero(entry,file_size,offset);
+    }
+    // do read or write
+    _multi_clus_rwv(fs,entry->first_clus_no,slice,slice_cnt,offset,write,write?entry:NULL);
+}
+
+/*!
+ * @note get the allocated size of a file,which is enough for end.
+ */
+static uint32_t _entry_allocated_size(entry_t * entry, uint32_t end){
+    fs_t * fs = entry->fs;
+    if(entry->first_clus_no == 0){
+        return 0;
+    }
+    uint32_t clus_cnt = _clus_cnt_of_size(fs,entry->file_size);
+    if(clus_cnt == 0){
+        clus_cnt = 1;
+    }
+    if(end>clus_cnt*fs->byts_per_clus){
+        // maybe preallocated
+        _clus_chain_last(fs,entry->first_clus_no,&clus_cnt);
+    }
+    return clus_cnt*fs->byts_per_clus;
+}
+
+/*!
+ * @note get anonymous block for delayed data.
+ *       when too many anonymous blocks are used,the delayed
+ *       data of other files get clusters to release blocks.
+ *       the caller holds entry`s lock and maybe it`s ancestors,
+ *       so the other entries are only try locked under the
+ *       cache lock,and the busy ones are skipped.
+ * @warning must hold entry`s write lock.
+ * @return NULL when no anonymous block.
+ */
+static block_t * _entry_delay_block_get(entry_t * entry){
+    block_t * block = block_get_anon();
+    if(block!=NULL){
+        return block;
+    }
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    for(dnode_t * probe = entry_cache.dlink.head;probe!=NULL;probe = probe->next){
+        entry_t * probe_entry = probe->data;
+        if(probe_entry!=entry&&probe_entry->delay_cnt>0
+           &&fs_stub_rw_w_lock_try_acquire(&probe_entry->rw_lock)){
+            _entry_delay_flush(probe_entry);
+            fs_stub_rw_w_lock_release(&probe_entry->rw_lock);
+        }
+    }
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    return block_get_anon();
+}
+
+/*!
+ * @note let file size cover the bytes written before offset,
+ *       they are data of this write or filled with zero,so the
+ *       direct write after them doesn`t fill them with zero again.
+ */
+static inline void _entry_size_cover(entry_t * entry, uint32_t offset, bool write){
+    if(write&&offset>entry->file_size){
+        entry->file_size = offset;
+    }
+}
+
+/*!
+ * @note read or write the delayed part of a file,
+ *       which starts from entry->delay_base.
+ *       written data is kept in anonymous blocks until
+ *       flush,close or too many delayed blocks.
+ * @param skip : bytes to skip in buffers.
+ */
+static void _entry_rwv_delay(entry_t * entry, const fs_iovec_t * iov, uint32_t iov_cnt, uint32_t skip, uint32_t offset, uint32_t length, bool write){
+    uint32_t end = offset+length;
+    if(!write){
+        if(end>entry->delay_base+entry->delay_cnt*CONFIG_FS_BLOCK_SIZE){
+            PANIC("Read Out Of File!\n");
+        }
+    }
+    else if(offset>entry->file_size&&entry->file_size<entry->delay_base){
+        // the gap in allocated clusters may be not cleared.
+        _entry_fill_zero(entry,entry->file_size,offset<entry->delay_base?offset:entry->delay_base);
+    }
+    while(length>0){
+        if(offset<entry->delay_base){
+            // the part which gets clusters.
+            uint32_t direct_len = entry->delay_base-offset;
+            if(direct_len>length){
+                direct_len = length;
+            }
+            _entry_size_cover(entry,offset,write);
+            _entry_rwv_direct(entry,iov,iov_cnt,skip,offset,direct_len,write);
+            skip+=direct_len;
+            offset+=direct_len;
+            length-=direct_len;
+            continue;
+        }
+        uint32_t index = (offset-entry->delay_base)/CONFIG_FS_BLOCK_SIZE;
+        if(index>=CONFIG_FS_ENTRY_DELAY_BLOCK_CNT){
+            if(entry->delay_cnt == 0){
+                // too far from allocated end.
+                break;
+            }
+            _entry_delay_flush(entry);
+            continue;
+        }
+        while(entry->delay_cnt<=index){
+            block_t * block = _entry_delay_block_get(entry);
+            if(block == NULL){
+                break;
+            }
+            entry->delay_blocks[entry->delay_cnt] = block;
+            entry->delay_cnt++;
+        }
+        if(entry->delay_cnt<=index){
+            // no anonymous block.
+            break;
+        }
+        uint32_t offset_in_block = (offset-entry->delay_base)%CONFIG_FS_BLOCK_SIZE;
+        uint32_t rw_len = CONFIG_FS_BLOCK_SIZE-offset_in_block;
+        if(rw_len>length){
+            rw_len = length;
+        }
+        _iov_copy(iov,iov_cnt,skip,entry->delay_blocks[index]->data+offset_in_block,rw_len,write);
+        skip+=rw_len;
+        offset+=rw_len;
+        length-=rw_len;
+    }
+    if(length>0){
+        // can`t delay,write directly.
+        _entry_delay_flush(entry);
+        _entry_size_cover(entry,offset,write);
+        _entry_rwv_direct(entry,iov,iov_cnt,skip,offset,length,write);
+    }
+    if(write&&end>entry->file_size){
+        entry->file_size = end;
+    }
+}
+
+/*!
+ * @note read or write a file.
+ * @warning must hold writing lock when write and read lock when reading.
+ *          don`t hold parent entry`s lock.
+ * @param entry
+ * @param buffer
+ * @param offset
+ * @param length
+ * @param write
+ */
+void entry_rw(entry_t * entry,void * buffer,uint32_t offset, uint32_t length,bool write){
+    fs_iovec_t iov = {buffer,length};
+    entry_rwv(entry,&iov,1,offset,write);
+}
+
+/*!
+ * @note read or write a file with a group of buffers.
+ *       the buffers are treated as one contiguous range
+ *       of file starting at offset,so the size check,
+ *       cluster alloc and chain walk are done only once.
+ *       the data written out of allocated size is delayed
+ *       in cache without clusters,and gets one contiguous
+ *       extent when the file is flushed or closed.
+ * @warning must hold writing lock when write and read lock when reading.
+ *          don`t hold parent entry`s lock.
+ * @param entry
+ * @param iov
+ * @param iov_cnt
+ * @param offset
+ * @param write
+ */
+void entry_rwv(entry_t * entry,const fs_iovec_t * iov,uint32_t iov_cnt,uint32_t offset,bool write){
+    ASSERT(entry!=NULL,"entry is invalid!\n");
+    uint32_t length = 0;
+    for(uint32_t i = 0;i<iov_cnt;i++){
+        length+=iov[i].length;
+    }
+    if(length == 0){
+        return;
+    }
+    FS_TRACE_BEGIN(trace_start);
+    if(write){
+        _entry_stamp(entry);
+    }
+    bool delay = false;
+    if(entry->attr==ENTRY_ATTR_ARCHIVE){
+        if(entry->delay_cnt == 0&&write){
+            entry->delay_base = _entry_allocated_size(entry,offset+length);
+            delay = offset+length>entry->delay_base;
+        }
+        else if(entry->delay_cnt>0&&offset+length>entry->delay_base){
+            delay = true;
+        }
+    }
+    if(delay){
+        _entry_rwv_delay(entry,iov,iov_cnt,0,offset,length,write);
+    }
+    else{
+        _entry_rwv_direct(entry,iov,iov_cnt,0,offset,length,write);
+    }
+    FS_TRACE_END(trace_start,write?"entry_write":"entry_read",length);
+}
+
+/*!
+ * @note reserve clusters for a file up to size.
+ *       the new clusters are contiguous as possible
+ *       and not cleared,file size is not changed.
+ * @warning must hold entry`s write lock.
+ * @param entry
+ * @param size
+ */
+void entry_fallocate(entry_t * entry, uint32_t size){
+    ASSERT(entry!=NULL&&entry->attr==ENTRY_ATTR_ARCHIVE,"entry is not a file!\n");
+    fs_t * fs = entry->fs;
+    _entry_delay_flush(entry);
+    uint32_t want = _clus_cnt_of_size(fs,size);
+    if(want == 0){
+        return;
+    }
+    if(entry->first_clus_no == 0){
+        entry->first_clus_no = _clus_chain_extend(fs,0,want,0,want,entry);
+        entry->dirty = true;
+        return;
+    }
+    uint32_t clus_cnt;
+    uint32_t last_clus = _clus_chain_last(fs,entry->first_clus_no,&clus_cnt);
+    if(want>clus_cnt){
+        _clus_chain_extend(fs,last_clus,want-clus_cnt,0,want-clus_cnt,entry);
+    }
+}
+
+/*!
+ * @note shrink a file to size and free the clusters
+ *       after it,including the preallocated clusters.
+ * @warning must hold entry`s write lock.
+ * @param entry
+ * @param size
+ * @return false when size is bigger than file size.
+ */
+bool entry_truncate(entry_t * entry, uint32_t size){
+    ASSERT(entry!=NULL&&entry->attr==ENTRY_ATTR_ARCHIVE,"entry is not a file!\n");
+    fs_t * fs = entry->fs;
+    if(size>entry->file_size){
+        return false;
+    }
+    _entry_delay_flush(entry);
+    _entry_stamp(entry);
+    entry->file_size = size;
+    entry->dirty = true;
+    if(entry->first_clus_no == 0){
+        return true;
+    }
+    uint32_t keep = _clus_cnt_of_size(fs,size);
+    fat_batch_t batch = {fs,NULL,entry};
+    if(keep == 0){
+        _clus_chain_free(&batch,entry->first_clus_no);
+        entry->first_clus_no = 0;
+    }
+    else{
+        uint32_t clus_no = entry->first_clus_no;
+        for(;keep>1;keep--){
+            clus_no = _fat_read(fs,clus_no);
+            if(clus_no>=FAT32_VALID_MAX){
+                return true;
+            }
+        }
+        uint32_t * item = _fat_batch_item(&batch,clus_no);
+        uint32_t next = *item;
+        *item = FAT32_FILE_END;
+        _clus_chain_free(&batch,next);
+    }
+    _fat_batch_end(&batch);
+    return true;
+}
+
+/*!
+ * @note lend the cache blocks of a file without copy.
+ *       every seg holds a pinned block,so seg->data
+ *       is valid until entry_read_release.
+ *       the range will be cut at file end,and only
+ *       the head of range is lent when segs or the pin
+ *       budget of block cache is not enough,the caller can
+ *       lend again from the end of last seg after release.
+ * @warning must hold entry`s read lock until release.
+ * @param entry
+ * @param offset
+ * @param length
+ * @param segs : seg array to be filled.
+ * @param seg_cnt : max count of segs.
+ * @return count of filled segs.
+ */
+uint32_t entry_read_lend(entry_t * entry, uint32_t offset, uint32_t length, entry_seg_t * segs, uint32_t seg_cnt){
+    ASSERT(entry!=NULL&&segs!=NULL,"entry is invalid!\n");
+    fs_t * fs = entry->fs;
+    uint32_t file_size;
+    if(entry->attr==ENTRY_ATTR_ARCHIVE){
+        file_size = entry->file_size;
+    }
+    else{
+        file_size = _get_dir_file_size(entry);
+    }
+    if(offset>=file_size){
+        return 0;
+    }
+    if(length>file_size-offset){
+        length = file_size-offset;
+    }
+    uint32_t cnt = 0;
+    // lend the blocks in clusters
+    uint32_t clus_end = entry->delay_cnt>0?entry->delay_base:file_size;
+    if(offset<clus_end&&entry->first_clus_no!=0){
+        // relocate the start clus
+        uint32_t clus_no = entry->first_clus_no;
+        fat_walk_t walk = {fs,NULL};
+        for(uint32_t clus_no_offset = offset>>fs->geo.clus_shift;clus_no_offset>0;clus_no_offset--){
+            clus_no = _fat_walk_next(&walk,clus_no);
+            if(clus_no>=FAT32_VALID_MAX){
+                _fat_walk_end(&walk);
+                return 0;
+            }
+        }
+        _fat_walk_end(&walk);
+        uint32_t offset_in_clus = offset&fs->geo.clus_mask;
+        while(offset<clus_end&&length>0&&cnt<seg_cnt){
+            uint32_t sec = _first_sec_in_clus(fs,clus_no) + (offset_in_clus>>fs->geo.sec_shift);
+            uint32_t offset_in_sec = offset_in_clus&fs->geo.sec_mask;
+            uint32_t seg_len = fs->bpb.byts_per_sec - offset_in_sec;
+            if(seg_len>length){
+                seg_len = length;
+            }
+            block_t * block = block_get_read_pinned(sec,fs->dev_no);
+            if(block==NULL){
+                return cnt;
+            }
+            segs[cnt].block = block;
+            segs[cnt].data = block->data + offset_in_sec;
+            segs[cnt].length = seg_len;
+            cnt++;
+            offset+=seg_len;
+            length-=seg_len;
+            offset_in_clus+=seg_len;
+            if(length>0&&offset_in_clus==fs->byts_per_clus){
+                // get next clus
+                clus_no = _fat_read(fs,clus_no);
+                if(clus_no>=FAT32_VALID_MAX){
+                    return cnt;
+                }
+                offset_in_clus = 0;
+            }
+        }
+    }
+    // lend the delayed blocks
+    while(entry->delay_cnt>0&&length>0&&cnt<seg_cnt){
+        uint32_t index = (offset-entry->delay_base)/CONFIG_FS_BLOCK_SIZE;
+        uint32_t offset_in_block = (offset-entry->delay_base)%CONFIG_FS_BLOCK_SIZE;
+        uint32_t seg_len = CONFIG_FS_BLOCK_SIZE-offset_in_block;
+        if(seg_len>length){
+            seg_len = length;
+        }
+        block_t * block = entry->delay_blocks[index];
+        if(!block_pin_read(block)){
+            break;
+        }
+        segs[cnt].block = block;
+        segs[cnt].data = block->data + offset_in_block;
+        segs[cnt].length = seg_len;
+        cnt++;
+        offset+=seg_len;
+        length-=seg_len;
+    }
+    return cnt;
+}
+
+/*!
+ * @note give back the blocks lent by entry_read_lend.
+ * @param segs
+ * @param seg_cnt : count returned by entry_read_lend.
+ */
+void entry_read_release(entry_seg_t * segs, uint32_t seg_cnt){
+    for(uint32_t i = 0;i<seg_cnt;i++){
+        block_put_read_pinned(segs[i].block);
+        segs[i].block = NULL;
+        segs[i].data = NULL;
+    }
+}
+
+/*!
+ * @note map a range of file to extents of contiguous sectors,
+ *       the chain is walked only once. the delayed data
+ *       without clusters is not mapped.
+ * @warning must hold entry`s read or write lock.
+ * @param entry
+ * @param offset : aligned to sector.
+ * @param length : aligned to sector.
+ * @param extents
+ * @param extent_cnt : size of extents.
+ * @return count of extents,the mapping stops when extents
+ *         are used up or chain ends.
+ */
+uint32_t entry_extent_map(entry_t * entry, uint32_t offset, uint32_t length, entry_extent_t * extents, uint32_t extent_cnt){
+    fs_t * fs = entry->fs;
+    ASSERT(((offset|length)&fs->geo.sec_mask) == 0,"range is not aligned to sector!\n");
+    if(length == 0||extent_cnt == 0||entry->first_clus_no == 0){
+        return 0;
+    }
+    uint32_t clus_no = entry->first_clus_no;
+    for(uint32_t clus_no_offset = offset>>fs->geo.clus_shift;clus_no_offset>0;clus_no_offset--){
+        clus_no = _fat_read(fs,clus_no);
+        if(clus_no>=FAT32_VALID_MAX){
+            return 0;
+        }
+    }
+    uint32_t cnt = 0;
+    uint32_t offset_in_clus = offset&fs->geo.clus_mask;
+    while(length>0){
+        uint32_t len = fs->byts_per_clus-offset_in_clus;
+        if(len>length){
+            len = length;
+        }
+        uint32_t sec = _first_sec_in_clus(fs,clus_no)+(offset_in_clus>>fs->geo.sec_shift);
+        if(cnt>0&&extents[cnt-1].sec+extents[cnt-1].sec_cnt == sec){
+            extents[cnt-1].sec_cnt+=len>>fs->geo.sec_shift;
+        }
+        else{
+            if(cnt == extent_cnt){
+                break;
+            }
+            extents[cnt].offset = offset;
+            extents[cnt].sec = sec;
+            extents[cnt].sec_cnt = len>>fs->geo.sec_shift;
+            cnt++;
+        }
+        offset+=len;
+        length-=len;
+        offset_in_clus+=len;
+        if(length>0&&offset_in_clus == fs->byts_per_clus){
+            clus_no = _fat_read(fs,clus_no);
+            if(clus_no>=FAT32_VALID_MAX){
+                break;
+            }
+            offset_in_clus = 0;
+        }
+    }
+    return cnt;
+}
+
+/*!
+ * @note walk a chain and count it`s clusters and extents.
+ * @param clus_cnt : count of clusters in chain.
+ * @return count of extents of contiguous clusters.
+ */
+static uint32_t _clus_chain_extents(fs_t * fs, uint32_t clus_no, uint32_t * clus_cnt){
+    uint32_t cnt = 0;
+    uint32_t prev = 0;
+    *clus_cnt = 0;
+    for(;clus_no>=2&&clus_no<FAT32_VALID_MAX;clus_no = _fat_read(fs,clus_no)){
+        if(clus_no!=prev+1){
+            cnt++;
+        }
+        prev = clus_no;
+        (*clus_cnt)++;
+    }
+    return cnt;
+}
+
+/*!
+ * @note measure fragmentation of a file.
+ * @warning must hold entry`s read or write lock.
+ * @return count of extents of contiguous clusters,
+ *         1 for a contiguous file and 0 for an empty file.
+ */
+uint32_t entry_extent_cnt(entry_t * entry){
+    uint32_t clus_cnt;
+    return _clus_chain_extents(entry->fs,entry->first_clus_no,&clus_cnt);
+}
+
+/*!
+ * @note count the clusters copied by defrag,the rate is
+ *       kept by _defrag_throttle after the file is unlocked.
+ */
+static void _defrag_account(defrag_t * defrag, uint32_t clus_cnt){
+    if(defrag->start_ns == 0){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        defrag->start_ns = (unsigned long long)now.tv_sec*1000000000ULL+now.tv_nsec;
+    }
+    defrag->moved_clus_cnt+=clus_cnt;
+}
+
+/*!
+ * @note sleep until the clusters copied by defrag fit in it`s rate,
+ *       so the foreground I/O gets the device most of time.
+ * @warning don`t hold the lock of moved file.
+ */
+static void _defrag_throttle(defrag_t * defrag){
+    if(defrag->rate == 0||defrag->start_ns == 0){
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    unsigned long long now_ns = (unsigned long long)now.tv_sec*1000000000ULL+now.tv_nsec;
+    unsigned long long due_ns = defrag->start_ns+defrag->moved_clus_cnt*1000000000ULL/defrag->rate;
+    if(due_ns>now_ns){
+        struct timespec wait = {(due_ns-now_ns)/1000000000ULL,(due_ns-now_ns)%1000000000ULL};
+        nanosleep(&wait,NULL);
+    }
+}
+
+/*!
+ * @note copy a batch of sectors from old chain to new chain,
+ *       the old sectors are prefetched at once.
+ */
+static void _defrag_copy(entry_t * entry, const uint32_t * old_secs, const uint32_t * new_secs, uint32_t cnt){
+    fs_t * fs = entry->fs;
+    block_prefetch(old_secs,cnt,fs->dev_no);
+    for(uint32_t i = 0;i<cnt;i++){
+        block_t * from = block_get_read(old_secs[i],fs->dev_no);
+        block_t * to = block_get_overwrite(new_secs[i],fs->dev_no);
+        memcpy(to->data,from->data,CONFIG_FS_BLOCK_SIZE);
+        block_put_write(to);
+        block_put_read(from);
+        _entry_track_sec(entry,new_secs[i]);
+    }
+}
+
+/*!
+ * @note rewrite a fragmented file into one run of free clusters.
+ *       the data is copied to the new run,then first_clus_no
+ *       is switched and the old chain is freed,all under the
+ *       write lock,so the readers see old chain or new chain.
+ *       the copied clusters are counted in defrag,but it never
+ *       sleeps with the lock held,fat32_defrag keeps the rate
+ *       between files.
+ * @warning must hold entry`s write lock.
+ * @param entry
+ * @param defrag
+ * @return true when the file is moved,false when it isn`t
+ *         fragmented or no run is long enough.
+ */
+bool entry_defrag(entry_t * entry, defrag_t * defrag){
+    fs_t * fs = entry->fs;
+    if(entry->attr!=ENTRY_ATTR_ARCHIVE){
+        return false;
+    }
+    defrag->file_cnt++;
+    // the delayed data is allocated first,so it is moved with the file.
+    _entry_delay_flush(entry);
+    uint32_t clus_cnt;
+    uint32_t extent_cnt = _clus_chain_extents(fs,entry->first_clus_no,&clus_cnt);
+    if(extent_cnt<(defrag->min_extent_cnt>2?defrag->min_extent_cnt:2)){
+        return false;
+    }
+    defrag->frag_file_cnt++;
+    uint32_t run_len;
+    uint32_t run = _clus_find_run(fs,0,clus_cnt,&run_len);
+    if(run_len<clus_cnt){
+        return false;
+    }
+    // the new clusters are overwritten totally,so they aren`t cleared.
+    // the extend searches from the run found,which is claimed at once.
+    uint32_t new_first = _clus_chain_extend_at(fs,run,0,clus_cnt,0,clus_cnt,entry);
+    uint32_t old_secs[CONFIG_FS_READAHEAD_CNT];
+    uint32_t new_secs[CONFIG_FS_READAHEAD_CNT];
+    uint32_t cnt = 0;
+    uint32_t old_clus = entry->first_clus_no;
+    uint32_t new_clus = new_first;
+    for(uint32_t i = 0;i<clus_cnt;i++){
+        for(uint32_t k = 0;k<fs->bpb.sec_per_clus;k++){
+            old_secs[cnt] = _first_sec_in_clus(fs,old_clus)+k;
+            new_secs[cnt] = _first_sec_in_clus(fs,new_clus)+k;
+            cnt++;
+            if(cnt == CONFIG_FS_READAHEAD_CNT){
+                _defrag_copy(entry,old_secs,new_secs,cnt);
+                _defrag_account(defrag,cnt>>fs->geo.spc_shift);
+                cnt = 0;
+            }
+        }
+        old_clus = _fat_read(fs,old_clus);
+        new_clus = _fat_read(fs,new_clus);
+    }
+    _defrag_copy(entry,old_secs,new_secs,cnt);
+    _defrag_account(defrag,cnt>>fs->geo.spc_shift);
+    fat_batch_t batch = {fs,NULL,entry};
+    _clus_chain_free(&batch,entry->first_clus_no);
+    _fat_batch_end(&batch);
+    entry->first_clus_no = new_first;
+    entry->dirty = true;
+    defrag->moved_file_cnt++;
+    return true;
+}
+
+/*!
+ * @note defrag a file of dir. the file is checked with read lock
+ *       and only locked for write when it is fragmented,so the
+ *       files kept are not marked dirty. a file held by others,
+ *       e.g. opened by elf64_open,is skipped instead of waited.
+ * @warning must hold dir`s read lock.
+ */
+static void _defrag_file(entry_t * dir, char * name, defrag_t * defrag){
+    entry_t * sub = _entry_sub_get(dir,name,false,false);
+    if(sub == NULL){
+        defrag->busy_file_cnt++;
+        return;
+    }
+    uint32_t const min_extent_cnt = defrag->min_extent_cnt>2?defrag->min_extent_cnt:2;
+    bool const frag = entry_extent_cnt(sub)>=min_extent_cnt;
+    fs_stub_rw_r_lock_release(&sub->rw_lock);
+    if(!frag){
+        defrag->file_cnt++;
+        _entry_unpin(&sub,1);
+        return;
+    }
+    // the ref keeps sub in cache,the write lock is tried again.
+    if(!fs_stub_rw_w_lock_try_acquire(&sub->rw_lock)){
+        defrag->busy_file_cnt++;
+        _entry_unpin(&sub,1);
+        return;
+    }
+    entry_defrag(sub,defrag);
+    fs_stub_rw_w_lock_release(&sub->rw_lock);
+    _entry_unpin(&sub,1);
+    _defrag_throttle(defrag);
+}
+
+/*!
+ * @note defrag the files in a dir and it`s sub dirs.
+ * @warning must hold dir`s read lock.
+ */
+static void _defrag_dir(entry_t * dir, defrag_t * defrag){
+    fs_t * fs = dir->fs;
+    char name[MAX_FULL_NAME];
+    entry_data_t data;
+    for(uint32_t offset = 0;_multi_clus_rw(fs,dir->first_clus_no,&data,offset,sizeof(entry_data_t),false,NULL);offset+=sizeof(entry_data_t)){
+        if(data.name_head[0] == '\0'){
+            break;
+        }
+        if((uint8_t)data.name_head[0] == 0xE5||data.name_head[0] == '.'){
+            continue;
+        }
+        _full_name_get_from_data(&data,name);
+        if(data.attr == ENTRY_ATTR_DIR){
+            entry_t * sub = entry_get_sub_read(dir,name);
+            if(sub!=NULL){
+                _defrag_dir(sub,defrag);
+                entry_put_read(sub);
+            }
+        }
+        else if(data.attr == ENTRY_ATTR_ARCHIVE){
+            _defrag_file(dir,name,defrag);
+        }
+        // the foreground gets a chance between files.
+        sched_yield();
+    }
+}
+
+/*!
+ * @note defrag all files of a volume,it can be run on demand
+ *       or by a background thread. every file is locked only
+ *       while it is moved.
+ * @param fs
+ * @param defrag : rate and min_extent_cnt are set,
+ *                 the counts are added by defrag.
+ */
+void fat32_defrag(fs_t * fs, defrag_t * defrag){
+    ASSERT(fs!=NULL&&fs->mounted,"volume is not mounted!\n");
+    entry_t * root = entry_get_read(fs->root);
+    _defrag_dir(root,defrag);
+    entry_put_read(root);
+}
+
+/*!
+ * @note create a entry and hold it`s write lock.
+ * @warning must hold parent write lock
+ * @param parent
+ * @param name
+ * @param attr
+ * @return new entry with write lock or NULL when fail to create entry.
+ */
+entry_t *entry_create_write(entry_t * parent , char * name , uint8_t attr){
+    ASSERT(parent!=NULL&&parent->attr == ENTRY_ATTR_DIR&&strlen(name)<MAX_FULL_NAME ,"Parent Dir is Not Dir!\n");
+    ASSERT(attr==ENTRY_ATTR_DIR||attr==ENTRY_ATTR_ARCHIVE,"Unexpected attr when create entry!\n");
+    fs_t * fs = parent->fs;
+    entry_t * tmp;
+    if((tmp= entry_get_sub_read(parent, name)) != NULL){
+        // this entry is exist
+        entry_put_read(tmp);
+        return NULL;
+    }
+    entry_data_t new_entry_data;
+    bzero(&new_entry_data,sizeof(entry_data_t));
+    if(!_full_name_put_to_data(&new_entry_data,name)){
+        // name is invalid
+        return NULL;
+    }
+    entry_t * idle = _entry_get_idle_write();
+    if(idle == NULL){
+        PANIC("All entries are busy!\n");
+    }
+    idle->fs = fs;
+    // held with write lock like entry_get_sub_write,the writes before put must reach it`s dirent.
+    idle->dirty = true;
+    idle->attr = attr;
+    idle->tomb_cnt = 0;
+    idle->batch = NULL;
+    idle->sync_sec_cnt = 0;
+    idle->delay_cnt = 0;
+    _entry_stamp(idle);
+    strcpy(idle->filename,name);
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    idle->parent = parent;
+    _entry_key_update(idle);
+    parent->ref_cnt++;
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    if(attr==ENTRY_ATTR_ARCHIVE){
+        idle->first_clus_no = 0;
+        idle->file_size = 0;
+    }
+    else{
+        idle->first_clus_no = _clus_alloc(fs,idle);
+        idle->file_size = 32*2;
+    }
+    new_entry_data.attr = attr;
+    new_entry_data.first_clus_high = idle->first_clus_no>>16;
+    new_entry_data.first_clus_low = idle->first_clus_no<<16>>16;
+    new_entry_data.file_size = idle->file_size;
+    // append the entry to parent,
+    // the parent file size will change.
+    idle->offset_in_dir = _get_dir_file_size(parent);
+    entry_rw(parent,&new_entry_data,idle->offset_in_dir,sizeof(entry_data_t),true);
+    parent->file_size = idle->offset_in_dir+sizeof(entry_data_t);
+    if(attr==ENTRY_ATTR_DIR){
+        // ".." of the dir in root points to clus 0.
+        uint32_t parent_clus = parent->parent == ROOT_PARENT?0:parent->first_clus_no;
+        // add entry "." and ".."
+        entry_data_t buffer[2]={
+                {
+                        ".",
+                        "",
+                        ENTRY_ATTR_DIR,
+                        0,
+                        0,
+                        0,
+                        0,
+                        0,
+                        idle->first_clus_no>>16,
+                        0,
+                        0,
+                        idle->first_clus_no<<16>>16,
+                        idle->file_size
+                },
+                {
+                        "..",
+                        "",
+                        ENTRY_ATTR_DIR,
+                        0,
+                        0,
+                        0,
+                        0,
+                        0,
+                        parent_clus>>16,
+                        0,
+                        0,
+                        parent_clus<<16>>16,
+                        0
+                }
+        };
+        entry_rw(idle,buffer,0,sizeof(entry_data_t)*2,true);
+    }
+    return idle;
+}
+
+
+/*!
+ * @note rewrite the live dirents of a dir densely from start,
+ *       and free the clusters not used after that.
+ *       the cached sub entries move their offset_in_dir
+ *       with their dirents,they are collected and pinned
+ *       under the cache lock first,so no entry lock is
+ *       waited under the cache lock.
+ * @warning must hold dir`s write lock.
+ * @param dir
+ * @return false when there is no deleted dirent.
+ */
+bool entry_dir_compact(entry_t * dir){
+    ASSERT(dir!=NULL&&dir->attr == ENTRY_ATTR_DIR,"entry is not dir!\n");
+    fs_t * fs = dir->fs;
+    uint32_t const end = _get_dir_file_size(dir);
+    if(dir->tomb_cnt == 0){
+        return false;
+    }
+    // no sub entry is loaded while dir is held,so the pinned ones are all.
+    entry_t * subs[CONFIG_FS_ENTRY_CACHE_CNT];
+    uint32_t sub_cnt = 0;
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    for(dnode_t * probe = entry_cache.dlink.head;probe!=NULL;probe = probe->next){
+        entry_t * entry = probe->data;
+        if(entry->parent == dir){
+            entry->ref_cnt++;
+            subs[sub_cnt++] = entry;
+        }
+    }
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    uint32_t const dirent_cnt = end/sizeof(entry_data_t);
+    uint32_t const live_cnt = dirent_cnt-dir->tomb_cnt;
+    uint32_t const new_end = live_cnt*sizeof(entry_data_t);
+    uint32_t clus_cnt = _clus_cnt_of_size(fs,new_end);
+    clus_cnt = clus_cnt == 0?1:clus_cnt;
+    uint32_t const kept_size = clus_cnt<<fs->geo.clus_shift;
+    byte * buffer = calloc(1,end>kept_size?end:kept_size);
+    uint32_t * old_offsets = malloc((live_cnt+1)*sizeof(uint32_t));
+    if(buffer == NULL||old_offsets == NULL){
+        free(buffer);
+        free(old_offsets);
+        _entry_unpin(subs,sub_cnt);
+        return false;
+    }
+    // the pinned entries write their dirents under dirent lock,they can`t be lost in rewrite.
+    fs_stub_rw_w_lock_acquire(&dir->dirent_lock);
+    _multi_clus_rw(fs,dir->first_clus_no,buffer,0,end,false,NULL);
+    uint32_t first_hole = end;
+    uint32_t cnt = 0;
+    for(uint32_t offset = 0;offset<end;offset+=sizeof(entry_data_t)){
+        if(buffer[offset] == 0xE5){
+            first_hole = first_hole<offset?first_hole:offset;
+            continue;
+        }
+        memmove(buffer+cnt*sizeof(entry_data_t),buffer+offset,sizeof(entry_data_t));
+        old_offsets[cnt++] = offset;
+    }
+    // the stale dirents after new end are cleared,so the scans stop at new end.
+    memset(buffer+new_end,0,(end>kept_size?end:kept_size)-new_end);
+    _multi_clus_rw(fs,dir->first_clus_no,buffer+first_hole,first_hole,kept_size-first_hole,true,dir);
+    uint32_t last_clus = dir->first_clus_no;
+    for(uint32_t i = 1;i<clus_cnt;i++){
+        last_clus = _fat_read(fs,last_clus);
+    }
+    uint32_t next = _fat_read(fs,last_clus);
+    if(next>=2&&next<FAT32_VALID_MAX){
+        fat_batch_t batch = {fs,NULL,dir};
+        *_fat_batch_item(&batch,last_clus) = FAT32_FILE_END;
+        _clus_chain_free(&batch,next);
+        _fat_batch_end(&batch);
+    }
+    for(uint32_t i = 0;i<sub_cnt;i++){
+        entry_t * entry = subs[i];
+        uint32_t low = 0;
+        uint32_t high = live_cnt;
+        while(low<high){
+            uint32_t mid = (low+high)/2;
+            if(old_offsets[mid]<entry->offset_in_dir){
+                low = mid+1;
+            }
+            else{
+                high = mid;
+            }
+        }
+        if(low>=live_cnt||old_offsets[low]!=entry->offset_in_dir){
+            // it`s dirent is deleted,nothing to move.
+            continue;
+        }
+        entry->offset_in_dir = low*sizeof(entry_data_t);
+    }
+    fs_stub_rw_w_lock_release(&dir->dirent_lock);
+    _entry_unpin(subs,sub_cnt);
+    free(buffer);
+    free(old_offsets);
+    dir->file_size = new_end;
+    dir->tomb_cnt = 0;
+    dir->dirty = true;
+    return true;
+}
+
+/*!
+ * @note check that a dir holds nothing but "." and "..",
+ *       so removing it can`t leak the clusters of it`s sub entries.
+ * @param first_clus_no first clus of the dir.
+ * @return true when the dir is empty.
+ */
+static bool _dir_clus_is_empty(fs_t * fs, uint32_t first_clus_no){
+    if(first_clus_no==0){
+        return true;
+    }
+    entry_data_t data;
+    for(uint32_t offset = sizeof(entry_data_t)*2;_multi_clus_rw(fs,first_clus_no,&data,offset,sizeof(entry_data_t),false,NULL);offset+=sizeof(entry_data_t)){
+        if(data.name_head[0] == '\0'){
+            break;
+        }
+        if((uint8_t)data.name_head[0] != 0xE5){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+ * @warning must hold parent write lock.And check if the entry is idle.
+ *          a dir can only be removed when it is empty.
+ * @param parent
+ * @param name
+ * @return
+ */
+bool entry_rm_sub(entry_t * parent, char * name){
+    // get target entry with write lock.
+    // if this entry`s sub entry not use and not in cache
+    // the entry`s ref cnt will be 1.
+    entry_t * entry = entry_get_sub_write(parent, name);
+    if(entry==NULL){
+        return false;
+    }
+    if(entry->attr==ENTRY_ATTR_DIR&&!_dir_clus_is_empty(entry->fs,entry->first_clus_no)){
+        entry_put_write(entry);
+        return false;
+    }
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    if(entry->ref_cnt!=1){
+        fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+        entry_put_write(entry);
+        return false;
+    }
+    // target entry can remove
+    // set entry`s parent to NULL,so can`t get from cache by parent and name,
+    // and can`t flush back to block layer automatically.
+    parent->ref_cnt--;
+    entry->parent = NULL;
+    _entry_key_update(entry);
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    uint8_t buffer = 0xE5;
+    entry_rw(parent,&buffer,entry->offset_in_dir,1,true);
+    // release the delayed data and clusters of entry.
+    _entry_delay_drop(entry);
+    if(entry->first_clus_no!=0){
+        fat_batch_t batch = {parent->fs,NULL,parent};
+        _clus_chain_free(&batch,entry->first_clus_no);
+        _fat_batch_end(&batch);
+        entry->first_clus_no = 0;
+    }
+    entry_put_write(entry);
+    // the tombstones before are counted when the dir is scanned by entry_rw.
+    parent->tomb_cnt++;
+    if(parent->tomb_cnt>=CONFIG_FS_DIR_COMPACT_MIN
+       &&parent->tomb_cnt*100>=(parent->file_size/sizeof(entry_data_t))*CONFIG_FS_DIR_COMPACT_RATIO){
+        entry_dir_compact(parent);
+    }
+    return true;
+};
+
+void entry_batch_init(entry_batch_t * batch, fs_t * fs){
+    bzero(batch,sizeof(entry_batch_t));
+    batch->fs = fs;
+}
+
+static entry_batch_op_t * _entry_batch_add(entry_batch_t * batch, entry_batch_kind_t kind, entry_t * dir, const char * name){
+    ASSERT(dir!=NULL&&dir->attr == ENTRY_ATTR_DIR&&dir->fs == batch->fs,"entry is not dir in volume!\n");
+    if(strlen(name)>=MAX_FULL_NAME){
+        return NULL;
+    }
+    if(batch->op_cnt == batch->op_cap){
+        uint32_t cap = batch->op_cap == 0?64:batch->op_cap*2;
+        entry_batch_op_t * ops = realloc(batch->ops,cap*sizeof(entry_batch_op_t));
+        if(ops == NULL){
+            return NULL;
+        }
+        batch->ops = ops;
+        batch->op_cap = cap;
+    }
+    entry_batch_op_t * op = &batch->ops[batch->op_cnt++];
+    bzero(op,sizeof(entry_batch_op_t));
+    op->kind = kind;
+    op->dir = dir;
+    strcpy(op->name,name);
+    return op;
+}
+
+/*!
+ * @note stage a create of an empty file or dir.
+ * @return false when there is no memory to stage.
+ */
+bool entry_batch_create(entry_batch_t * batch, entry_t * dir, const char * name, uint8_t attr){
+    ASSERT(attr==ENTRY_ATTR_DIR||attr==ENTRY_ATTR_ARCHIVE,"Unexpected attr when create entry!\n");
+    entry_batch_op_t * op = _entry_batch_add(batch,ENTRY_BATCH_CREATE,dir,name);
+    if(op == NULL){
+        return false;
+    }
+    op->attr = attr;
+    return true;
+}
+
+/*!
+ * @note stage a remove of a file or dir,
+ *       like entry_rm_sub it fails when the entry is in use
+ *       or is a dir that is not empty.
+ */
+bool entry_batch_remove(entry_batch_t * batch, entry_t * dir, const char * name){
+    return _entry_batch_add(batch,ENTRY_BATCH_REMOVE,dir,name)!=NULL;
+}
+
+/*!
+ * @note stage a size update of a file,the clusters
+ *       are freed or allocated to fit the size,
+ *       and the grown range reads as zero.
+ */
+bool entry_batch_resize(entry_batch_t * batch, entry_t * dir, const char * name, uint32_t size){
+    entry_batch_op_t * op = _entry_batch_add(batch,ENTRY_BATCH_RESIZE,dir,name);
+    if(op == NULL){
+        return false;
+    }
+    op->size = size;
+    return true;
+}
+
+void entry_batch_release(entry_batch_t * batch){
+    free(batch->ops);
+    free(batch->secs);
+    bzero(batch,sizeof(entry_batch_t));
+}
+
+#define DIRENT_INDEX_DEL 0xFFFFFFFF
+
+/*!
+ * @note open addressing index of the dirent names in a dir buffer.
+ *       the slots hold offset+1 of dirent,0 for empty slot.
+ */
+typedef
+struct {
+    const byte * data;
+    uint32_t * slots;
+    uint32_t mask;
+} dirent_index_t;
+
+static inline uint32_t _dirent_name_hash(const char * raw){
+    uint32_t hash = 2166136261u;
+    for(int i = 0;i<11;i++){
+        hash = (hash^(uint8_t)raw[i])*16777619u;
+    }
+    return hash;
+}
+
+/*!
+ * @param raw : 8+3 name padded with space.
+ * @return slot of the dirent named raw,NULL when not found.
+ */
+static uint32_t * _dirent_index_find(dirent_index_t * index, const char * raw){
+    for(uint32_t i = _dirent_name_hash(raw)&index->mask;index->slots[i]!=0;i = (i+1)&index->mask){
+        uint32_t slot = index->slots[i];
+        if(slot!=DIRENT_INDEX_DEL&&memcmp(index->data+slot-1,raw,11) == 0){
+            return &index->slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void _dirent_index_put(dirent_index_t * index, uint32_t offset){
+    uint32_t i = _dirent_name_hash((const char *)index->data+offset)&index->mask;
+    for(;index->slots[i]!=0&&index->slots[i]!=DIRENT_INDEX_DEL;i = (i+1)&index->mask);
+    index->slots[i] = offset+1;
+}
+
+/*!
+ * @note drop the idle cached entry of name in dir,
+ *       so the batch can change it`s dirent directly.
+ * @warning must hold dir`s write lock.
+ * @return false when the entry is in use.
+ */
+static bool _entry_batch_evict(entry_t * dir, const char * name){
+    bool ret = true;
+    // the entry lock comes after the cache lock here,
+    // so only try it,an idle entry is never locked.
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    entry_t * entry = _entry_cache_find(dir,name);
+    if(entry!=NULL){
+        if(entry->ref_cnt!=0||!fs_stub_rw_w_lock_try_acquire(&entry->rw_lock)){
+            ret = false;
+        }
+        else{
+            _entry_delay_flush(entry);
+            _entry_flush(entry);
+            dir->ref_cnt--;
+            entry->parent = NULL;
+            entry->filename[0] = '\0';
+            _entry_key_update(entry);
+            fs_stub_rw_w_lock_release(&entry->rw_lock);
+        }
+    }
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    return ret;
+}
+
+/*!
+ * @note fit the clus chain of a file dirent to size.
+ */
+static void _entry_batch_resize_chain(entry_t * dir, entry_data_t * data, uint32_t size){
+    fs_t * fs = dir->fs;
+    static const byte zero[CONFIG_FS_BLOCK_SIZE];
+    uint32_t first = (data->first_clus_high<<16)|data->first_clus_low;
+    uint32_t const want = _clus_cnt_of_size(fs,size);
+    uint32_t cnt = 0;
+    uint32_t last = 0;
+    if(first!=0){
+        last = _clus_chain_last(fs,first,&cnt);
+    }
+    if(want<cnt){
+        fat_batch_t batch = {fs,NULL,dir};
+        if(want == 0){
+            _clus_chain_free(&batch,first);
+            first = 0;
+        }
+        else{
+            uint32_t clus_no = first;
+            for(uint32_t i = 1;i<want;i++){
+                clus_no = _fat_read(fs,clus_no);
+            }
+            uint32_t * item = _fat_batch_item(&batch,clus_no);
+            uint32_t next = *item;
+            *item = FAT32_FILE_END;
+            _clus_chain_free(&batch,next);
+        }
+        _fat_batch_end(&batch);
+    }
+    else if(size>data->file_size){
+        // the allocated tail may hold stale data,the new clusters are cleared.
+        uint32_t from = data->file_size;
+        uint32_t to = cnt<<fs->geo.clus_shift;
+        to = to<size?to:size;
+        while(from<to){
+            uint32_t len = to-from;
+            if(len>CONFIG_FS_BLOCK_SIZE){
+                len = CONFIG_FS_BLOCK_SIZE;
             }
+            _multi_clus_rw(fs,first,(void *)zero,from,len,true,dir);
+            from+=len;
         }
-        else{
-            break;
+        if(want>cnt){
+            uint32_t clus_no = _clus_chain_extend(fs,last,want-cnt,0,0,dir);
+            if(first == 0){
+                first = clus_no;
+            }
         }
     }
-    return off;
+    data->first_clus_high = first>>16;
+    data->first_clus_low = first<<16>>16;
+    data->file_size = size;
 }
 
 /*!
- * @note read or write a file.
- * @warning must hold writing lock when write and read lock when reading.
- *          don`t hold parent entry`s lock.
- * @param entry
- * @param buffer
- * @param offset
- * @param length
- * @param write
+ * @note apply the ops of one dir with a single scan of it,
+ *       the dirents are changed in memory and written back
+ *       from the first changed one.
+ * @warning must hold dir`s write lock.
+ * @param first : index of first op of dir.
+ * @param busy : ops on entries in use,they fail.
+ * @return count of ops done.
  */
-void entry_rw(entry_t * entry,void * buffer,uint32_t offset, uint32_t length,bool write){
-    ASSERT(entry!=NULL,"entry is invalid!\n");
-    if(entry->first_clus_no == 0){
-        // this is a new create file with no cluster allocating.
-        // alloc one
-        entry->first_clus_no = _clus_alloc();
+static uint32_t _entry_batch_apply(entry_batch_t * batch, uint32_t first, bool * busy){
+    entry_t * dir = batch->ops[first].dir;
+    fs_t * fs = dir->fs;
+    uint32_t create_cnt = 0;
+    uint32_t dir_create_cnt = 0;
+    // the cached entries write their dirents before the dir is read.
+    for(uint32_t i = first;i<batch->op_cnt;i++){
+        if(batch->ops[i].dir!=dir){
+            continue;
+        }
+        if(batch->ops[i].kind == ENTRY_BATCH_CREATE){
+            create_cnt++;
+            dir_create_cnt+=batch->ops[i].attr == ENTRY_ATTR_DIR;
+        }
+        else{
+            busy[i] = !_entry_batch_evict(dir,batch->ops[i].name);
+        }
     }
-    uint32_t file_size;
-    if(entry->attr==ENTRY_ATTR_ARCHIVE){
-        file_size = entry->file_size;
+    uint32_t chain_cnt;
+    uint32_t last_clus = _clus_chain_last(fs,dir->first_clus_no,&chain_cnt);
+    uint32_t const chain_size = chain_cnt<<fs->geo.clus_shift;
+    uint32_t const buffer_size = chain_size+(_clus_cnt_of_size(fs,create_cnt*sizeof(entry_data_t))<<fs->geo.clus_shift);
+    uint32_t slot_cnt = 16;
+    while(slot_cnt<buffer_size/sizeof(entry_data_t)*2){
+        slot_cnt*=2;
     }
-    else{
-        file_size = _get_dir_file_size(entry);
+    byte * buffer = calloc(1,buffer_size);
+    uint32_t * slots = calloc(slot_cnt,sizeof(uint32_t));
+    // the clusters of new dirs are allocated together,
+    // and each of them is written totally with it`s "." and "..".
+    uint32_t * dir_clus = malloc((dir_create_cnt+1)*sizeof(uint32_t));
+    entry_data_t * dots = calloc(1,fs->byts_per_clus);
+    if(buffer == NULL||slots == NULL||dir_clus == NULL||dots == NULL){
+        free(buffer);
+        free(slots);
+        free(dir_clus);
+        free(dots);
+        return 0;
     }
-    uint32_t clus_cnt = file_size/fat32.byts_per_clus;
-    if(file_size%fat32.byts_per_clus!=0){
-        clus_cnt++;
+    dirent_index_t index = {buffer,slots,slot_cnt-1};
+    // the cached sub entries left can`t write their dirents until the dir is written back.
+    fs_stub_rw_w_lock_acquire(&dir->dirent_lock);
+    _multi_clus_rw(fs,dir->first_clus_no,buffer,0,chain_size,false,NULL);
+    static const byte zero_dirent[sizeof(entry_data_t)];
+    uint32_t end = 0;
+    uint32_t tomb_cnt = 0;
+    for(;end<chain_size&&memcmp(buffer+end,zero_dirent,sizeof(entry_data_t))!=0;end+=sizeof(entry_data_t)){
+        if(buffer[end] == 0xE5){
+            tomb_cnt++;
+        }
+        else{
+            _dirent_index_put(&index,end);
+        }
     }
-    uint32_t allocated_size = clus_cnt * fat32.byts_per_clus;
-    uint32_t file_now_size = offset + length;
-    if(file_now_size > allocated_size){
-        if(write){
-            // alloc more cluster
-            uint32_t alloc_clus_cnt = (file_now_size - allocated_size)/fat32.byts_per_clus;
-            if((file_now_size - allocated_size)%fat32.byts_per_clus!=0){
-                alloc_clus_cnt++;
-            }
-            // find file end
-            uint32_t probe_clus = entry->first_clus_no;
-            for(;_fat_read(probe_clus)!= FAT32_FILE_END;probe_clus = _fat_read(probe_clus));
-            for(;alloc_clus_cnt>0;alloc_clus_cnt--){
-                uint32_t next = _clus_alloc();
-                _fat_write(probe_clus, next);
-                probe_clus = next;
+    // the stale bytes after the end are cleared when written back.
+    memset(buffer+end,0,buffer_size-end);
+    uint32_t dirty_from = end;
+    uint32_t dirty_to = 0;
+    uint32_t done_cnt = 0;
+    uint32_t dir_clus_used = 0;
+    dir->batch = batch;
+    _clus_alloc_many(fs,dir_create_cnt,dir_clus,dir);
+    uint32_t const parent_clus = dir->parent == ROOT_PARENT?0:dir->first_clus_no;
+    dots[0].name_head[0] = '.';
+    dots[1].name_head[0] = '.';
+    dots[1].name_head[1] = '.';
+    dots[0].attr = ENTRY_ATTR_DIR;
+    dots[1].attr = ENTRY_ATTR_DIR;
+    dots[0].file_size = sizeof(entry_data_t)*2;
+    dots[1].first_clus_high = parent_clus>>16;
+    dots[1].first_clus_low = parent_clus<<16>>16;
+    for(uint32_t i = first;i<batch->op_cnt;i++){
+        entry_batch_op_t * op = &batch->ops[i];
+        char raw[11];
+        if(op->dir!=dir||busy[i]||!_full_name_split(op->name,raw,raw+8)){
+            continue;
+        }
+        uint32_t * slot = _dirent_index_find(&index,raw);
+        entry_data_t * data = slot == NULL?NULL:(entry_data_t *)(buffer+*slot-1);
+        if(op->kind == ENTRY_BATCH_CREATE){
+            if(data!=NULL){
+                // this entry is exist
+                continue;
             }
-            if(entry->attr == ENTRY_ATTR_ARCHIVE){
-                entry->file_size = file_now_size;
+            data = (entry_data_t *)(buffer+end);
+            memcpy(data,raw,11);
+            data->attr = op->attr;
+            if(op->attr == ENTRY_ATTR_DIR){
+                uint32_t clus_no = dir_clus[dir_clus_used++];
+                dots[0].first_clus_high = clus_no>>16;
+                dots[0].first_clus_low = clus_no<<16>>16;
+                _multi_clus_rw(fs,clus_no,dots,0,fs->byts_per_clus,true,dir);
+                data->first_clus_high = clus_no>>16;
+                data->first_clus_low = clus_no<<16>>16;
+                data->file_size = sizeof(entry_data_t)*2;
             }
+            _dirent_index_put(&index,end);
+            end+=sizeof(entry_data_t);
+            dirty_from = dirty_from<end-sizeof(entry_data_t)?dirty_from:end-sizeof(entry_data_t);
+            dirty_to = dirty_to>end?dirty_to:end;
         }
         else{
-            // if read out of the file size,panic
-            PANIC("Read Out Of File!\n");
+            if(data == NULL||(data->attr!=ENTRY_ATTR_DIR&&data->attr!=ENTRY_ATTR_ARCHIVE)){
+                continue;
+            }
+            if(op->kind == ENTRY_BATCH_REMOVE){
+                uint32_t clus_no = (data->first_clus_high<<16)|data->first_clus_low;
+                // a dir with sub entries is left,or it`s sub entries leak.
+                if(data->attr==ENTRY_ATTR_DIR&&!_dir_clus_is_empty(fs,clus_no)){
+                    continue;
+                }
+                if(clus_no!=0){
+                    fat_batch_t fat_batch = {fs,NULL,dir};
+                    _clus_chain_free(&fat_batch,clus_no);
+                    _fat_batch_end(&fat_batch);
+                }
+                data->name_head[0] = (char)0xE5;
+                *slot = DIRENT_INDEX_DEL;
+                tomb_cnt++;
+            }
+            else{
+                if(data->attr!=ENTRY_ATTR_ARCHIVE){
+                    continue;
+                }
+                _entry_batch_resize_chain(dir,data,op->size);
+            }
+            uint32_t offset = (byte *)data-buffer;
+            dirty_from = dirty_from<offset?dirty_from:offset;
+            dirty_to = dirty_to>offset+sizeof(entry_data_t)?dirty_to:offset+sizeof(entry_data_t);
         }
+        op->done = true;
+        done_cnt++;
     }
-    // do read or write
-    _multi_clus_rw(entry->first_clus_no,buffer,offset,length,write);
+    if(dir_clus_used<dir_create_cnt){
+        // the clusters of dirs not created.
+        fat_batch_t fat_batch = {fs,NULL,dir};
+        for(uint32_t i = dir_clus_used;i<dir_create_cnt;i++){
+            *_fat_batch_item(&fat_batch,dir_clus[i]) = 0;
+        }
+        _fat_batch_end(&fat_batch);
+    }
+    if(dirty_from<dirty_to){
+        uint32_t const clus_cnt = _clus_cnt_of_size(fs,end);
+        if(clus_cnt>chain_cnt){
+            // the new clusters are written totally below.
+            _clus_chain_extend(fs,last_clus,clus_cnt-chain_cnt,0,clus_cnt-chain_cnt,dir);
+        }
+        if(dirty_to == end){
+            // the rest of last clus is cleared,so the scans stop at end.
+            dirty_to = clus_cnt<<fs->geo.clus_shift;
+        }
+        _multi_clus_rw(fs,dir->first_clus_no,buffer+dirty_from,dirty_from,dirty_to-dirty_from,true,dir);
+        dir->file_size = end;
+        dir->tomb_cnt = tomb_cnt;
+        dir->dirty = true;
+    }
+    fs_stub_rw_w_lock_release(&dir->dirent_lock);
+    if(dirty_from<dirty_to&&tomb_cnt>=CONFIG_FS_DIR_COMPACT_MIN
+       &&tomb_cnt*100>=(end/sizeof(entry_data_t))*CONFIG_FS_DIR_COMPACT_RATIO){
+        entry_dir_compact(dir);
+    }
+    dir->batch = NULL;
+    free(buffer);
+    free(slots);
+    free(dir_clus);
+    free(dots);
+    return done_cnt;
+}
+
+static int _entry_batch_sec_cmp(const void * a, const void * b){
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x<y?-1:(x>y?1:0);
 }
 
 /*!
- * @note create a entry and hold it`s write lock.
- * @warning must hold parent write lock
- * @param parent
- * @param name
- * @param attr
- * @return new entry with write lock or NULL when fail to create entry.
+ * @note apply the staged ops in order of dir,and the ops of
+ *       a dir in order of staging. every dir is read once,
+ *       then all of the dirent,FAT and data sectors dirtied
+ *       are written back in sector order and the device is synced.
+ *       the ops are kept for checking their done flag until release.
+ * @warning must hold write locks of the dirs,the entries
+ *          removed or resized must not be in use.
+ * @param batch
+ * @return count of ops done.
  */
-entry_t *entry_create_write(entry_t * parent , char * name , uint8_t attr){
-    ASSERT(parent!=NULL&&parent->attr == ENTRY_ATTR_DIR&&strlen(name)<MAX_FULL_NAME ,"Parent Dir is Not Dir!\n");
-    ASSERT(attr==ENTRY_ATTR_DIR||attr==ENTRY_ATTR_ARCHIVE,"Unexpected attr when create entry!\n");
-    entry_t * tmp;
-    if((tmp= entry_get_sub_read(parent, name)) != NULL){
-        // this entry is exist
-        entry_put_read(tmp);
-        return NULL;
+uint32_t entry_batch_commit(entry_batch_t * batch){
+    FS_TRACE_BEGIN(trace_start);
+    bool * busy = calloc(batch->op_cnt+1,sizeof(bool));
+    if(busy == NULL){
+        return 0;
     }
-    entry_t * idle = _entry_get_idle_write();
-    idle->parent = parent;
-    strcpy(idle->filename,name);
-    entry_data_t new_entry_data;
-    // write a empty entry to parent.
-    // the parent file size will change
-    entry_rw(parent,&new_entry_data,parent->file_size,sizeof(entry_data_t),true);
-    idle->offset_in_dir = parent->file_size-32;
-    idle->parent->ref_cnt++;
-    if(attr==ENTRY_ATTR_ARCHIVE){
-        idle->first_clus_no = 0;
-        idle->file_size = 0;
+    uint32_t done_cnt = 0;
+    batch->sec_cnt = 0;
+    batch->sec_lost = false;
+    for(uint32_t i = 0;i<batch->op_cnt;i++){
+        bool applied = false;
+        for(uint32_t j = 0;j<i&&!applied;j++){
+            applied = batch->ops[j].dir == batch->ops[i].dir;
+        }
+        if(!applied){
+            done_cnt+=_entry_batch_apply(batch,i,busy);
+        }
+    }
+    free(busy);
+    if(batch->sec_lost){
+        block_flush_dev(batch->fs->dev_no);
     }
     else{
-        idle->first_clus_no = _clus_alloc();
-        idle->file_size = 32*2;
-        // add entry "." and ".."
-        entry_data_t buffer[2]={
-                {
-                        ".",
-                        "",
-                        ENTRY_ATTR_DIR,
-                        0,
-                        0,
-                        0,
-                        0,
-                        0,
-                        idle->first_clus_no>>16,
-                        0,
-                        0,
-                        idle->first_clus_no<<16>>16,
-                        idle->file_size
-                },
-                {
-                        "..",
-                        "",
-                        ENTRY_ATTR_DIR,
-                        0,
-                        0,
-                        0,
-                        0,
-                        0,
-                        idle->parent->first_clus_no>>16,
-                        0,
-                        0,
-                        idle->parent->first_clus_no<<16>>16,
-                        idle->parent->file_size
-                }
-        };
-        entry_rw(idle,buffer,0,sizeof(entry_data_t)*2,true);
+        qsort(batch->secs,batch->sec_cnt,sizeof(uint32_t),_entry_batch_sec_cmp);
+        uint32_t cnt = 0;
+        for(uint32_t i = 0;i<batch->sec_cnt;i++){
+            if(cnt == 0||batch->secs[cnt-1]!=batch->secs[i]){
+                batch->secs[cnt++] = batch->secs[i];
+            }
+        }
+        batch->sec_cnt = cnt;
+        block_flush_sorted(batch->secs,batch->sec_cnt,batch->fs->dev_no);
     }
-    return idle;
+    fs_stub_source_sync(batch->fs->dev_no);
+    FS_TRACE_END(trace_start,"entry_batch_commit",done_cnt);
+    return done_cnt;
 }
 
-
 /*!
- * @warning must hold parent write lock.And check if the entry is idle.
+ * @note create many empty entries in a dir,all of the names
+ *       are checked against one scan of dir and the new dirents
+ *       are appended together and written sector by sector.
+ * @warning must hold parent write lock.
  * @param parent
- * @param name
- * @return
+ * @param names
+ * @param cnt : count of names.
+ * @param attr
+ * @param created : set for every name when it is created,can be NULL.
+ * @return count of entries created.
  */
-bool entry_rm_sub(entry_t * parent, char * name){
-    // get target entry with write lock.
-    // if this entry`s sub entry not use and not in cache
-    // the entry`s ref cnt will be 1.
-    entry_t * entry = entry_get_sub_write(parent, name);
-    if(entry==NULL){
-        return false;
+uint32_t entry_create_multi(entry_t * parent, const char * const * names, uint32_t cnt, uint8_t attr, bool * created){
+    ASSERT(parent!=NULL&&parent->attr == ENTRY_ATTR_DIR,"Parent Dir is Not Dir!\n");
+    entry_batch_t batch;
+    entry_batch_init(&batch,parent->fs);
+    for(uint32_t i = 0;i<cnt;i++){
+        // the names too long are not staged.
+        bool staged = entry_batch_create(&batch,parent,names[i],attr);
+        if(created!=NULL){
+            created[i] = staged;
+        }
     }
-    if(entry->ref_cnt!=1){
-        entry_put_write(entry);
-        return false;
+    uint32_t ret = entry_batch_commit(&batch);
+    for(uint32_t i = 0,op = 0;created!=NULL&&i<cnt;i++){
+        if(created[i]){
+            created[i] = batch.ops[op++].done;
+        }
     }
-    // target entry can remove
-    parent->ref_cnt--;
-    uint8_t buffer = 0xE5;
-    entry_rw(parent,&buffer,entry->offset_in_dir,1,true);
-    // set entry`s parent to NULL,so can`t get from cache by parent and name,
-    // and can`t flush back to block layer automatically.
-    entry->parent = NULL;
-    entry_put_write(entry);
-    return true;
-};
+    entry_batch_release(&batch);
+    return ret;
+}
 
 void entry_ls(entry_t * parent,void * buffer){
     ASSERT(parent->attr==ENTRY_ATTR_DIR,"this entry is not a dir!\n");
 }
 
-entry_t * _parse_path(const char * path , bool write){
-    entry_t * parent = entry_get_read(root);
+entry_t * _parse_path(fs_t * fs, const char * path , bool write){
+    ASSERT(fs!=NULL&&fs->mounted,"volume is not mounted!\n");
     if(path[0]!='/'){
         return NULL;
     }
+    entry_t * parent = entry_get_read(fs->root);
     char buffer[13];
     int last_index = 0;
     int i=0;
@@ -724,6 +2797,7 @@ entry_t * _parse_path(const char * path , bool write){
                 }
                 if(have_point){
                     if((i-last_index-1)>12){
+                        entry_put_read(parent);
                         return NULL;
                     }
                     else{
@@ -733,6 +2807,7 @@ entry_t * _parse_path(const char * path , bool write){
                 }
                 else{
                     if((i-last_index-1)>11){
+                        entry_put_read(parent);
                         return NULL;
                     }
                     else{
@@ -748,6 +2823,7 @@ entry_t * _parse_path(const char * path , bool write){
                     else{
                         sub = entry_get_sub_read(parent,buffer);
                     }
+                    entry_put_read(parent);
                     return sub;
                 }
                 else{
@@ -761,80 +2837,146 @@ entry_t * _parse_path(const char * path , bool write){
                     parent = sub;
                 }
             }
+            else if(end_flag){
+                // path ends with '/',the last dir is target.
+                return parent;
+            }
             last_index = i;
         }
     }
 }
 
-entry_t * parse_path_read(const char * path){
-    return _parse_path(path,false);
+entry_t * parse_path_read(fs_t * fs, const char * path){
+    FS_TRACE_BEGIN(trace_start);
+    entry_t * entry = _parse_path(fs,path,false);
+    FS_TRACE_END(trace_start,"parse_path_read",entry!=NULL);
+    return entry;
 }
 
-entry_t * parse_path_write(const char * path){
-    return _parse_path(path,true);
+entry_t * parse_path_write(fs_t * fs, const char * path){
+    FS_TRACE_BEGIN(trace_start);
+    entry_t * entry = _parse_path(fs,path,true);
+    FS_TRACE_END(trace_start,"parse_path_write",entry!=NULL);
+    return entry;
 }
 
+/*!
+ * @note init the entry cache shared by all volumes.
+ */
 void fat32_module_init(){
     bzero(&entry_cache, sizeof(entry_cache_t));
-    block_t * block = block_get_read(0,0);    // first selector
-    assert(strncmp((char const*)(block->data + 0x52), "FAT32", 5)==0,"not FAT32 volume");
-    fat32.bpb.byts_per_sec = *(uint16_t *)(block->data + 0x0B);
-    fat32.bpb.sec_per_clus = *(block->data + 0x0D);
-    fat32.bpb.rsvd_sec_cnt = *(uint16_t *)(block->data + 0x0E);
-    fat32.bpb.fat_cnt = *(block->data + 0x10);
-    fat32.bpb.hidd_sec = *(uint32_t *)(block->data + 0x1C);
-    if(*(uint16_t *)(block->data + 0x13) == 0){
-        // bigger than 32MB
-        fat32.bpb.tot_sec = *(uint32_t *)(block->data + 0x20);
-    }
-    else{
-        // little than 32MB
-        fat32.bpb.tot_sec = *(uint16_t *)(block->data + 0x13);
-    }
-    if(*(uint16_t *)(block->data + 0x16) == 0){
-        fat32.bpb.fat_sz = *(uint32_t *)(block->data + 0x24);
-    }
-    else{
-        fat32.bpb.fat_sz = *(uint16_t *)(block->data + 0x16);
-    }
-    fat32.bpb.root_clus = *(uint32_t *)(block->data + 0x2C);
-    fat32.first_data_sec = fat32.bpb.rsvd_sec_cnt + fat32.bpb.fat_cnt * fat32.bpb.fat_sz;
-    fat32.data_sec_cnt = fat32.bpb.tot_sec - fat32.first_data_sec;
-    fat32.data_clus_cnt = fat32.data_sec_cnt / fat32.bpb.sec_per_clus;
-    fat32.byts_per_clus = fat32.bpb.sec_per_clus * fat32.bpb.byts_per_sec;
-    assert(fat32.byts_per_clus == fat32.bpb.byts_per_sec, "Not support:sector size not equaled to clus size!\n");
-
+    bzero(fs_table, sizeof(fs_table));
+    memset(entry_cache.hash_heads,0xFF,sizeof(entry_cache.hash_heads));
     //entry cache init
     entry_cache.dirty = false;
     fs_stub_rw_lock_init(&entry_cache.rw_lock);
     for(int i =0;i<CONFIG_FS_ENTRY_CACHE_CNT;i++){
         entry_t * entry = &entry_cache.buffer[i];
         entry->dnode.data = entry;
+        entry->fs = NULL;
         entry->ref_cnt = 0;
         entry->dirty = false;
         entry->attr = 0;
         entry->file_size = 0;
         entry->parent = NULL;
+        entry->tomb_cnt = 0;
+        entry->batch = NULL;
+        entry->sync_sec_cnt = 0;
+        entry->delay_cnt = 0;
         fs_stub_rw_lock_init(&entry->rw_lock);
+        fs_stub_rw_lock_init(&entry->dirent_lock);
         dlink_add_tail(&entry_cache.dlink,&entry_cache.buffer[i].dnode);
     }
     entry_cache.dirty = false;
+}
+
+/*!
+ * @note mount a FAT32 volume in a registered device.
+ * @param dev_no
+ * @return volume or NULL when device is not FAT32,the geometry
+ *         is not supported,already mounted or too many volumes.
+ */
+fs_t * fat32_mount_dev(int dev_no){
+    fs_t * fs = NULL;
+    for(int i = 0;i<CONFIG_FS_DEV_CNT;i++){
+        if(fs_table[i].mounted){
+            if(fs_table[i].dev_no == dev_no){
+                return NULL;
+            }
+        }
+        else if(fs == NULL){
+            fs = &fs_table[i];
+        }
+    }
+    if(fs == NULL){
+        return NULL;
+    }
+    bzero(fs,sizeof(fs_t));
+    fs->dev_no = dev_no;
+    block_t * block = block_get_read(0,dev_no);    // first selector
+    if(strncmp((char const*)(block->data + 0x52), "FAT32", 5)!=0){
+        // not FAT32 volume
+        block_put_read(block);
+        block_drop_dev(dev_no);
+        return NULL;
+    }
+    fs->bpb.byts_per_sec = *(uint16_t *)(block->data + 0x0B);
+    fs->bpb.sec_per_clus = *(block->data + 0x0D);
+    fs->bpb.rsvd_sec_cnt = *(uint16_t *)(block->data + 0x0E);
+    fs->bpb.fat_cnt = *(block->data + 0x10);
+    fs->bpb.hidd_sec = *(uint32_t *)(block->data + 0x1C);
+    if(*(uint16_t *)(block->data + 0x13) == 0){
+        // bigger than 32MB
+        fs->bpb.tot_sec = *(uint32_t *)(block->data + 0x20);
+    }
+    else{
+        // little than 32MB
+        fs->bpb.tot_sec = *(uint16_t *)(block->data + 0x13);
+    }
+    if(*(uint16_t *)(block->data + 0x16) == 0){
+        fs->bpb.fat_sz = *(uint32_t *)(block->data + 0x24);
+    }
+    else{
+        fs->bpb.fat_sz = *(uint16_t *)(block->data + 0x16);
+    }
+    fs->bpb.root_clus = *(uint32_t *)(block->data + 0x2C);
+    block_put_read(block);
+    if(!_fs_geo_init(fs)){
+        // the geometry is invalid for FAT32
+        block_drop_dev(dev_no);
+        return NULL;
+    }
+    fs->first_data_sec = fs->bpb.rsvd_sec_cnt + fs->bpb.fat_cnt * fs->bpb.fat_sz;
+    fs->data_sec_cnt = fs->bpb.tot_sec - fs->first_data_sec;
+    fs->data_clus_cnt = fs->data_sec_cnt >> fs->geo.spc_shift;
+    fs->free_hint = 2;
+    fs->byts_per_clus = fs->bpb.sec_per_clus * fs->bpb.byts_per_sec;
 
     // load root dir to entry cache
-    root = entry_cache.dlink.head->data;
-    root->ref_cnt = 1;
-    fs_stub_rw_lock_init(&root->rw_lock);
-    root->parent = NULL;
+    entry_t * root = _entry_get_idle_write();
+    if(root == NULL){
+        PANIC("All entries are busy!\n");
+    }
+    root->fs = fs;
     root->dirty = false;
     strcpy(root->filename,"root");
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
     root->parent = ROOT_PARENT;
-    root->first_clus_no = 2;
+    _entry_key_update(root);
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    root->first_clus_no = fs->bpb.root_clus;
+    root->tomb_cnt = 0;
+    root->batch = NULL;
+    root->sync_sec_cnt = 0;
+    root->delay_cnt = 0;
+    _entry_stamp(root);
     //load root`s file size
     char probe_buffer[32];
-    uint32_t clus = 2;
     uint32_t offset = 0;
     while(true){
-        _multi_clus_rw(clus, probe_buffer, offset, 32, false);
+        if(!_multi_clus_rw(fs, root->first_clus_no, probe_buffer, offset, 32, false, NULL)){
+            break;
+        }
         bool zero_flag = true;
         for(int i=0;i<32;i++){
             if(*(probe_buffer+i) != 0){
@@ -848,6 +2990,154 @@ void fat32_module_init(){
     }
     root->file_size = offset;
     root->attr = ENTRY_ATTR_DIR;
+    fs_stub_rw_w_lock_release(&root->rw_lock);
+    fs->root = root;
+    fs->mounted = true;
+    return fs;
+}
+
+#define FAT32_HOT_MAGIC 0x544F4842     // "BHOT"
+
+/*!
+ * @note head of hot set sidecar,followed by cnt block numbers.
+ */
+typedef
+struct {
+    uint32_t magic;
+    uint32_t tot_sec;   // of volume,the set of another volume is ignored.
+    uint32_t cnt;
+} fat32_hot_head_t;
+
+/*!
+ * @note load the hot blocks recorded at last umount into cache.
+ *       a missing or broken sidecar only makes a cold start.
+ */
+static void _fs_warm_load(fs_t * fs){
+    FS_TRACE_BEGIN(trace_start);
+    int fd = open(fs->hot_path,O_RDONLY);
+    if(fd<0){
+        return;
+    }
+    fat32_hot_head_t head;
+    uint32_t block_nos[CONFIG_FS_WARM_BLOCK_CNT];
+    uint32_t cnt = 0;
+    if(pread(fd,&head,sizeof(head),0) == (ssize_t)sizeof(head)
+       &&head.magic == FAT32_HOT_MAGIC&&head.tot_sec == fs->bpb.tot_sec&&head.cnt<=CONFIG_FS_WARM_BLOCK_CNT
+       &&pread(fd,block_nos,head.cnt*sizeof(uint32_t),sizeof(head)) == (ssize_t)(head.cnt*sizeof(uint32_t))){
+        for(uint32_t i = 0;i<head.cnt;i++){
+            if(block_nos[i]<fs->bpb.tot_sec){
+                block_nos[cnt++] = block_nos[i];
+            }
+        }
+    }
+    close(fd);
+    block_warm(block_nos,cnt,fs->dev_no);
+    FS_TRACE_END(trace_start,"fs_warm_load",cnt);
+}
+
+/*!
+ * @note record the hot blocks of volume to sidecar.
+ * @warning must be invoked before the blocks of volume are dropped.
+ */
+static void _fs_warm_save(fs_t * fs){
+    fat32_hot_head_t head;
+    uint32_t block_nos[CONFIG_FS_WARM_BLOCK_CNT];
+    head.magic = FAT32_HOT_MAGIC;
+    head.tot_sec = fs->bpb.tot_sec;
+    head.cnt = block_hot_set(fs->dev_no,block_nos,CONFIG_FS_WARM_BLOCK_CNT);
+    int fd = open(fs->hot_path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(fd<0){
+        return;
+    }
+    if(pwrite(fd,&head,sizeof(head),0)!=(ssize_t)sizeof(head)
+       ||pwrite(fd,block_nos,head.cnt*sizeof(uint32_t),sizeof(head))!=(ssize_t)(head.cnt*sizeof(uint32_t))){
+        // a torn sidecar is ignored at next mount,
+        // drop it when it can`t be emptied.
+        if(ftruncate(fd,0)!=0){
+            unlink(fs->hot_path);
+        }
+    }
+    close(fd);
+}
+
+/*!
+ * @note open an image file and mount the FAT32 volume in it.
+ *       the device is closed when umount.
+ *       with FAT32_MOUNT_WARM the hot blocks recorded in
+ *       the sidecar of image are loaded into cache.
+ * @param path
+ * @param flags : flags of disk_open,and FAT32_MOUNT_WARM.
+ * @return volume or NULL when fail.
+ */
+fs_t * fat32_mount(const char * path, uint32_t flags){
+    int dev_no = disk_open(path,flags&~FAT32_MOUNT_WARM);
+    if(dev_no == DISK_NO_ERROR){
+        return NULL;
+    }
+    fs_t * fs = fat32_mount_dev(dev_no);
+    if(fs == NULL){
+        disk_close(dev_no);
+        return NULL;
+    }
+    fs->own_dev = true;
+    if(flags&FAT32_MOUNT_WARM){
+        fs->hot_path = malloc(strlen(path)+sizeof(".hot"));
+        if(fs->hot_path!=NULL){
+            strcpy(fs->hot_path,path);
+            strcat(fs->hot_path,".hot");
+            _fs_warm_load(fs);
+        }
+    }
+    return fs;
+}
+
+/*!
+ * @note write back and drop the entries and blocks of a volume.
+ * @warning no entry of volume can be in use.
+ * @param fs
+ */
+void fat32_umount(fs_t * fs){
+    ASSERT(fs!=NULL&&fs->mounted,"volume is not mounted!\n");
+    fs_stub_rw_w_lock_acquire(&entry_cache.rw_lock);
+    // the entries of volume are written back before they are dropped,
+    // because a sub entry writes it`s dirent into parent.
+    for(dnode_t * probe = entry_cache.dlink.head;probe!=NULL;probe = probe->next){
+        entry_t * entry = probe->data;
+        if(entry->fs!=fs){
+            continue;
+        }
+        fs_stub_rw_w_lock_acquire(&entry->rw_lock);
+        _entry_delay_flush(entry);
+        _entry_flush(entry);
+        fs_stub_rw_w_lock_release(&entry->rw_lock);
+    }
+    for(dnode_t * probe = entry_cache.dlink.head;probe!=NULL;probe = probe->next){
+        entry_t * entry = probe->data;
+        if(entry->fs!=fs){
+            continue;
+        }
+        fs_stub_rw_w_lock_acquire(&entry->rw_lock);
+        entry->fs = NULL;
+        entry->parent = NULL;
+        entry->ref_cnt = 0;
+        entry->dirty = false;
+        entry->filename[0] = '\0';
+        _entry_key_update(entry);
+        fs_stub_rw_w_lock_release(&entry->rw_lock);
+    }
+    fs_stub_rw_w_lock_release(&entry_cache.rw_lock);
+    if(fs->hot_path!=NULL){
+        _fs_warm_save(fs);
+        free(fs->hot_path);
+        fs->hot_path = NULL;
+    }
+    block_drop_dev(fs->dev_no);
+    fs_stub_source_sync(fs->dev_no);
+    if(fs->own_dev){
+        disk_close(fs->dev_no);
+    }
+    fs->root = NULL;
+    fs->mounted = false;
 }
 
 void fat32_test_helper_uint2str(char * buffer , uint32_t number){
@@ -879,8 +3169,8 @@ void fat32_test_helper_uint2str(char * buffer , uint32_t number){
     }
 }
 
-void fat32_test(){
-    entry_t * entry1 = parse_path_write("/A/1.TXT");
+void fat32_test(fs_t * fs){
+    entry_t * entry1 = parse_path_write(fs,"/A/1.TXT");
     char s_buffer[100]={[0 ... 99]='T'};
     char r_buffer[100]={[0 ... 99]='F'};
     entry_rw(entry1,s_buffer,0,100,true);
@@ -7,8 +7,8 @@
 
 #include "fs_common.h"
 
-//differet in 32bits system
-#define ROOT_PARENT 0xFFFFFFFFFFFFFFFF
+// parent of root entry,all bits set in a pointer of any width.
+#define ROOT_PARENT ((struct entry_s *)~0UL)
 #define FAT32_FILE_END 0x0FFFFFFF
 #define FAT32_CLUS0 0xF8FFFF0F
 #define FAT32_EOC 0x0FFFFFF8
@@ -19,13 +19,39 @@
 #define ENTRY_ATTR_ARCHIVE 0x20
 #define ENTRY_ATTR_LONG_NAME 0x0F
 #define MAX_FULL_NAME 13
+#define FAT32_MOUNT_WARM 0x100     // keep hot blocks of volume in "<path>.hot" across mounts.
 
+struct entry_s;
+struct entry_batch_s;
+
+/*!
+ * @note a mounted FAT32 volume.
+ */
 typedef
 struct {
+    bool mounted;
+    bool own_dev;       // device is opened by mount and closed by umount.
+    char * hot_path;    // sidecar of hot blocks,NULL when volume is not warm started.
+    int dev_no;
+    struct entry_s * root;
     uint32_t first_data_sec;
     uint32_t data_sec_cnt;
     uint32_t data_clus_cnt;
     uint32_t byts_per_clus;
+    uint32_t free_hint;     // clus to start the search of free clusters,behind the last allocation.
+
+    // shifts and masks of geometry computed at mount,
+    // the sizes are power of 2 so offsets are split without division.
+    struct {
+        uint8_t sec_shift;      // log2 of byts_per_sec.
+        uint8_t clus_shift;     // log2 of byts_per_clus.
+        uint8_t spc_shift;      // log2 of sec_per_clus.
+        uint8_t fat_shift;      // log2 of FAT items in a sector.
+        uint32_t sec_mask;      // byts_per_sec-1.
+        uint32_t clus_mask;     // byts_per_clus-1.
+        uint32_t spc_mask;      // sec_per_clus-1.
+        uint32_t fat_mask;      // FAT items in a sector-1.
+    } geo;
 
     struct {
         uint16_t byts_per_sec;      // offset:0x0B~0x0C
@@ -44,25 +70,52 @@ struct {
     } bpb;
 } fs_t;
 
+/*!
+ * @note the fields used by lookup and the state are put at the head,
+ *       they fill the first cache line without holes.
+ */
 typedef
 struct entry_s{
     char filename[CONFIG_FS_FAT32_MAX_FILENAME_LEN];
+    uint8_t attr;
     struct entry_s * parent;
+    fs_t * fs;      // the volume of entry.
     uint32_t ref_cnt;
-    uint8_t attr;
+    bool dirty;
     uint32_t first_clus_no;
     uint32_t file_size;
-    bool dirty;
-    dnode_t dnode;
     uint32_t offset_in_dir;
+    uint32_t tomb_cnt;      // count of deleted dirents in dir.
+    struct entry_batch_s * batch;   // the batch committing to dir,it takes the tracked sectors.
+    dnode_t dnode;
     rw_lock_t rw_lock;
+    rw_lock_t dirent_lock;  // of dir,taken by the sub entries writing their dirents and the rewrites of all dirents.
+    uint32_t sync_sec_cnt;
+    uint32_t sync_secs[CONFIG_FS_ENTRY_SYNC_SEC_CNT];    // sorted dirty sectors written for this entry.
+    uint32_t delay_base;    // file offset of first delayed block,equal to allocated size.
+    uint32_t delay_cnt;
+    block_t * delay_blocks[CONFIG_FS_ENTRY_DELAY_BLOCK_CNT];   // anonymous blocks of data without clusters.
+    uint32_t write_stamp;   // renewed by load and every write,so the copies of data made before can be checked.
 }entry_t;
 
+/*!
+ * @note packed lookup key of a cached entry.
+ */
+typedef
+struct {
+    entry_t * parent;
+    uint32_t name_hash;
+} entry_key_t;
+
 typedef
 struct{
     entry_t buffer[CONFIG_FS_ENTRY_CACHE_CNT];
+    entry_key_t keys[CONFIG_FS_ENTRY_CACHE_CNT];   // keys of buffer[i],compared without touching entries.
+    uint16_t hash_heads[CONFIG_FS_ENTRY_HASH_CNT];
+    uint16_t hash_next[CONFIG_FS_ENTRY_CACHE_CNT];
     dlink_t dlink;
     bool dirty;
+    uint32_t write_stamp;   // last stamp given to entries.
     rw_lock_t rw_lock;
 } entry_cache_t;
 
@@ -83,6 +136,116 @@ struct {
     uint32_t file_size;
 }__attribute__((packed)) entry_data_t;
 
+/*!
+ * @note a piece of file data lent from block cache.
+ *       data points into block->data and is valid
+ *       until the seg is released.
+ */
+typedef
+struct {
+    block_t * block;
+    const byte * data;
+    uint32_t length;
+} entry_seg_t;
+
+/*!
+ * @note contiguous sectors holding a range of file from offset.
+ */
+typedef
+struct {
+    uint32_t offset;
+    uint32_t sec;
+    uint32_t sec_cnt;
+} entry_extent_t;
+
+typedef
+struct {
+    void * base;
+    uint32_t length;
+} fs_iovec_t;
+
+/*!
+ * @note a defrag pass,the first two fields are set by caller
+ *       and the others are counted by defrag.
+ */
+typedef
+struct {
+    uint32_t rate;              // clusters copied per second,0 for no limit.
+    uint32_t min_extent_cnt;    // files with fewer extents are kept,0 for 2.
+    uint32_t file_cnt;
+    uint32_t frag_file_cnt;     // files with min_extent_cnt extents or more.
+    uint32_t moved_file_cnt;
+    uint32_t moved_clus_cnt;
+    uint32_t busy_file_cnt;     // files skipped,they were held by others.
+    unsigned long long start_ns;    // when the first clus is copied,for rate limit.
+} defrag_t;
+
+typedef
+enum {
+    ENTRY_BATCH_CREATE,
+    ENTRY_BATCH_REMOVE,
+    ENTRY_BATCH_RESIZE,
+} entry_batch_kind_t;
+
+typedef
+struct {
+    entry_batch_kind_t kind;
+    entry_t * dir;
+    char name[MAX_FULL_NAME];
+    uint8_t attr;       // attr of created entry.
+    uint32_t size;      // new size of resized file.
+    bool done;          // set by commit,false when the op fails.
+} entry_batch_op_t;
+
+/*!
+ * @note metadata updates staged against dirs and applied
+ *       together,each dir is scanned once and the sectors
+ *       dirtied by all of the updates are flushed at once in order.
+ */
+typedef
+struct entry_batch_s {
+    fs_t * fs;
+    entry_batch_op_t * ops;
+    uint32_t op_cnt;
+    uint32_t op_cap;
+    uint32_t * secs;        // sectors dirtied by commit.
+    uint32_t sec_cnt;
+    uint32_t sec_cap;
+    bool sec_lost;          // some sectors are not recorded,whole device is flushed.
+} entry_batch_t;
+
 void fat32_module_init();
-void fat32_test();
+fs_t * fat32_mount_dev(int dev_no);
+fs_t * fat32_mount(const char * path, uint32_t flags);
+void fat32_umount(fs_t * fs);
+entry_t * parse_path_read(fs_t * fs, const char * path);
+entry_t * parse_path_write(fs_t * fs, const char * path);
+entry_t * entry_get_read(entry_t * entry);
+void entry_put_read(entry_t * entry);
+entry_t * entry_pin(entry_t * entry);
+void entry_unpin(entry_t * entry);
+void entry_put_write(entry_t * entry);
+entry_t * entry_create_write(entry_t * parent , char * name , uint8_t attr);
+bool entry_rm_sub(entry_t * parent, char * name);
+bool entry_dir_compact(entry_t * dir);
+void entry_batch_init(entry_batch_t * batch, fs_t * fs);
+bool entry_batch_create(entry_batch_t * batch, entry_t * dir, const char * name, uint8_t attr);
+bool entry_batch_remove(entry_batch_t * batch, entry_t * dir, const char * name);
+bool entry_batch_resize(entry_batch_t * batch, entry_t * dir, const char * name, uint32_t size);
+uint32_t entry_batch_commit(entry_batch_t * batch);
+void entry_batch_release(entry_batch_t * batch);
+uint32_t entry_create_multi(entry_t * parent, const char * const * names, uint32_t cnt, uint8_t attr, bool * created);
+void entry_rw(entry_t * entry,void * buffer,uint32_t offset, uint32_t length,bool write);
+void entry_rwv(entry_t * entry,const fs_iovec_t * iov,uint32_t iov_cnt,uint32_t offset,bool write);
+void entry_fallocate(entry_t * entry, uint32_t size);
+bool entry_truncate(entry_t * entry, uint32_t size);
+uint32_t entry_read_lend(entry_t * entry, uint32_t offset, uint32_t length, entry_seg_t * segs, uint32_t seg_cnt);
+void entry_read_release(entry_seg_t * segs, uint32_t seg_cnt);
+uint32_t entry_extent_map(entry_t * entry, uint32_t offset, uint32_t length, entry_extent_t * extents, uint32_t extent_cnt);
+uint32_t entry_extent_cnt(entry_t * entry);
+bool entry_defrag(entry_t * entry, defrag_t * defrag);
+void fat32_defrag(fs_t * fs, defrag_t * defrag);
+void entry_flush_all();
+void entry_fsync(entry_t * entry);
+void fat32_test(fs_t * fs);
 #endif //OPENBHOS_FS_FAT32_H
@@ -9,9 +9,29 @@
 
 #define CONFIG_FS_BLOCK_SIZE 512
 #define CONFIG_FS_BLOCK_CACHE_CNT 1024
-#define CONFIG_FS_ENTRY_CACHE_CNT 64
+#define CONFIG_FS_BLOCK_ANON_MAX (CONFIG_FS_BLOCK_CACHE_CNT/4)
+#define CONFIG_FS_BLOCK_PIN_MAX (CONFIG_FS_BLOCK_CACHE_CNT/4)     // budget of lent blocks,below CACHE_CNT-ANON_MAX.
+#define CONFIG_FS_BLOCK_HASH_CNT (CONFIG_FS_BLOCK_CACHE_CNT*2)     // power of 2.
+#define CONFIG_FS_ENTRY_CACHE_CNT 256
+#define CONFIG_FS_ENTRY_HASH_CNT (CONFIG_FS_ENTRY_CACHE_CNT*2)     // power of 2.
+#define CONFIG_FS_ENTRY_SYNC_SEC_CNT 32
+#define CONFIG_FS_ENTRY_DELAY_BLOCK_CNT 64
 #define CONFIG_FS_FAT32_MAX_FILENAME_LEN 15
-#define CONFIG_FS_FAT32_DEV_NO 0
+#define CONFIG_FS_DEV_CNT 4
+#define CONFIG_FS_AIO_IO_URING 1
+#define CONFIG_FS_AIO_DEPTH 64
+#define CONFIG_FS_AIO_WORKER_CNT 4
+#define CONFIG_FS_READAHEAD_CNT 32
+#define CONFIG_FS_DIR_COMPACT_MIN 32
+#define CONFIG_FS_DIR_COMPACT_RATIO 50
+#define CONFIG_FS_FSCK_WORKER_CNT 8
+#define CONFIG_FS_FSCK_IO_SEC_CNT 256
+#define CONFIG_FS_WARM_BLOCK_CNT (CONFIG_FS_BLOCK_CACHE_CNT/2)
+#define CONFIG_FS_WARM_IO_SEC_CNT 256
+#ifndef CONFIG_FS_TRACE
+#define CONFIG_FS_TRACE 0
+#endif
+#define CONFIG_FS_TRACE_RING_CNT 4096
 #define NULL (void *)0
 
 typedef int bool;
@@ -23,7 +43,24 @@ typedef void * node_data_t;
 
 typedef unsigned long size_t;
 
-typedef int rw_lock_t;
+typedef pthread_rwlock_t rw_lock_t;
+
+/*!
+ * @note an async I/O request of some contiguous selectors.
+ */
+typedef
+struct fs_io_req_s {
+    void * buffer;
+    uint32_t select_no;
+    uint32_t select_cnt;
+    bool write;
+    int result;     // count of bytes or -errno after completion.
+    void * data;    // owner`s data.
+    // set by disk layer,a request is only reaped with the owner submitted it.
+    const void * owner;
+    bool complete;      // completed by device,not returned to owner yet.
+    struct fs_io_req_s * next;     // in the pending list of device.
+} fs_io_req_t;
 
 
 static void assert(bool in , char * text){
@@ -58,61 +95,106 @@ typedef struct{
     size_t size;
 }dlink_t;
 
+/*!
+ * @note the header and LRU node are put before the payload,
+ *       so a list operation touches the same cache line as the header.
+ */
 typedef
 struct {
     int dev_no;
     uint32_t block_no;    //eq to selector number.
     bool dirty;     // if the block is not sync with disk, dirty will be set.
-    rw_lock_t rw_lock;
-    byte data[CONFIG_FS_BLOCK_SIZE];
+    uint32_t ref_cnt;   // count of holders and pins,the block can`t be recycled when it isn`t zero.
+    uint32_t hit_cnt;   // cache hits since the block is loaded,for the hot set.
+    byte * data;    // points to buf,or into device`s mapping when block is clean.
     dnode_t dnode;
+    rw_lock_t rw_lock;
+    byte buf[CONFIG_FS_BLOCK_SIZE] __attribute__((aligned(64)));
 } block_t;
 
 typedef
 struct{
     block_t buffer[CONFIG_FS_BLOCK_CACHE_CNT];
+    // ids of buffer[i] packed apart from the blocks and hashed
+    // by index chains,so a lookup touches neither payloads nor list.
+    uint32_t block_nos[CONFIG_FS_BLOCK_CACHE_CNT];
+    int dev_nos[CONFIG_FS_BLOCK_CACHE_CNT];
+    uint16_t hash_next[CONFIG_FS_BLOCK_CACHE_CNT];
+    uint16_t hash_heads[CONFIG_FS_BLOCK_HASH_CNT];
     dlink_t dlink;
+    uint32_t anon_cnt;  // count of blocks lent as anonymous blocks.
+    uint32_t pin_cnt;   // count of pins taken by block_get_read_pinned and block_pin_read.
     bool dirty;
     rw_lock_t rw_lock;
 } block_cache_t;
 
 static inline void fs_stub_rw_lock_init(void * lock){
-
+    pthread_rwlock_init(lock,NULL);
 }
 
 static inline void fs_stub_rw_r_lock_acquire(void * lock){
-
+    pthread_rwlock_rdlock(lock);
 }
 
 static inline void fs_stub_rw_r_lock_release(void * lock){
-
+    pthread_rwlock_unlock(lock);
 }
 
 static inline void fs_stub_rw_w_lock_acquire(void * lock){
-
+    pthread_rwlock_wrlock(lock);
 }
 
 static inline void fs_stub_rw_w_lock_release(void * lock){
+    pthread_rwlock_unlock(lock);
+}
 
+// get write lock without waiting,return false when the lock is held.
+static inline bool fs_stub_rw_w_lock_try_acquire(void * lock){
+    return pthread_rwlock_trywrlock(lock) == 0;
+}
+
+// get read lock without waiting,return false when the write lock is held.
+static inline bool fs_stub_rw_r_lock_try_acquire(void * lock){
+    return pthread_rwlock_tryrdlock(lock) == 0;
 }
 
 //declare
-void read_select(void * buffer , uint32_t select_no);
-void write_select(void * buffer , uint32_t select_no);
-void disk_init();
+void read_select(int dev_no, void * buffer , uint32_t select_no);
+void write_select(int dev_no, void * buffer , uint32_t select_no);
+void disk_sync(int dev_no);
+byte * disk_map(int dev_no, uint32_t select_no);
+uint32_t disk_submit(int dev_no, const void * owner, fs_io_req_t ** reqs, uint32_t cnt);
+uint32_t disk_reap(int dev_no, const void * owner, fs_io_req_t ** done, uint32_t max, uint32_t min);
 
 // must holding block write lock
 static inline void fs_stub_source_read(block_t * block){
-    read_select(block->data,block->block_no);
+    read_select(block->dev_no,block->data,block->block_no);
 }
 
 // must holding block read lock
 static inline void fs_stub_source_write(block_t * block){
-    write_select(block->data,block->block_no);
+    write_select(block->dev_no,block->data,block->block_no);
+}
+
+// get the address of block in device`s mapping,
+// NULL if device is not mapped.
+static inline byte * fs_stub_source_map(int dev_no, uint32_t block_no){
+    return disk_map(dev_no,block_no);
+}
+
+// make the written data durable in device.
+static inline void fs_stub_source_sync(int dev_no){
+    disk_sync(dev_no);
+}
+
+// queue async requests,return count of requests queued.
+static inline uint32_t fs_stub_source_submit(int dev_no, const void * owner, fs_io_req_t ** reqs, uint32_t cnt){
+    return disk_submit(dev_no,owner,reqs,cnt);
 }
 
-static inline void fs_stub_source_init(){
-    disk_init();
+// wait for at least min requests completed,return count of completed.
+static inline uint32_t fs_stub_source_reap(int dev_no, const void * owner, fs_io_req_t ** done, uint32_t max, uint32_t min){
+    return disk_reap(dev_no,owner,done,max,min);
 }
 
 void dlink_add_tail(dlink_t * dlink, dnode_t * dnode);
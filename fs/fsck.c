@@ -0,0 +1,699 @@
+#include "stdlib.h"
+#include "string.h"
+#include "sched.h"
+#include "fsck.h"
+#include "fat32.h"
+#include "block.h"
+#include "virtul_disk.h"
+#define FSCK_CLUS_MASK 0x0FFFFFFF
+#define FSCK_DELETED 0xE5
+#define FSCK_FAT_SHIFT 7        // log2 of FAT items in a sector.
+
+typedef
+enum {
+    FSCK_CHAIN_END,     // chain ends normally.
+    FSCK_CHAIN_BROKEN,
+    FSCK_CHAIN_CROSS,
+} fsck_chain_t;
+
+/*!
+ * @note a dir to check,it`s first clus is claimed by the pusher.
+ */
+typedef
+struct {
+    uint32_t clus;
+    char path[FSCK_PATH_LEN];   // "" for root.
+} fsck_item_t;
+
+/*!
+ * @note work queue of a worker,the owner pushes and pops
+ *       at tail and the idle workers steal from head,
+ *       so a thief takes the dirs found earliest which
+ *       are the roots of biggest subtrees usually.
+ */
+typedef
+struct {
+    pthread_mutex_t lock;
+    fsck_item_t * items;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t cap;
+} fsck_deque_t;
+
+typedef
+struct {
+    int dev_no;
+    uint32_t flags;
+    uint8_t sec_per_clus;
+    uint16_t rsvd_sec_cnt;
+    uint8_t fat_cnt;
+    uint32_t fat_sz;
+    uint32_t root_clus;
+    uint32_t first_data_sec;
+    uint32_t max_clus;          // last valid clus number.
+    uint8_t clus_shift;         // log2 of bytes per clus.
+    uint32_t * fat;             // first FAT,loaded at once.
+    uint32_t * reach;           // bitmap of clusters reachable from root.
+    uint32_t * fat_dirty;       // bitmap of FAT sectors changed by repair.
+    uint32_t worker_cnt;
+    fsck_deque_t * deques;
+    uint32_t pending;           // count of dirs pushed and not checked.
+    bool failed;                // out of memory in workers.
+    pthread_mutex_t report_lock;
+    fsck_cb_t cb;
+    void * data;
+    fsck_report_t report;
+} fsck_t;
+
+typedef
+struct {
+    fsck_t * ck;
+    uint32_t self;
+} fsck_worker_t;
+
+static inline bool _fsck_repair(fsck_t * ck){
+    return (ck->flags&FSCK_REPAIR)!=0;
+}
+
+static inline uint32_t _fsck_first_sec(fsck_t * ck, uint32_t clus_no){
+    return ((clus_no-2)*ck->sec_per_clus)+ck->first_data_sec;
+}
+
+static inline uint32_t _fsck_first_clus(const entry_data_t * data){
+    return ((uint32_t)data->first_clus_high<<16)|data->first_clus_low;
+}
+
+/*!
+ * @note mark a clus reachable.
+ * @return false when it is claimed already.
+ */
+static inline bool _fsck_claim(fsck_t * ck, uint32_t clus_no){
+    uint32_t bit = 1u<<(clus_no&31);
+    return (__atomic_fetch_or(&ck->reach[clus_no>>5],bit,__ATOMIC_RELAXED)&bit) == 0;
+}
+
+static inline bool _fsck_reached(fsck_t * ck, uint32_t clus_no){
+    return (ck->reach[clus_no>>5]&(1u<<(clus_no&31)))!=0;
+}
+
+/*!
+ * @note change a FAT item,the sector is written back at end.
+ * @warning the clus must be claimed by caller,or no worker is running.
+ */
+static inline void _fsck_fat_set(fsck_t * ck, uint32_t clus_no, uint32_t data){
+    ck->fat[clus_no] = (ck->fat[clus_no]&~FSCK_CLUS_MASK)|data;
+    uint32_t fat_sec = clus_no>>FSCK_FAT_SHIFT;
+    __atomic_fetch_or(&ck->fat_dirty[fat_sec>>5],1u<<(fat_sec&31),__ATOMIC_RELAXED);
+}
+
+static void _fsck_problem(fsck_t * ck, fsck_kind_t kind, const char * path, uint32_t clus_no, uint32_t arg){
+    pthread_mutex_lock(&ck->report_lock);
+    switch(kind){
+        case FSCK_LEAK:
+            ck->report.leak_clus_cnt+=arg;
+            break;
+        case FSCK_CROSS:
+            ck->report.cross_cnt++;
+            break;
+        case FSCK_BROKEN:
+            ck->report.broken_cnt++;
+            break;
+        case FSCK_SIZE:
+            ck->report.size_cnt++;
+            break;
+    }
+    if(_fsck_repair(ck)){
+        ck->report.fixed_cnt++;
+    }
+    if(ck->cb!=NULL){
+        ck->cb(ck->data,kind,path!=NULL&&path[0]=='\0'?"/":path,clus_no,arg);
+    }
+    pthread_mutex_unlock(&ck->report_lock);
+}
+
+/*!
+ * @note read or write contiguous sectors by large requests,
+ *       which are submitted to async engine of device as deep
+ *       as possible. mapped device is read by copy,and device
+ *       without async I/O is accessed sector by sector.
+ * @return false when I/O fails or out of memory.
+ */
+static bool _fsck_io(fsck_t * ck, byte * buffer, uint32_t sec, uint32_t sec_cnt, bool write){
+    int const dev_no = ck->dev_no;
+    byte * mapped = write?NULL:fs_stub_source_map(dev_no,sec);
+    if(mapped!=NULL){
+        memcpy(buffer,mapped,(size_t)sec_cnt*CONFIG_FS_BLOCK_SIZE);
+        return true;
+    }
+    uint32_t const req_cnt = (sec_cnt+CONFIG_FS_FSCK_IO_SEC_CNT-1)/CONFIG_FS_FSCK_IO_SEC_CNT;
+    fs_io_req_t * reqs = malloc(req_cnt*sizeof(fs_io_req_t));
+    fs_io_req_t ** req_ptrs = malloc(req_cnt*sizeof(fs_io_req_t *));
+    if(reqs == NULL||req_ptrs == NULL){
+        free(reqs);
+        free(req_ptrs);
+        return false;
+    }
+    for(uint32_t i = 0;i<req_cnt;i++){
+        uint32_t offset = i*CONFIG_FS_FSCK_IO_SEC_CNT;
+        reqs[i].buffer = buffer+(size_t)offset*CONFIG_FS_BLOCK_SIZE;
+        reqs[i].select_no = sec+offset;
+        reqs[i].select_cnt = sec_cnt-offset<CONFIG_FS_FSCK_IO_SEC_CNT?sec_cnt-offset:CONFIG_FS_FSCK_IO_SEC_CNT;
+        reqs[i].write = write;
+        reqs[i].result = 0;
+        reqs[i].data = NULL;
+        req_ptrs[i] = &reqs[i];
+    }
+    bool ok = true;
+    uint32_t submitted = 0;
+    uint32_t in_flight = 0;
+    while(submitted<req_cnt||in_flight>0){
+        if(submitted<req_cnt&&in_flight<CONFIG_FS_AIO_DEPTH){
+            uint32_t cnt = req_cnt-submitted;
+            if(cnt>CONFIG_FS_AIO_DEPTH-in_flight){
+                cnt = CONFIG_FS_AIO_DEPTH-in_flight;
+            }
+            uint32_t queued = fs_stub_source_submit(dev_no,reqs,&req_ptrs[submitted],cnt);
+            if(queued == 0&&in_flight == 0){
+                // engine can`t take it,do it by selectors.
+                fs_io_req_t * req = req_ptrs[submitted];
+                for(uint32_t k = 0;k<req->select_cnt;k++){
+                    byte * data = (byte *)req->buffer+(size_t)k*CONFIG_FS_BLOCK_SIZE;
+                    if(write){
+                        write_select(dev_no,data,req->select_no+k);
+                    }
+                    else{
+                        read_select(dev_no,data,req->select_no+k);
+                    }
+                }
+                submitted++;
+                continue;
+            }
+            submitted+=queued;
+            in_flight+=queued;
+        }
+        if(in_flight == 0){
+            continue;
+        }
+        fs_io_req_t * done[CONFIG_FS_AIO_DEPTH];
+        uint32_t reaped = fs_stub_source_reap(dev_no,reqs,done,CONFIG_FS_AIO_DEPTH,1);
+        for(uint32_t k = 0;k<reaped;k++){
+            if(done[k]->result!=(int)(done[k]->select_cnt*CONFIG_FS_BLOCK_SIZE)){
+                ok = false;
+            }
+        }
+        in_flight-=reaped;
+    }
+    free(reqs);
+    free(req_ptrs);
+    return ok;
+}
+
+/*!
+ * @note read a clus in worker,the selectors are read
+ *       directly so workers don`t share the block cache.
+ */
+static void _fsck_clus_read(fsck_t * ck, byte * buffer, uint32_t clus_no){
+    uint32_t sec = _fsck_first_sec(ck,clus_no);
+    byte * mapped = fs_stub_source_map(ck->dev_no,sec);
+    if(mapped!=NULL){
+        memcpy(buffer,mapped,(size_t)ck->sec_per_clus*CONFIG_FS_BLOCK_SIZE);
+        return;
+    }
+    for(uint32_t i = 0;i<ck->sec_per_clus;i++){
+        read_select(ck->dev_no,buffer+(size_t)i*CONFIG_FS_BLOCK_SIZE,sec+i);
+    }
+}
+
+static void _fsck_clus_write(fsck_t * ck, byte * buffer, uint32_t clus_no){
+    uint32_t sec = _fsck_first_sec(ck,clus_no);
+    for(uint32_t i = 0;i<ck->sec_per_clus;i++){
+        write_select(ck->dev_no,buffer+(size_t)i*CONFIG_FS_BLOCK_SIZE,sec+i);
+    }
+}
+
+/*!
+ * @note claim the clusters of a chain in reachability bitmap.
+ * @param clus_no : first clus of chain.
+ * @param claimed : the first clus is claimed by caller.
+ * @param cnt : count of clusters claimed.
+ * @param last : last clus claimed,0 when none.
+ * @param stop : the clus where walk stops when chain doesn`t end normally.
+ * @return state of chain.
+ */
+static fsck_chain_t _fsck_chain_walk(fsck_t * ck, uint32_t clus_no, bool claimed,
+                                     uint32_t * cnt, uint32_t * last, uint32_t * stop){
+    *cnt = 0;
+    *last = 0;
+    for(;;){
+        *stop = clus_no;
+        if(clus_no<2||clus_no>ck->max_clus){
+            return FSCK_CHAIN_BROKEN;
+        }
+        if(!claimed&&!_fsck_claim(ck,clus_no)){
+            return FSCK_CHAIN_CROSS;
+        }
+        claimed = false;
+        (*cnt)++;
+        *last = clus_no;
+        uint32_t next = ck->fat[clus_no]&FSCK_CLUS_MASK;
+        if(next>=FAT32_EOC){
+            return FSCK_CHAIN_END;
+        }
+        clus_no = next;
+    }
+}
+
+/*!
+ * @note end a chain after last,the clusters after it
+ *       become leaked and they are freed at end.
+ * @param data : the dirent of chain.
+ * @param last : 0 to drop whole chain.
+ */
+static void _fsck_chain_cut(fsck_t * ck, entry_data_t * data, uint32_t last){
+    if(last == 0){
+        data->first_clus_high = 0;
+        data->first_clus_low = 0;
+    }
+    else{
+        _fsck_fat_set(ck,last,FAT32_FILE_END);
+    }
+}
+
+/*!
+ * @note check the chain and size of a file.
+ *       the clusters after the size are kept,entry_fallocate
+ *       reserves them without changing the size.
+ * @return true when the dirent is changed by repair.
+ */
+static bool _fsck_file(fsck_t * ck, entry_data_t * data, const char * path){
+    uint32_t const first = _fsck_first_clus(data);
+    uint32_t const clus_size = 1u<<ck->clus_shift;
+    uint32_t const expect = (data->file_size>>ck->clus_shift)+((data->file_size&(clus_size-1))!=0);
+    bool const repair = _fsck_repair(ck);
+    if(first == 0){
+        if(data->file_size == 0){
+            return false;
+        }
+        _fsck_problem(ck,FSCK_SIZE,path,0,0);
+        data->file_size = repair?0:data->file_size;
+        return repair;
+    }
+    uint32_t cnt,last,stop;
+    fsck_chain_t state = _fsck_chain_walk(ck,first,false,&cnt,&last,&stop);
+    if(state == FSCK_CHAIN_END){
+        if(cnt>=expect){
+            return false;
+        }
+        // the file is shorter than it`s size.
+        _fsck_problem(ck,FSCK_SIZE,path,first,cnt);
+        data->file_size = repair?cnt<<ck->clus_shift:data->file_size;
+        return repair;
+    }
+    _fsck_problem(ck,state == FSCK_CHAIN_CROSS?FSCK_CROSS:FSCK_BROKEN,path,state == FSCK_CHAIN_CROSS?stop:last,cnt);
+    if(!repair){
+        return false;
+    }
+    _fsck_chain_cut(ck,data,last);
+    if(data->file_size>(cnt<<ck->clus_shift)){
+        data->file_size = cnt<<ck->clus_shift;
+    }
+    return true;
+}
+
+static void _fsck_name(const entry_data_t * data, char * name){
+    int len = 0;
+    for(int i = 0;i<8&&data->name_head[i]!=' '&&data->name_head[i]!='\0';i++){
+        name[len++] = data->name_head[i];
+    }
+    if(data->name_suffix[0]!=' '&&data->name_suffix[0]!='\0'){
+        name[len++] = '.';
+        for(int i = 0;i<3&&data->name_suffix[i]!=' '&&data->name_suffix[i]!='\0';i++){
+            name[len++] = data->name_suffix[i];
+        }
+    }
+    name[len] = '\0';
+}
+
+static void _fsck_push(fsck_t * ck, uint32_t self, uint32_t clus_no, const char * path){
+    fsck_deque_t * deque = &ck->deques[self];
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail == deque->cap){
+        if(deque->head>0){
+            // reuse the space left by thieves.
+            memmove(deque->items,deque->items+deque->head,(deque->tail-deque->head)*sizeof(fsck_item_t));
+            deque->tail-=deque->head;
+            deque->head = 0;
+        }
+        else{
+            uint32_t cap = deque->cap?deque->cap*2:16;
+            fsck_item_t * items = realloc(deque->items,cap*sizeof(fsck_item_t));
+            if(items == NULL){
+                __atomic_store_n(&ck->failed,true,__ATOMIC_RELAXED);
+                pthread_mutex_unlock(&deque->lock);
+                return;
+            }
+            deque->items = items;
+            deque->cap = cap;
+        }
+    }
+    fsck_item_t * item = &deque->items[deque->tail++];
+    item->clus = clus_no;
+    strncpy(item->path,path,FSCK_PATH_LEN-1);
+    item->path[FSCK_PATH_LEN-1] = '\0';
+    // counted before any worker can take it.
+    __atomic_add_fetch(&ck->pending,1,__ATOMIC_ACQ_REL);
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool _fsck_pop(fsck_deque_t * deque, fsck_item_t * item, bool steal){
+    pthread_mutex_lock(&deque->lock);
+    bool got = deque->tail>deque->head;
+    if(got){
+        *item = steal?deque->items[deque->head++]:deque->items[--deque->tail];
+        if(deque->head == deque->tail){
+            deque->head = 0;
+            deque->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return got;
+}
+
+/*!
+ * @note check a dir,the files in it are checked here and
+ *       the sub dirs are pushed to worker`s queue.
+ *       only this worker touches the dir`s clusters,
+ *       so the dirents are repaired in place.
+ */
+static void _fsck_dir(fsck_t * ck, uint32_t self, const fsck_item_t * item){
+    bool const repair = _fsck_repair(ck);
+    uint32_t cnt,last,stop;
+    fsck_chain_t state = _fsck_chain_walk(ck,item->clus,true,&cnt,&last,&stop);
+    if(state!=FSCK_CHAIN_END){
+        _fsck_problem(ck,state == FSCK_CHAIN_CROSS?FSCK_CROSS:FSCK_BROKEN,item->path,state == FSCK_CHAIN_CROSS?stop:last,cnt);
+        if(repair){
+            _fsck_fat_set(ck,last,FAT32_FILE_END);
+        }
+    }
+    uint32_t const clus_size = 1u<<ck->clus_shift;
+    byte * buffer = malloc((size_t)cnt*clus_size);
+    uint32_t * clus_nos = malloc(cnt*sizeof(uint32_t));
+    bool * dirty = calloc(cnt,sizeof(bool));
+    if(buffer == NULL||clus_nos == NULL||dirty == NULL){
+        __atomic_store_n(&ck->failed,true,__ATOMIC_RELAXED);
+        goto end;
+    }
+    for(uint32_t i = 0,clus_no = item->clus;i<cnt;i++){
+        clus_nos[i] = clus_no;
+        _fsck_clus_read(ck,buffer+(size_t)i*clus_size,clus_no);
+        clus_no = ck->fat[clus_no]&FSCK_CLUS_MASK;
+    }
+    char path[FSCK_PATH_LEN];
+    char name[MAX_FULL_NAME];
+    for(size_t offset = 0;offset<(size_t)cnt*clus_size;offset+=sizeof(entry_data_t)){
+        entry_data_t * data = (entry_data_t *)(buffer+offset);
+        uint8_t const head = data->name_head[0];
+        if(head == 0){
+            break;
+        }
+        if(head == FSCK_DELETED||head == '.'||data->attr == ENTRY_ATTR_LONG_NAME||(data->attr&ENTRY_ATTR_ROLL)){
+            continue;
+        }
+        _fsck_name(data,name);
+        if(snprintf(path,FSCK_PATH_LEN,"%s/%s",item->path,name)>=FSCK_PATH_LEN){
+            // too deep to keep,the reports show the head of path.
+            memcpy(path+FSCK_PATH_LEN-4,"...",4);
+        }
+        bool changed;
+        if(data->attr&ENTRY_ATTR_DIR){
+            __atomic_add_fetch(&ck->report.dir_cnt,1,__ATOMIC_RELAXED);
+            uint32_t const first = _fsck_first_clus(data);
+            bool const valid = first>=2&&first<=ck->max_clus;
+            if(valid&&_fsck_claim(ck,first)){
+                _fsck_push(ck,self,first,path);
+                continue;
+            }
+            // the dir can`t be kept,it`s clusters are freed as leaked.
+            _fsck_problem(ck,valid?FSCK_CROSS:FSCK_BROKEN,path,first,0);
+            data->name_head[0] = repair?FSCK_DELETED:data->name_head[0];
+            changed = repair;
+        }
+        else{
+            __atomic_add_fetch(&ck->report.file_cnt,1,__ATOMIC_RELAXED);
+            changed = _fsck_file(ck,data,path);
+        }
+        if(changed){
+            dirty[offset>>ck->clus_shift] = true;
+        }
+    }
+    for(uint32_t i = 0;i<cnt;i++){
+        if(dirty[i]){
+            _fsck_clus_write(ck,buffer+(size_t)i*clus_size,clus_nos[i]);
+        }
+    }
+    end:
+    free(buffer);
+    free(clus_nos);
+    free(dirty);
+}
+
+static void * _fsck_worker(void * arg){
+    fsck_t * ck = ((fsck_worker_t *)arg)->ck;
+    uint32_t const self = ((fsck_worker_t *)arg)->self;
+    fsck_item_t * item = malloc(sizeof(fsck_item_t));
+    if(item == NULL){
+        // the other workers still drain the queues.
+        return NULL;
+    }
+    for(;;){
+        bool got = _fsck_pop(&ck->deques[self],item,false);
+        for(uint32_t i = 1;!got&&i<ck->worker_cnt;i++){
+            got = _fsck_pop(&ck->deques[(self+i)%ck->worker_cnt],item,true);
+        }
+        if(got){
+            _fsck_dir(ck,self,item);
+            __atomic_sub_fetch(&ck->pending,1,__ATOMIC_ACQ_REL);
+        }
+        else if(__atomic_load_n(&ck->pending,__ATOMIC_ACQUIRE) == 0){
+            break;
+        }
+        else{
+            sched_yield();
+        }
+    }
+    free(item);
+    return NULL;
+}
+
+/*!
+ * @note walk the dir tree from root by workers.
+ * @return false when no worker can run.
+ */
+static bool _fsck_walk(fsck_t * ck){
+    ck->deques = calloc(ck->worker_cnt,sizeof(fsck_deque_t));
+    fsck_worker_t * workers = calloc(ck->worker_cnt,sizeof(fsck_worker_t));
+    pthread_t * threads = calloc(ck->worker_cnt,sizeof(pthread_t));
+    bool ret = ck->deques!=NULL&&workers!=NULL&&threads!=NULL;
+    if(ret){
+        for(uint32_t i = 0;i<ck->worker_cnt;i++){
+            pthread_mutex_init(&ck->deques[i].lock,NULL);
+            workers[i].ck = ck;
+            workers[i].self = i;
+        }
+        _fsck_push(ck,0,ck->root_clus,"");
+        // the caller is worker 0.
+        uint32_t started = 1;
+        for(;started<ck->worker_cnt;started++){
+            if(pthread_create(&threads[started],NULL,_fsck_worker,&workers[started])!=0){
+                break;
+            }
+        }
+        _fsck_worker(&workers[0]);
+        for(uint32_t i = 1;i<started;i++){
+            pthread_join(threads[i],NULL);
+        }
+        for(uint32_t i = 0;i<ck->worker_cnt;i++){
+            free(ck->deques[i].items);
+            pthread_mutex_destroy(&ck->deques[i].lock);
+        }
+        ret = ck->pending == 0;
+    }
+    free(ck->deques);
+    free(workers);
+    free(threads);
+    ck->deques = NULL;
+    return ret;
+}
+
+/*!
+ * @note count the used clusters,and the used but
+ *       unreachable clusters are leaked.
+ */
+static void _fsck_leak_scan(fsck_t * ck){
+    uint32_t run = 0;
+    uint32_t run_len = 0;
+    for(uint32_t clus_no = 2;clus_no<=ck->max_clus+1;clus_no++){
+        bool leaked = false;
+        if(clus_no<=ck->max_clus){
+            uint32_t item = ck->fat[clus_no]&FSCK_CLUS_MASK;
+            if(item!=0&&item!=FAT32_BAD){
+                ck->report.used_clus_cnt++;
+                if(_fsck_reached(ck,clus_no)){
+                    ck->report.reach_clus_cnt++;
+                }
+                else{
+                    leaked = true;
+                }
+            }
+        }
+        if(leaked){
+            run = run_len == 0?clus_no:run;
+            run_len++;
+            if(_fsck_repair(ck)){
+                _fsck_fat_set(ck,clus_no,0);
+            }
+            continue;
+        }
+        if(run_len>0){
+            _fsck_problem(ck,FSCK_LEAK,NULL,run,run_len);
+            run_len = 0;
+        }
+    }
+}
+
+/*!
+ * @note write the changed FAT sectors to every FAT,
+ *       contiguous changed sectors are written together.
+ */
+static bool _fsck_fat_store(fsck_t * ck){
+    bool ok = true;
+    for(uint32_t sec = 0;sec<ck->fat_sz;){
+        if((ck->fat_dirty[sec>>5]&(1u<<(sec&31))) == 0){
+            sec++;
+            continue;
+        }
+        uint32_t end = sec+1;
+        while(end<ck->fat_sz&&(ck->fat_dirty[end>>5]&(1u<<(end&31)))!=0){
+            end++;
+        }
+        for(uint8_t i = 0;i<ck->fat_cnt;i++){
+            byte * buffer = (byte *)ck->fat+(size_t)sec*CONFIG_FS_BLOCK_SIZE;
+            ok = _fsck_io(ck,buffer,ck->rsvd_sec_cnt+ck->fat_sz*i+sec,end-sec,true)&&ok;
+        }
+        sec = end;
+    }
+    return ok;
+}
+
+/*!
+ * @note read geometry from boot sector.
+ * @return false when it is not a FAT32 volume fsck supports.
+ */
+static bool _fsck_geo(fsck_t * ck){
+    byte buffer[CONFIG_FS_BLOCK_SIZE];
+    read_select(ck->dev_no,buffer,0);
+    if(strncmp((char const *)(buffer+0x52),"FAT32",5)!=0||*(uint16_t *)(buffer+0x0B)!=CONFIG_FS_BLOCK_SIZE){
+        return false;
+    }
+    ck->sec_per_clus = buffer[0x0D];
+    ck->rsvd_sec_cnt = *(uint16_t *)(buffer+0x0E);
+    ck->fat_cnt = buffer[0x10];
+    uint32_t tot_sec = *(uint16_t *)(buffer+0x13);
+    tot_sec = tot_sec == 0?*(uint32_t *)(buffer+0x20):tot_sec;
+    ck->fat_sz = *(uint16_t *)(buffer+0x16);
+    ck->fat_sz = ck->fat_sz == 0?*(uint32_t *)(buffer+0x24):ck->fat_sz;
+    ck->root_clus = *(uint32_t *)(buffer+0x2C);
+    uint8_t spc = ck->sec_per_clus;
+    if(spc == 0||(spc&(spc-1))!=0||ck->fat_cnt == 0||ck->fat_sz == 0){
+        return false;
+    }
+    ck->clus_shift = 9;
+    while((1u<<(ck->clus_shift-9))!=spc){
+        ck->clus_shift++;
+    }
+    ck->first_data_sec = ck->rsvd_sec_cnt+ck->fat_cnt*ck->fat_sz;
+    if(tot_sec<=ck->first_data_sec||tot_sec>disk_get_max_selector_no(ck->dev_no)){
+        return false;
+    }
+    uint32_t clus_cnt = (tot_sec-ck->first_data_sec)/spc;
+    // the FAT may be shorter than data region.
+    uint32_t fat_items = ck->fat_sz<<FSCK_FAT_SHIFT;
+    ck->max_clus = clus_cnt+1<fat_items-1?clus_cnt+1:fat_items-1;
+    return ck->root_clus>=2&&ck->root_clus<=ck->max_clus;
+}
+
+/*!
+ * @note check a FAT32 volume in a registered device.
+ *       the FAT is loaded by large async reads,and the dir tree
+ *       is walked by a pool of workers which steal dirs from each
+ *       other. every chain claims it`s clusters in a bitmap,so a
+ *       clus claimed twice is cross-linked,and a used clus never
+ *       claimed is leaked.
+ *       when repairing,a broken or cross-linked chain is cut before
+ *       the bad link,a dir which can`t be kept is removed,file size
+ *       is fit to it`s chain and leaked clusters are freed.
+ * @warning the device can`t be mounted.
+ * @param dev_no
+ * @param flags : FSCK_REPAIR to fix the problems.
+ * @param worker_cnt : 0 for CONFIG_FS_FSCK_WORKER_CNT.
+ * @param cb : called for every problem,can be NULL.
+ * @param data : passed to cb.
+ * @param report : counts of volume and problems.
+ * @return false when the volume is not FAT32,out of memory or I/O fails.
+ */
+bool fat32_fsck_dev(int dev_no, uint32_t flags, uint32_t worker_cnt, fsck_cb_t cb, void * data, fsck_report_t * report){
+    fsck_t ck;
+    memset(&ck,0,sizeof(fsck_t));
+    ck.dev_no = dev_no;
+    ck.flags = flags;
+    ck.worker_cnt = worker_cnt == 0?CONFIG_FS_FSCK_WORKER_CNT:worker_cnt;
+    ck.cb = cb;
+    ck.data = data;
+    // the device is read and written directly.
+    block_flush_dev(dev_no);
+    block_drop_dev(dev_no);
+    if(!_fsck_geo(&ck)){
+        return false;
+    }
+    pthread_mutex_init(&ck.report_lock,NULL);
+    ck.fat = malloc((size_t)ck.fat_sz*CONFIG_FS_BLOCK_SIZE);
+    ck.reach = calloc((ck.max_clus>>5)+1,sizeof(uint32_t));
+    ck.fat_dirty = calloc((ck.fat_sz>>5)+1,sizeof(uint32_t));
+    bool ret = ck.fat!=NULL&&ck.reach!=NULL&&ck.fat_dirty!=NULL;
+    ret = ret&&_fsck_io(&ck,(byte *)ck.fat,ck.rsvd_sec_cnt,ck.fat_sz,false);
+    if(ret){
+        _fsck_claim(&ck,ck.root_clus);
+        ret = _fsck_walk(&ck)&&!ck.failed;
+    }
+    // leaked clusters are not freed when walk is not complete.
+    if(ret){
+        _fsck_leak_scan(&ck);
+        ck.report.dir_cnt++;    // root
+    }
+    if(ret&&_fsck_repair(&ck)){
+        ret = _fsck_fat_store(&ck);
+        disk_sync(dev_no);
+    }
+    if(report!=NULL){
+        *report = ck.report;
+    }
+    free(ck.fat);
+    free(ck.reach);
+    free(ck.fat_dirty);
+    pthread_mutex_destroy(&ck.report_lock);
+    return ret;
+}
+
+/*!
+ * @note check a FAT32 image file.
+ * @see fat32_fsck_dev
+ */
+bool fat32_fsck(const char * path, uint32_t flags, uint32_t worker_cnt, fsck_cb_t cb, void * data, fsck_report_t * report){
+    int dev_no = disk_open(path,0);
+    if(dev_no == DISK_NO_ERROR){
+        return false;
+    }
+    bool ret = fat32_fsck_dev(dev_no,flags,worker_cnt,cb,data,report);
+    disk_close(dev_no);
+    return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef OPENBHOS_FS_FSCK_H
+#define OPENBHOS_FS_FSCK_H
+
+#include "fs_common.h"
+
+#define FSCK_REPAIR 0x1     // fix the problems found,or only report them.
+#define FSCK_PATH_LEN 256
+
+typedef
+enum {
+    FSCK_LEAK,      // clusters used in FAT but not reachable,clus is first of run and arg is length.
+    FSCK_CROSS,     // chain of path runs into clus claimed by another chain or itself.
+    FSCK_BROKEN,    // chain of path links to a free,bad or out of range clus from clus.
+    FSCK_SIZE,      // chain of file path is shorter than it`s size,arg is count of clusters in chain.
+} fsck_kind_t;
+
+/*!
+ * @note called for every problem found,maybe from worker threads
+ *       but never at the same time.
+ * @param path : NULL for leaked clusters.
+ */
+typedef void (*fsck_cb_t)(void * data, fsck_kind_t kind, const char * path, uint32_t clus, uint32_t arg);
+
+typedef
+struct {
+    uint32_t dir_cnt;
+    uint32_t file_cnt;
+    uint32_t used_clus_cnt;     // clusters not free in FAT.
+    uint32_t reach_clus_cnt;    // clusters reachable from root.
+    uint32_t leak_clus_cnt;
+    uint32_t cross_cnt;
+    uint32_t broken_cnt;
+    uint32_t size_cnt;
+    uint32_t fixed_cnt;         // count of problems repaired.
+} fsck_report_t;
+
+bool fat32_fsck_dev(int dev_no, uint32_t flags, uint32_t worker_cnt, fsck_cb_t cb, void * data, fsck_report_t * report);
+bool fat32_fsck(const char * path, uint32_t flags, uint32_t worker_cnt, fsck_cb_t cb, void * data, fsck_report_t * report);
+
+#endif //OPENBHOS_FS_FSCK_H
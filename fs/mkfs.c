@@ -0,0 +1,243 @@
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "mkfs.h"
+#include "block.h"
+#include "virtul_disk.h"
+#define MKFS_ZERO_CHUNK (1024*1024)
+#define MKFS_MEDIA 0xF8
+
+typedef
+struct {
+    uint16_t byts_per_sec;
+    uint8_t sec_per_clus;
+    uint16_t rsvd_sec_cnt;
+    uint8_t fat_cnt;
+    uint32_t tot_sec;
+    uint32_t fat_sz;
+    uint32_t clus_cnt;
+    uint32_t first_data_sec;
+} mkfs_layout_t;
+
+/*!
+ * @note where the volume is written,a file or a registered device.
+ */
+typedef
+struct {
+    int fd;         // -1 when write to device.
+    int dev_no;
+    uint16_t byts_per_sec;
+} mkfs_out_t;
+
+static inline void _put16(byte * buf, uint32_t offset, uint16_t data){
+    buf[offset] = data&0xFF;
+    buf[offset+1] = data>>8;
+}
+
+static inline void _put32(byte * buf, uint32_t offset, uint32_t data){
+    _put16(buf,offset,data&0xFFFF);
+    _put16(buf,offset+2,data>>16);
+}
+
+/*!
+ * @note compute the size of FAT and count of clusters.
+ * @return false when geometry is invalid for FAT32,
+ *         or the volume can`t be mounted by fat32_mount.
+ */
+static bool _mkfs_layout(const mkfs_param_t * param, mkfs_layout_t * layout){
+    layout->byts_per_sec = param->byts_per_sec?param->byts_per_sec:CONFIG_FS_BLOCK_SIZE;
+    layout->sec_per_clus = param->sec_per_clus?param->sec_per_clus:1;
+    layout->rsvd_sec_cnt = param->rsvd_sec_cnt?param->rsvd_sec_cnt:32;
+    layout->fat_cnt = param->fat_cnt?param->fat_cnt:2;
+    uint16_t bps = layout->byts_per_sec;
+    uint8_t spc = layout->sec_per_clus;
+    if(bps!=CONFIG_FS_BLOCK_SIZE||spc!=1||layout->rsvd_sec_cnt<8){
+        return false;
+    }
+    size_t tot_sec = param->size/bps;
+    if(tot_sec>0xFFFFFFFF||tot_sec<=layout->rsvd_sec_cnt){
+        return false;
+    }
+    layout->tot_sec = tot_sec;
+    // the FAT must have an item for every cluster in data region
+    // which shrinks when FAT grows,so grow FAT until it is enough.
+    uint32_t fat_sz = 1;
+    for(;;){
+        size_t meta_sec = layout->rsvd_sec_cnt+(size_t)layout->fat_cnt*fat_sz;
+        if(meta_sec>=tot_sec){
+            return false;
+        }
+        uint32_t clus_cnt = (tot_sec-meta_sec)/spc;
+        uint32_t need = ((size_t)(clus_cnt+2)*4+bps-1)/bps;
+        if(need<=fat_sz){
+            layout->clus_cnt = clus_cnt;
+            break;
+        }
+        fat_sz = need;
+    }
+    layout->fat_sz = fat_sz;
+    layout->first_data_sec = layout->rsvd_sec_cnt+layout->fat_cnt*fat_sz;
+    return layout->clus_cnt>=MKFS_FAT32_MIN_CLUS&&layout->clus_cnt<=MKFS_FAT32_MAX_CLUS;
+}
+
+static void _mkfs_boot_sec(byte * buf, const mkfs_layout_t * layout, const mkfs_param_t * param){
+    memset(buf,0,layout->byts_per_sec);
+    buf[0] = 0xEB;
+    buf[1] = 0x58;
+    buf[2] = 0x90;
+    memcpy(buf+0x03,"BHOSMKFS",8);
+    _put16(buf,0x0B,layout->byts_per_sec);
+    buf[0x0D] = layout->sec_per_clus;
+    _put16(buf,0x0E,layout->rsvd_sec_cnt);
+    buf[0x10] = layout->fat_cnt;
+    buf[0x15] = MKFS_MEDIA;
+    _put16(buf,0x18,63);        // sectors per track
+    _put16(buf,0x1A,255);       // count of heads
+    _put32(buf,0x20,layout->tot_sec);
+    _put32(buf,0x24,layout->fat_sz);
+    _put32(buf,0x2C,2);         // root clus
+    _put16(buf,0x30,1);         // FSInfo sector
+    _put16(buf,0x32,6);         // backup boot sector
+    buf[0x40] = 0x80;
+    buf[0x42] = 0x29;
+    _put32(buf,0x43,param->vol_id);
+    if(param->label[0]!='\0'){
+        memcpy(buf+0x47,param->label,11);
+    }
+    else{
+        memcpy(buf+0x47,"NO NAME    ",11);
+    }
+    memcpy(buf+0x52,"FAT32   ",8);
+    buf[510] = 0x55;
+    buf[511] = 0xAA;
+}
+
+static void _mkfs_fsinfo_sec(byte * buf, const mkfs_layout_t * layout){
+    memset(buf,0,layout->byts_per_sec);
+    _put32(buf,0x000,0x41615252);
+    _put32(buf,0x1E4,0x61417272);
+    _put32(buf,0x1E8,layout->clus_cnt-1);   // root dir uses one clus.
+    _put32(buf,0x1EC,3);
+    _put32(buf,0x1FC,0xAA550000);
+}
+
+static bool _mkfs_write(mkfs_out_t * out, uint32_t sec, const byte * buf, uint32_t sec_cnt){
+    if(out->fd>=0){
+        size_t length = (size_t)sec_cnt*out->byts_per_sec;
+        off_t offset = (off_t)sec*out->byts_per_sec;
+        for(size_t done = 0;done<length;){
+            ssize_t ret = pwrite(out->fd,buf+done,length-done,offset+done);
+            if(ret<=0){
+                return false;
+            }
+            done+=ret;
+        }
+        return true;
+    }
+    for(uint32_t i = 0;i<sec_cnt;i++){
+        write_select(out->dev_no,(void *)(buf+(size_t)i*out->byts_per_sec),sec+i);
+    }
+    return true;
+}
+
+/*!
+ * @note fill sectors with zero by large writes.
+ */
+static bool _mkfs_zero(mkfs_out_t * out, uint32_t sec, uint32_t sec_cnt){
+    byte * zero = calloc(1,MKFS_ZERO_CHUNK);
+    if(zero == NULL){
+        return false;
+    }
+    uint32_t const chunk_sec = MKFS_ZERO_CHUNK/out->byts_per_sec;
+    bool ret = true;
+    while(sec_cnt>0&&ret){
+        uint32_t cnt = sec_cnt<chunk_sec?sec_cnt:chunk_sec;
+        ret = _mkfs_write(out,sec,zero,cnt);
+        sec+=cnt;
+        sec_cnt-=cnt;
+    }
+    free(zero);
+    return ret;
+}
+
+/*!
+ * @note write the metadata of volume,the data region
+ *       is not touched except root dir.
+ */
+static bool _mkfs_format(mkfs_out_t * out, const mkfs_layout_t * layout, const mkfs_param_t * param){
+    uint16_t const bps = layout->byts_per_sec;
+    byte * buf = malloc(bps);
+    if(buf == NULL){
+        return false;
+    }
+    bool ret = true;
+    // the reserved region,FAT and root dir are cleared
+    // at first,so the old data in them is gone.
+    ret = ret&&_mkfs_zero(out,0,layout->first_data_sec+layout->sec_per_clus);
+    _mkfs_boot_sec(buf,layout,param);
+    ret = ret&&_mkfs_write(out,0,buf,1);
+    ret = ret&&_mkfs_write(out,6,buf,1);
+    _mkfs_fsinfo_sec(buf,layout);
+    ret = ret&&_mkfs_write(out,1,buf,1);
+    ret = ret&&_mkfs_write(out,7,buf,1);
+    // the first sector of every FAT
+    memset(buf,0,bps);
+    _put32(buf,0,0x0FFFFF00|MKFS_MEDIA);
+    _put32(buf,4,0x0FFFFFFF);
+    _put32(buf,8,0x0FFFFFFF);   // root dir
+    for(uint8_t i = 0;i<layout->fat_cnt;i++){
+        ret = ret&&_mkfs_write(out,layout->rsvd_sec_cnt+i*layout->fat_sz,buf,1);
+    }
+    free(buf);
+    return ret;
+}
+
+/*!
+ * @note create a FAT32 image file.
+ *       the file is sparse,only the metadata is written.
+ * @param path : the file is created or overwritten.
+ * @param param
+ * @return false when geometry is invalid or fail to write.
+ */
+bool fat32_mkfs(const char * path, const mkfs_param_t * param){
+    mkfs_layout_t layout;
+    if(!_mkfs_layout(param,&layout)){
+        return false;
+    }
+    int fd = open(path,O_RDWR|O_CREAT,0644);
+    if(fd<0){
+        return false;
+    }
+    mkfs_out_t out = {fd,-1,layout.byts_per_sec};
+    bool ret = ftruncate(fd,(off_t)layout.tot_sec*layout.byts_per_sec) == 0;
+    ret = ret&&_mkfs_format(&out,&layout,param);
+    ret = ret&&fsync(fd) == 0;
+    close(fd);
+    return ret;
+}
+
+/*!
+ * @note format a registered device,such as a ram disk.
+ *       param->size is cut to size of device,and the
+ *       sector size must equal to selector size.
+ * @warning the device can`t be mounted.
+ * @return false when geometry is invalid.
+ */
+bool fat32_mkfs_dev(int dev_no, const mkfs_param_t * param){
+    mkfs_param_t dev_param = *param;
+    size_t dev_size = (size_t)disk_get_max_selector_no(dev_no)*CONFIG_FS_BLOCK_SIZE;
+    if(dev_param.size == 0||dev_param.size>dev_size){
+        dev_param.size = dev_size;
+    }
+    mkfs_layout_t layout;
+    if(!_mkfs_layout(&dev_param,&layout)){
+        return false;
+    }
+    // the cached blocks of device are stale after format.
+    block_drop_dev(dev_no);
+    mkfs_out_t out = {-1,dev_no,layout.byts_per_sec};
+    bool ret = _mkfs_format(&out,&layout,&dev_param);
+    disk_sync(dev_no);
+    return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef OPENBHOS_FS_MKFS_H
+#define OPENBHOS_FS_MKFS_H
+
+#include "fs_common.h"
+
+#define MKFS_FAT32_MIN_CLUS 65525
+#define MKFS_FAT32_MAX_CLUS 0x0FFFFFF5
+
+/*!
+ * @note geometry of a new FAT32 volume,
+ *       the fields which are zero get default value.
+ */
+typedef
+struct {
+    size_t size;                // bytes of volume.
+    uint16_t byts_per_sec;      // must be CONFIG_FS_BLOCK_SIZE,the only size can be mounted. default 512.
+    uint8_t sec_per_clus;       // must be 1,the cluster of some sectors can`t be mounted. default 1.
+    uint16_t rsvd_sec_cnt;      // default 32.
+    uint8_t fat_cnt;            // default 2.
+    uint32_t vol_id;
+    char label[11];             // padded with space,default "NO NAME    ".
+} mkfs_param_t;
+
+bool fat32_mkfs(const char * path, const mkfs_param_t * param);
+bool fat32_mkfs_dev(int dev_no, const mkfs_param_t * param);
+
+#endif //OPENBHOS_FS_MKFS_H
@@ -0,0 +1,257 @@
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "ram_disk.h"
+#include "virtul_disk.h"
+#define SELECTOR_SIZE 512
+
+/*!
+ * @note a device kept in memory.
+ *       async requests are done when submitted and wait
+ *       in completion queue until reaped.
+ */
+typedef
+struct {
+    bool used;
+    int dev_no;
+    byte * data;
+    uint32_t select_cnt;
+    uint32_t read_ns;       // latency injected for every read request.
+    uint32_t write_ns;      // latency injected for every write request.
+    fs_io_req_t * complete_queue[CONFIG_FS_AIO_DEPTH];
+    uint32_t complete_head;
+    uint32_t complete_cnt;
+    uint32_t busy_cnt;      // requests being copied,they have slots in completion queue.
+    pthread_mutex_t queue_lock;
+} ram_disk_t;
+
+static ram_disk_t ram_disks[CONFIG_FS_DEV_CNT];
+
+static void _ram_delay(uint32_t ns){
+    if(ns == 0){
+        return;
+    }
+    struct timespec req = {ns/1000000000,ns%1000000000};
+    while(nanosleep(&req,&req)!=0);
+}
+
+static void _ram_read(void * priv, void * buffer, uint32_t select_no){
+    ram_disk_t * ram = priv;
+    _ram_delay(ram->read_ns);
+    memcpy(buffer,ram->data+(size_t)select_no*SELECTOR_SIZE,SELECTOR_SIZE);
+}
+
+static void _ram_write(void * priv, void * buffer, uint32_t select_no){
+    ram_disk_t * ram = priv;
+    _ram_delay(ram->write_ns);
+    memcpy(ram->data+(size_t)select_no*SELECTOR_SIZE,buffer,SELECTOR_SIZE);
+}
+
+static uint32_t _ram_submit(void * priv, fs_io_req_t ** reqs, uint32_t cnt){
+    ram_disk_t * ram = priv;
+    uint32_t queued = 0;
+    for(;queued<cnt;queued++){
+        pthread_mutex_lock(&ram->queue_lock);
+        if(ram->complete_cnt+ram->busy_cnt>=CONFIG_FS_AIO_DEPTH){
+            pthread_mutex_unlock(&ram->queue_lock);
+            break;
+        }
+        ram->busy_cnt++;
+        pthread_mutex_unlock(&ram->queue_lock);
+        // the copies of threads run at same time like a device.
+        fs_io_req_t * req = reqs[queued];
+        size_t length = (size_t)req->select_cnt*SELECTOR_SIZE;
+        byte * addr = ram->data+(size_t)req->select_no*SELECTOR_SIZE;
+        if(req->write){
+            _ram_delay(ram->write_ns);
+            memcpy(addr,req->buffer,length);
+        }
+        else{
+            _ram_delay(ram->read_ns);
+            memcpy(req->buffer,addr,length);
+        }
+        req->result = (int)length;
+        pthread_mutex_lock(&ram->queue_lock);
+        ram->busy_cnt--;
+        ram->complete_queue[(ram->complete_head+ram->complete_cnt)%CONFIG_FS_AIO_DEPTH] = req;
+        ram->complete_cnt++;
+        pthread_mutex_unlock(&ram->queue_lock);
+    }
+    return queued;
+}
+
+/*!
+ * @note requests are done when submitted,so min is never waited.
+ *       the requests of all threads are reaped,disk_reap gives
+ *       them back to their submitters.
+ */
+static uint32_t _ram_reap(void * priv, fs_io_req_t ** done, uint32_t max, uint32_t min){
+    ram_disk_t * ram = priv;
+    uint32_t got = 0;
+    (void)min;
+    pthread_mutex_lock(&ram->queue_lock);
+    for(;got<max&&ram->complete_cnt>0;got++){
+        done[got] = ram->complete_queue[ram->complete_head];
+        ram->complete_head = (ram->complete_head+1)%CONFIG_FS_AIO_DEPTH;
+        ram->complete_cnt--;
+    }
+    pthread_mutex_unlock(&ram->queue_lock);
+    return got;
+}
+
+static byte * _ram_map(void * priv, uint32_t select_no){
+    return ((ram_disk_t *)priv)->data+(size_t)select_no*SELECTOR_SIZE;
+}
+
+static void _ram_close(void * priv){
+    ram_disk_t * ram = priv;
+    pthread_mutex_destroy(&ram->queue_lock);
+    free(ram->data);
+    ram->data = NULL;
+    ram->used = false;
+}
+
+static const disk_ops_t ram_disk_ops = {
+        _ram_read,
+        _ram_write,
+        _ram_submit,
+        _ram_reap,
+        NULL,
+        NULL,
+        _ram_close
+};
+
+static const disk_ops_t ram_disk_map_ops = {
+        _ram_read,
+        _ram_write,
+        _ram_submit,
+        _ram_reap,
+        _ram_map,
+        NULL,
+        _ram_close
+};
+
+/*!
+ * @note get a free ram disk and register it with zeroed data.
+ */
+static ram_disk_t * _ram_disk_new(uint32_t select_cnt, uint32_t flags){
+    ram_disk_t * ram = NULL;
+    for(int i = 0;i<CONFIG_FS_DEV_CNT;i++){
+        if(!ram_disks[i].used){
+            ram = &ram_disks[i];
+            break;
+        }
+    }
+    if(ram == NULL){
+        return NULL;
+    }
+    bzero(ram,sizeof(ram_disk_t));
+    ram->data = calloc(select_cnt,SELECTOR_SIZE);
+    if(ram->data == NULL){
+        return NULL;
+    }
+    ram->select_cnt = select_cnt;
+    pthread_mutex_init(&ram->queue_lock,NULL);
+    const disk_ops_t * ops = (flags&DISK_OPEN_MMAP)?&ram_disk_map_ops:&ram_disk_ops;
+    ram->dev_no = disk_register(ops,ram,SELECTOR_SIZE,select_cnt);
+    if(ram->dev_no == DISK_NO_ERROR){
+        pthread_mutex_destroy(&ram->queue_lock);
+        free(ram->data);
+        ram->data = NULL;
+        return NULL;
+    }
+    ram->used = true;
+    return ram;
+}
+
+static ram_disk_t * _ram_disk_get(int dev_no){
+    for(int i = 0;i<CONFIG_FS_DEV_CNT;i++){
+        if(ram_disks[i].used&&ram_disks[i].dev_no == dev_no){
+            return &ram_disks[i];
+        }
+    }
+    PANIC("device is not a ram disk!\n");
+    return NULL;
+}
+
+/*!
+ * @note create a ram disk filled with zero,closed by disk_close.
+ * @param select_cnt
+ * @param flags : DISK_OPEN_MMAP to hand out clean blocks
+ *                from memory of ram disk directly.
+ * @return dev_no or DISK_NO_ERROR when fail.
+ */
+int ram_disk_create(uint32_t select_cnt, uint32_t flags){
+    ram_disk_t * ram = _ram_disk_new(select_cnt,flags);
+    return ram == NULL?DISK_NO_ERROR:ram->dev_no;
+}
+
+/*!
+ * @note create a ram disk with a copy of image file.
+ * @param path
+ * @param flags : flags of ram_disk_create.
+ * @return dev_no or DISK_NO_ERROR when fail.
+ */
+int ram_disk_load(const char * path, uint32_t flags){
+    int fd = open(path,O_RDONLY);
+    if(fd<0){
+        return DISK_NO_ERROR;
+    }
+    off_t size = lseek(fd,0L,SEEK_END);
+    ram_disk_t * ram = _ram_disk_new(size/SELECTOR_SIZE,flags);
+    if(ram == NULL){
+        close(fd);
+        return DISK_NO_ERROR;
+    }
+    size_t length = (size_t)ram->select_cnt*SELECTOR_SIZE;
+    for(size_t done = 0;done<length;){
+        ssize_t ret = pread(fd,ram->data+done,length-done,done);
+        if(ret<=0){
+            close(fd);
+            disk_close(ram->dev_no);
+            return DISK_NO_ERROR;
+        }
+        done+=ret;
+    }
+    close(fd);
+    return ram->dev_no;
+}
+
+/*!
+ * @note write the data of ram disk to an image file.
+ * @warning the dirty blocks must be flushed before.
+ * @return false when fail to write.
+ */
+bool ram_disk_save(int dev_no, const char * path){
+    ram_disk_t * ram = _ram_disk_get(dev_no);
+    int fd = open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(fd<0){
+        return false;
+    }
+    size_t length = (size_t)ram->select_cnt*SELECTOR_SIZE;
+    for(size_t done = 0;done<length;){
+        ssize_t ret = pwrite(fd,ram->data+done,length-done,done);
+        if(ret<=0){
+            close(fd);
+            return false;
+        }
+        done+=ret;
+    }
+    close(fd);
+    return true;
+}
+
+/*!
+ * @note inject latency for every I/O request to model slow media.
+ *       the mapped blocks are not delayed.
+ * @param dev_no
+ * @param read_ns
+ * @param write_ns
+ */
+void ram_disk_set_latency(int dev_no, uint32_t read_ns, uint32_t write_ns){
+    ram_disk_t * ram = _ram_disk_get(dev_no);
+    ram->read_ns = read_ns;
+    ram->write_ns = write_ns;
+}
@@ -0,0 +1,11 @@
+#ifndef OPENBHOS_FS_RAM_DISK_H
+#define OPENBHOS_FS_RAM_DISK_H
+
+#include "fs_common.h"
+
+int ram_disk_create(uint32_t select_cnt, uint32_t flags);
+int ram_disk_load(const char * path, uint32_t flags);
+bool ram_disk_save(int dev_no, const char * path);
+void ram_disk_set_latency(int dev_no, uint32_t read_ns, uint32_t write_ns);
+
+#endif //OPENBHOS_FS_RAM_DISK_H
@@ -0,0 +1,162 @@
+#include "trace.h"
+
+#if CONFIG_FS_TRACE
+
+#include "stdlib.h"
+#define TRACE_INSTANT_DUR 0xFFFFFFFF
+#define TRACE_DUR_MAX (TRACE_INSTANT_DUR-1)
+
+typedef
+struct {
+    const char * name;
+    trace_ts_t start;
+    unsigned long long arg;
+    uint32_t dur;       // ns,TRACE_INSTANT_DUR for instant record.
+    uint32_t tid;
+} trace_rec_t;
+
+/*!
+ * @note ring of one thread,only the owner writes it.
+ *       the ring is given to another thread after owner exits,
+ *       so every record keeps the tid of writer.
+ */
+typedef
+struct trace_ring_s {
+    struct trace_ring_s * next;
+    bool owned;
+    unsigned long long head;    // count of records ever written.
+    trace_rec_t recs[CONFIG_FS_TRACE_RING_CNT];
+} trace_ring_t;
+
+static trace_ring_t * trace_rings;      // list of all rings,only grows.
+static uint32_t trace_tid_next;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread trace_ring_t * trace_ring_self;
+static __thread uint32_t trace_tid_self;
+
+static void _trace_thread_exit(void * ring){
+    __atomic_store_n(&((trace_ring_t *)ring)->owned,false,__ATOMIC_RELEASE);
+}
+
+static void _trace_key_init(){
+    pthread_key_create(&trace_key,_trace_thread_exit);
+}
+
+/*!
+ * @note get the ring of current thread,reuse a ring
+ *       released by an exited thread when possible.
+ * @return NULL when out of memory.
+ */
+static trace_ring_t * _trace_ring_get(){
+    if(trace_ring_self!=NULL){
+        return trace_ring_self;
+    }
+    pthread_once(&trace_once,_trace_key_init);
+    trace_ring_t * ring = NULL;
+    for(trace_ring_t * probe = __atomic_load_n(&trace_rings,__ATOMIC_ACQUIRE);probe!=NULL;probe = probe->next){
+        bool expected = false;
+        if(__atomic_compare_exchange_n(&probe->owned,&expected,true,false,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED)){
+            ring = probe;
+            break;
+        }
+    }
+    if(ring == NULL){
+        ring = calloc(1,sizeof(trace_ring_t));
+        if(ring == NULL){
+            return NULL;
+        }
+        ring->owned = true;
+        ring->next = __atomic_load_n(&trace_rings,__ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&trace_rings,&ring->next,ring,false,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    }
+    trace_tid_self = __atomic_add_fetch(&trace_tid_next,1,__ATOMIC_RELAXED);
+    trace_ring_self = ring;
+    pthread_setspecific(trace_key,ring);
+    return ring;
+}
+
+static inline void _trace_push(const char * name, trace_ts_t start, uint32_t dur, unsigned long long arg){
+    trace_ring_t * ring = _trace_ring_get();
+    if(ring == NULL){
+        return;
+    }
+    unsigned long long head = ring->head;
+    trace_rec_t * rec = &ring->recs[head%CONFIG_FS_TRACE_RING_CNT];
+    rec->name = name;
+    rec->start = start;
+    rec->arg = arg;
+    rec->dur = dur;
+    rec->tid = trace_tid_self;
+    // the record is visible to exporter after head moves.
+    __atomic_store_n(&ring->head,head+1,__ATOMIC_RELEASE);
+}
+
+void trace_record(const char * name, trace_ts_t start, unsigned long long arg){
+    trace_ts_t dur = trace_now()-start;
+    _trace_push(name,start,dur>TRACE_DUR_MAX?TRACE_DUR_MAX:(uint32_t)dur,arg);
+}
+
+void trace_instant(const char * name, unsigned long long arg){
+    _trace_push(name,trace_now(),TRACE_INSTANT_DUR,arg);
+}
+
+/*!
+ * @note write the records of all rings as Chrome trace event
+ *       JSON,which can be opened by chrome://tracing or Perfetto.
+ *       the oldest records of a ring are overwritten when it is full.
+ * @warning the records written while exporting may be torn,
+ *          export when the traced threads are idle.
+ * @param path
+ * @return false when fail to write file.
+ */
+bool trace_export(const char * path){
+    FILE * file = fopen(path,"w");
+    if(file == NULL){
+        return false;
+    }
+    fprintf(file,"{\"traceEvents\":[\n");
+    bool first = true;
+    for(trace_ring_t * ring = __atomic_load_n(&trace_rings,__ATOMIC_ACQUIRE);ring!=NULL;ring = ring->next){
+        unsigned long long head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+        unsigned long long i = head>CONFIG_FS_TRACE_RING_CNT?head-CONFIG_FS_TRACE_RING_CNT:0;
+        for(;i<head;i++){
+            trace_rec_t * rec = &ring->recs[i%CONFIG_FS_TRACE_RING_CNT];
+            fprintf(file,"%s{\"name\":\"%s\",\"cat\":\"fs\",\"pid\":1,\"tid\":%u,\"ts\":%llu.%03llu,",
+                    first?"":",\n",rec->name,rec->tid,rec->start/1000,rec->start%1000);
+            if(rec->dur == TRACE_INSTANT_DUR){
+                fprintf(file,"\"ph\":\"i\",\"s\":\"t\",");
+            }
+            else{
+                fprintf(file,"\"ph\":\"X\",\"dur\":%u.%03u,",rec->dur/1000,rec->dur%1000);
+            }
+            fprintf(file,"\"args\":{\"arg\":%llu}}",rec->arg);
+            first = false;
+        }
+    }
+    fprintf(file,"\n]}\n");
+    return fclose(file) == 0;
+}
+
+/*!
+ * @note drop all records.
+ * @warning the traced threads must be idle.
+ */
+void trace_reset(){
+    for(trace_ring_t * ring = __atomic_load_n(&trace_rings,__ATOMIC_ACQUIRE);ring!=NULL;ring = ring->next){
+        __atomic_store_n(&ring->head,0,__ATOMIC_RELEASE);
+    }
+}
+
+#else
+
+bool trace_export(const char * path){
+    (void)path;
+    return false;
+}
+
+void trace_reset(){
+
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef OPENBHOS_FS_TRACE_H
+#define OPENBHOS_FS_TRACE_H
+
+#include "fs_common.h"
+
+/*!
+ * @note tracepoints record the time of operations into the ring of
+ *       current thread. they are removed totally when CONFIG_FS_TRACE
+ *       is 0,the arguments are not evaluated then.
+ *       FS_TRACE_BEGIN(var) : declare var and save start time in it.
+ *       FS_TRACE_END(var,name,arg) : record a span from var to now.
+ *       FS_TRACE_INSTANT(name,arg) : record a point of time.
+ *       name must be a string literal,arg is an integer.
+ */
+#if CONFIG_FS_TRACE
+
+#include "time.h"
+
+typedef unsigned long long trace_ts_t;
+
+static inline trace_ts_t trace_now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return (trace_ts_t)t.tv_sec*1000000000ULL+t.tv_nsec;
+}
+
+void trace_record(const char * name, trace_ts_t start, unsigned long long arg);
+void trace_instant(const char * name, unsigned long long arg);
+
+#define FS_TRACE_BEGIN(var) trace_ts_t const var = trace_now()
+#define FS_TRACE_END(var,name,arg) trace_record(name,var,(unsigned long long)(arg))
+#define FS_TRACE_INSTANT(name,arg) trace_instant(name,(unsigned long long)(arg))
+
+#else
+
+#define FS_TRACE_BEGIN(var)
+#define FS_TRACE_END(var,name,arg)
+#define FS_TRACE_INSTANT(name,arg)
+
+#endif
+
+bool trace_export(const char * path);
+void trace_reset();
+
+#endif //OPENBHOS_FS_TRACE_H
@@ -4,34 +4,324 @@
 
 #include "virtul_disk.h"
 #include "stdio.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/mman.h"
 #include "fs_common.h"
+#include "aio.h"
 #define SELECTOR_SIZE 512
-FILE * disk = NULL;
-uint32_t max_selector_no;
-inline uint32_t disk_get_max_selector_no(){
-    return  max_selector_no;
+
+typedef
+struct {
+    const disk_ops_t * ops;     // NULL when the slot is free.
+    void * priv;
+    uint32_t select_size;
+    uint32_t max_selector_no;
+    // the backend completes requests of all threads,they are given
+    // back to their submitters here.
+    pthread_mutex_t io_lock;
+    pthread_cond_t io_cond;
+    fs_io_req_t * pending;      // submitted and not returned to owner.
+    bool reaping;               // a thread is waiting in backend`s reap.
+} disk_dev_t;
+
+/*!
+ * @note data of the image file backend.
+ */
+typedef
+struct {
+    int fd;
+    aio_engine_t * aio;
+    byte * mapping;     // read only mapping of image when opened with DISK_OPEN_MMAP.
+    size_t map_size;
+} disk_file_t;
+
+static disk_dev_t disk_devs[CONFIG_FS_DEV_CNT];
+static disk_file_t disk_files[CONFIG_FS_DEV_CNT];
+
+static inline disk_dev_t * _disk_dev(int dev_no){
+    assert(dev_no>=0&&dev_no<CONFIG_FS_DEV_CNT&&disk_devs[dev_no].ops!=NULL,"device is not registered!\n");
+    return &disk_devs[dev_no];
 }
 
-void disk_init(){
-    disk = fopen("../fs/fs.img","rb+");
-    assert(disk!=NULL,"disk can`t access!\n");
-    fseek(disk,0L,SEEK_END);
-    max_selector_no = ftell(disk)/SELECTOR_SIZE;
-    fseek(disk,0L,SEEK_SET);
+/*!
+ * @note add a device to device table.
+ * @param ops : backend operations,must be valid until close.
+ * @param priv : backend`s data passed to ops.
+ * @param select_size : must equal to block size of cache.
+ * @param select_cnt
+ * @return dev_no or DISK_NO_ERROR when table is full.
+ */
+int disk_register(const disk_ops_t * ops, void * priv, uint32_t select_size, uint32_t select_cnt){
+    assert(ops!=NULL&&ops->read!=NULL&&ops->write!=NULL,"device ops is invalid!\n");
+    assert(select_size == CONFIG_FS_BLOCK_SIZE,"Not support:selector size not equaled to block size!\n");
+    for(int dev_no = 0;dev_no<CONFIG_FS_DEV_CNT;dev_no++){
+        if(disk_devs[dev_no].ops == NULL){
+            disk_devs[dev_no].ops = ops;
+            disk_devs[dev_no].priv = priv;
+            disk_devs[dev_no].select_size = select_size;
+            disk_devs[dev_no].max_selector_no = select_cnt;
+            disk_devs[dev_no].pending = NULL;
+            disk_devs[dev_no].reaping = false;
+            pthread_mutex_init(&disk_devs[dev_no].io_lock,NULL);
+            pthread_cond_init(&disk_devs[dev_no].io_cond,NULL);
+            return dev_no;
+        }
+    }
+    return DISK_NO_ERROR;
 }
 
-void disk_close(){
-    fclose(disk);
+/*!
+ * @note remove a device from table and close it`s backend.
+ * @warning the blocks of device must be dropped from cache before.
+ */
+void disk_close(int dev_no){
+    disk_dev_t * dev = _disk_dev(dev_no);
+    if(dev->ops->close!=NULL){
+        dev->ops->close(dev->priv);
+    }
+    pthread_cond_destroy(&dev->io_cond);
+    pthread_mutex_destroy(&dev->io_lock);
+    dev->ops = NULL;
+    dev->priv = NULL;
 }
 
-void read_select(void * buffer , uint32_t select_no){
-    assert(select_no<max_selector_no,"selector number bigger than max!\n");
-    fseek(disk,SELECTOR_SIZE * select_no,SEEK_SET);
-    fread(buffer,SELECTOR_SIZE,1,disk);
+inline uint32_t disk_get_max_selector_no(int dev_no){
+    return _disk_dev(dev_no)->max_selector_no;
 }
 
-void write_select(void * buffer , uint32_t select_no){
-    assert(select_no<max_selector_no,"selector number bigger than max!\n");
-    fseek(disk,SELECTOR_SIZE * select_no,SEEK_SET);
-    fwrite(buffer,SELECTOR_SIZE,1,disk);
-}
\ No newline at end of file
+void disk_sync(int dev_no){
+    disk_dev_t * dev = _disk_dev(dev_no);
+    if(dev->ops->sync!=NULL){
+        dev->ops->sync(dev->priv);
+    }
+}
+
+/*!
+ * @return address of selector in device`s mapping,NULL if device isn`t mapped.
+ */
+byte * disk_map(int dev_no, uint32_t select_no){
+    disk_dev_t * dev = _disk_dev(dev_no);
+    if(dev->ops->map == NULL){
+        return NULL;
+    }
+    assert(select_no<dev->max_selector_no,"selector number bigger than max!\n");
+    return dev->ops->map(dev->priv,select_no);
+}
+
+void read_select(int dev_no, void * buffer , uint32_t select_no){
+    disk_dev_t * dev = _disk_dev(dev_no);
+    assert(select_no<dev->max_selector_no,"selector number bigger than max!\n");
+    dev->ops->read(dev->priv,buffer,select_no);
+}
+
+void write_select(int dev_no, void * buffer , uint32_t select_no){
+    disk_dev_t * dev = _disk_dev(dev_no);
+    assert(select_no<dev->max_selector_no,"selector number bigger than max!\n");
+    dev->ops->write(dev->priv,buffer,select_no);
+}
+
+/*!
+ * @note queue requests,they are completed in any order and
+ *       only reaped with same owner.
+ *       the requests and buffers must be valid until reaped.
+ * @param owner : any address unique to the caller while it has
+ *                requests in flight,e.g. the array of requests.
+ *                a thread can have some owners at same time.
+ * @return count of requests queued,0 when device has no async I/O.
+ */
+uint32_t disk_submit(int dev_no, const void * owner, fs_io_req_t ** reqs, uint32_t cnt){
+    disk_dev_t * dev = _disk_dev(dev_no);
+    if(dev->ops->submit == NULL){
+        return 0;
+    }
+    // the requests are pending before submit,a backend may
+    // complete them before it returns.
+    pthread_mutex_lock(&dev->io_lock);
+    for(uint32_t i = 0;i<cnt;i++){
+        assert(reqs[i]->select_no+reqs[i]->select_cnt<=dev->max_selector_no,"selector number bigger than max!\n");
+        reqs[i]->owner = owner;
+        reqs[i]->complete = false;
+        reqs[i]->next = dev->pending;
+        dev->pending = reqs[i];
+    }
+    pthread_mutex_unlock(&dev->io_lock);
+    uint32_t queued = dev->ops->submit(dev->priv,reqs,cnt);
+    if(queued<cnt){
+        pthread_mutex_lock(&dev->io_lock);
+        for(fs_io_req_t ** link = &dev->pending;*link!=NULL;){
+            bool dropped = false;
+            for(uint32_t i = queued;i<cnt;i++){
+                if(*link == reqs[i]){
+                    dropped = true;
+                    break;
+                }
+            }
+            if(dropped){
+                *link = (*link)->next;
+            }
+            else{
+                link = &(*link)->next;
+            }
+        }
+        pthread_mutex_unlock(&dev->io_lock);
+    }
+    return queued;
+}
+
+/*!
+ * @note get completed requests submitted with the owner.
+ *       one thread waits in backend for all owners,the requests
+ *       of others it gets are left in pending list for them.
+ * @param done : completed requests,req->result is count of bytes or -errno.
+ * @param max : size of done.
+ * @param min : wait until min requests completed,
+ *              or no request of owner in flight.
+ * @return count of completed requests.
+ */
+uint32_t disk_reap(int dev_no, const void * owner, fs_io_req_t ** done, uint32_t max, uint32_t min){
+    disk_dev_t * dev = _disk_dev(dev_no);
+    if(dev->ops->reap == NULL){
+        return 0;
+    }
+    uint32_t got = 0;
+    pthread_mutex_lock(&dev->io_lock);
+    for(;;){
+        bool in_flight = false;
+        for(fs_io_req_t ** link = &dev->pending;*link!=NULL&&got<max;){
+            fs_io_req_t * req = *link;
+            if(req->owner!=owner){
+                link = &req->next;
+            }
+            else if(req->complete){
+                *link = req->next;
+                done[got++] = req;
+            }
+            else{
+                in_flight = true;
+                link = &req->next;
+            }
+        }
+        if(got>=min||got == max||!in_flight){
+            break;
+        }
+        if(dev->reaping){
+            pthread_cond_wait(&dev->io_cond,&dev->io_lock);
+            continue;
+        }
+        dev->reaping = true;
+        pthread_mutex_unlock(&dev->io_lock);
+        fs_io_req_t * reaped[CONFIG_FS_AIO_DEPTH];
+        uint32_t cnt = dev->ops->reap(dev->priv,reaped,CONFIG_FS_AIO_DEPTH,1);
+        pthread_mutex_lock(&dev->io_lock);
+        for(uint32_t i = 0;i<cnt;i++){
+            reaped[i]->complete = true;
+        }
+        dev->reaping = false;
+        pthread_cond_broadcast(&dev->io_cond);
+    }
+    pthread_mutex_unlock(&dev->io_lock);
+    return got;
+}
+
+static void _file_read(void * priv, void * buffer, uint32_t select_no){
+    pread(((disk_file_t *)priv)->fd,buffer,SELECTOR_SIZE,(off_t)SELECTOR_SIZE * select_no);
+}
+
+static void _file_write(void * priv, void * buffer, uint32_t select_no){
+    pwrite(((disk_file_t *)priv)->fd,buffer,SELECTOR_SIZE,(off_t)SELECTOR_SIZE * select_no);
+}
+
+static uint32_t _file_submit(void * priv, fs_io_req_t ** reqs, uint32_t cnt){
+    return aio_submit(((disk_file_t *)priv)->aio,reqs,cnt);
+}
+
+static uint32_t _file_reap(void * priv, fs_io_req_t ** done, uint32_t max, uint32_t min){
+    return aio_reap(((disk_file_t *)priv)->aio,done,max,min);
+}
+
+/*!
+ * @note the mapping is shared with the file,so it sees
+ *       the selectors written by pwrite and aio.
+ */
+static byte * _file_map(void * priv, uint32_t select_no){
+    return ((disk_file_t *)priv)->mapping+(size_t)select_no*SELECTOR_SIZE;
+}
+
+static void _file_sync(void * priv){
+    fsync(((disk_file_t *)priv)->fd);
+}
+
+static void _file_close(void * priv){
+    disk_file_t * file = priv;
+    if(file->mapping!=NULL){
+        munmap(file->mapping,file->map_size);
+        file->mapping = NULL;
+    }
+    aio_engine_destroy(file->aio);
+    file->aio = NULL;
+    close(file->fd);
+    file->fd = -1;
+}
+
+static const disk_ops_t disk_file_ops = {
+        _file_read,
+        _file_write,
+        _file_submit,
+        _file_reap,
+        NULL,
+        _file_sync,
+        _file_close
+};
+
+static const disk_ops_t disk_file_mmap_ops = {
+        _file_read,
+        _file_write,
+        _file_submit,
+        _file_reap,
+        _file_map,
+        _file_sync,
+        _file_close
+};
+
+/*!
+ * @note open an image file as a device.
+ * @param path
+ * @param flags : DISK_OPEN_MMAP to hand out clean blocks
+ *                from a mapping of image.
+ * @return dev_no or DISK_NO_ERROR when fail.
+ */
+int disk_open(const char * path, uint32_t flags){
+    int fd = open(path,O_RDWR);
+    if(fd<0){
+        return DISK_NO_ERROR;
+    }
+    off_t size = lseek(fd,0L,SEEK_END);
+    const disk_ops_t * ops = (flags&DISK_OPEN_MMAP)?&disk_file_mmap_ops:&disk_file_ops;
+    int dev_no = disk_register(ops,NULL,SELECTOR_SIZE,size/SELECTOR_SIZE);
+    if(dev_no == DISK_NO_ERROR){
+        close(fd);
+        return DISK_NO_ERROR;
+    }
+    // the file backend uses the slot with same number.
+    disk_file_t * file = &disk_files[dev_no];
+    disk_devs[dev_no].priv = file;
+    file->fd = fd;
+    file->mapping = NULL;
+    file->map_size = (size_t)(size/SELECTOR_SIZE)*SELECTOR_SIZE;
+    file->aio = aio_engine_create(fd,SELECTOR_SIZE,CONFIG_FS_AIO_DEPTH);
+    if(file->aio == NULL){
+        goto fail;
+    }
+    if(flags&DISK_OPEN_MMAP){
+        void * mapping = mmap(NULL,file->map_size,PROT_READ,MAP_SHARED,fd,0);
+        if(mapping == MAP_FAILED){
+            goto fail;
+        }
+        file->mapping = mapping;
+    }
+    return dev_no;
+    fail:
+    disk_close(dev_no);
+    return DISK_NO_ERROR;
+}
@@ -6,9 +6,34 @@
 #define OPENBHOS_FS_VIRTUL_DISK_H
 #include "fs_common.h"
 
-void disk_init();
-void disk_close();
-void read_select(void * buffer , uint32_t select_no);
-void write_select(void * buffer , uint32_t select_no);
+#define DISK_NO_ERROR (-1)
+#define DISK_OPEN_MMAP 0x1      // map the image for read-mostly mounts.
 
-#endif //OPENBHOS_FS_VIRTUL_DISK_H
\ No newline at end of file
+/*!
+ * @note operations of a device backend,priv is the backend`s data
+ *       given when register.
+ *       submit,reap and map can be NULL when not supported.
+ */
+typedef
+struct {
+    void (*read)(void * priv, void * buffer, uint32_t select_no);
+    void (*write)(void * priv, void * buffer, uint32_t select_no);
+    uint32_t (*submit)(void * priv, fs_io_req_t ** reqs, uint32_t cnt);
+    uint32_t (*reap)(void * priv, fs_io_req_t ** done, uint32_t max, uint32_t min);
+    byte * (*map)(void * priv, uint32_t select_no);
+    void (*sync)(void * priv);
+    void (*close)(void * priv);
+} disk_ops_t;
+
+int disk_register(const disk_ops_t * ops, void * priv, uint32_t select_size, uint32_t select_cnt);
+int disk_open(const char * path, uint32_t flags);
+void disk_close(int dev_no);
+uint32_t disk_get_max_selector_no(int dev_no);
+void disk_sync(int dev_no);
+byte * disk_map(int dev_no, uint32_t select_no);
+void read_select(int dev_no, void * buffer , uint32_t select_no);
+void write_select(int dev_no, void * buffer , uint32_t select_no);
+uint32_t disk_submit(int dev_no, const void * owner, fs_io_req_t ** reqs, uint32_t cnt);
+uint32_t disk_reap(int dev_no, const void * owner, fs_io_req_t ** done, uint32_t max, uint32_t min);
+
+#endif //OPENBHOS_FS_VIRTUL_DISK_H
@@ -2,14 +2,21 @@
 #include "fs/virtul_disk.h"
 #include "fs/fs.h"
 #include "fs/fat32.h"
+#include "elf64/elf64.h"
 #include "string.h"
 
 int main() {
     unsigned char buffer[512];
-    block_module_init(0);
+    block_module_init();
     fat32_module_init();
-    fat32_test();
-    disk_close();
+    elf64_module_init();
+    fs_t * fs = fat32_mount("../fs/fs.img",0);
+    if(fs == NULL){
+        printf("disk can`t mount!\n");
+        return 1;
+    }
+    fat32_test(fs);
+    fat32_umount(fs);
     while (1);
     return 0;
 }
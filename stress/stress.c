@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../fs/fat32.h"
+#include "../fs/block.h"
+#include "../fs/virtul_disk.h"
+#include "../fs/ram_disk.h"
+#include "../fs/mkfs.h"
+
+#define STRESS_MAX_THREADS 64
+#define STRESS_RAM_SECTORS (512*1024)       // 256MB
+#define STRESS_PRIVATE_FILES 16             // max files of a thread at same time.
+#define STRESS_FILE_MAX 8192
+#define STRESS_SLOT_SIZE 16
+
+#define STRESS_TOTAL_OFFSET (STRESS_MAX_THREADS*STRESS_SLOT_SIZE)   // the counter of all threads in shared file.
+
+// the workers call into FS without any lock of their own,so the entry
+// and block locks are all which keep FS consistent. the ops take the
+// locks in the orders used by FS users: parent then sub for create and
+// remove,a read walk through the dirs of other threads while they are
+// written,and a read-modify-write of one counter by all threads,which
+// loses updates when a write lock of entry doesn`t exclude others.
+
+typedef
+struct {
+    uint32_t name;      // number in file name.
+    uint32_t seed;      // seed of content.
+    uint32_t size;
+    bool used;
+} stress_file_t;
+
+typedef
+struct {
+    pthread_t thread;
+    uint32_t id;
+    unsigned long long rand_state;
+    uint32_t next_name;
+    stress_file_t files[STRESS_PRIVATE_FILES];
+    uint32_t shared_cnt;        // the counter written to shared slot.
+    uint32_t shared_names[STRESS_PRIVATE_FILES];
+    uint32_t shared_name_cnt;
+    uint32_t total_cnt;         // the increments of total counter.
+    unsigned long long ops;     // updated atomically,read by watchdog.
+    uint32_t errors;
+    byte buffer[STRESS_FILE_MAX];
+} stress_worker_t;
+
+static struct {
+    fs_t * fs;
+    int dev_no;
+    bool stop;          // set and read atomically.
+    uint32_t thread_cnt;
+    double seconds;
+    uint32_t stall_seconds;
+    double base_ops_per_sec;    // of 1 thread,the base of scaling.
+    stress_worker_t workers[STRESS_MAX_THREADS];
+} stress;
+
+static inline double _now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec+t.tv_nsec/1e9;
+}
+
+static inline uint32_t _rand(stress_worker_t * worker){
+    worker->rand_state ^= worker->rand_state<<13;
+    worker->rand_state ^= worker->rand_state>>7;
+    worker->rand_state ^= worker->rand_state<<17;
+    return (uint32_t)(worker->rand_state>>16);
+}
+
+static inline byte _pattern(uint32_t seed, uint32_t i){
+    return (byte)((seed+i*31)^(seed>>8));
+}
+
+static void _fill(byte * buffer, uint32_t seed, uint32_t size){
+    for(uint32_t i = 0;i<size;i++){
+        buffer[i] = _pattern(seed,i);
+    }
+}
+
+static bool _check(const byte * buffer, uint32_t seed, uint32_t size){
+    for(uint32_t i = 0;i<size;i++){
+        if(buffer[i]!=_pattern(seed,i)){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _error(stress_worker_t * worker, const char * what, const char * path){
+    worker->errors++;
+    fprintf(stderr,"thread %u: %s %s\n",worker->id,what,path);
+}
+
+static inline void _private_path(char * path, uint32_t id, uint32_t name){
+    sprintf(path,"/T%02u/F%05u.TXT",id,name);
+}
+
+/*!
+ * @note create a private file and write it.
+ */
+static void _op_create(stress_worker_t * worker, stress_file_t * file){
+    char path[32];
+    char name[16];
+    file->name = __atomic_fetch_add(&worker->next_name,1,__ATOMIC_RELAXED);
+    file->seed = _rand(worker);
+    file->size = _rand(worker)%STRESS_FILE_MAX+1;
+    _fill(worker->buffer,file->seed,file->size);
+    sprintf(name,"F%05u.TXT",file->name);
+    sprintf(path,"/T%02u",worker->id);
+    entry_t * dir = parse_path_write(stress.fs,path);
+    entry_t * entry = dir == NULL?NULL:entry_create_write(dir,name,ENTRY_ATTR_ARCHIVE);
+    if(entry!=NULL){
+        entry_rw(entry,worker->buffer,0,file->size,true);
+        entry_put_write(entry);
+        file->used = true;
+    }
+    if(dir!=NULL){
+        entry_put_write(dir);
+    }
+    if(entry == NULL){
+        _error(worker,"fail to create",name);
+    }
+}
+
+static void _op_read(stress_worker_t * worker, stress_file_t * file){
+    char path[32];
+    _private_path(path,worker->id,file->name);
+    entry_t * entry = parse_path_read(stress.fs,path);
+    uint32_t size = 0;
+    if(entry!=NULL){
+        size = entry->file_size;
+        if(size == file->size){
+            entry_rw(entry,worker->buffer,0,size,false);
+        }
+        entry_put_read(entry);
+    }
+    if(entry == NULL){
+        _error(worker,"lost file",path);
+    }
+    else if(size!=file->size||!_check(worker->buffer,file->seed,size)){
+        _error(worker,"wrong content of",path);
+    }
+}
+
+/*!
+ * @note replace content of a private file.
+ */
+static void _op_write(stress_worker_t * worker, stress_file_t * file){
+    char path[32];
+    _private_path(path,worker->id,file->name);
+    uint32_t seed = _rand(worker);
+    uint32_t size = _rand(worker)%STRESS_FILE_MAX+1;
+    _fill(worker->buffer,seed,size);
+    entry_t * entry = parse_path_write(stress.fs,path);
+    if(entry!=NULL){
+        entry_truncate(entry,0);
+        entry_rw(entry,worker->buffer,0,size,true);
+        entry_put_write(entry);
+    }
+    if(entry == NULL){
+        _error(worker,"lost file",path);
+        return;
+    }
+    file->seed = seed;
+    file->size = size;
+}
+
+/*!
+ * @note the remove is refused when other thread is peeking the file,
+ *       then the file must be still there and is removed later.
+ */
+static void _op_remove(stress_worker_t * worker, stress_file_t * file){
+    char path[32];
+    char name[16];
+    sprintf(path,"/T%02u",worker->id);
+    sprintf(name,"F%05u.TXT",file->name);
+    entry_t * dir = parse_path_write(stress.fs,path);
+    bool removed = dir!=NULL&&entry_rm_sub(dir,name);
+    if(dir!=NULL){
+        entry_put_write(dir);
+    }
+    if(!removed){
+        _private_path(path,worker->id,file->name);
+        entry_t * entry = parse_path_read(stress.fs,path);
+        if(entry == NULL){
+            _error(worker,"fail to remove",name);
+            file->used = false;
+        }
+        else{
+            entry_put_read(entry);
+        }
+        return;
+    }
+    file->used = false;
+}
+
+/*!
+ * @note write the counter of thread to it`s slot in shared file,
+ *       the slots of other threads must not be changed.
+ */
+static void _op_shared_write(stress_worker_t * worker){
+    uint32_t slot[STRESS_SLOT_SIZE/sizeof(uint32_t)] = {worker->id,++worker->shared_cnt,~worker->id,0};
+    entry_t * entry = parse_path_write(stress.fs,"/SHARED/CNT.DAT");
+    if(entry!=NULL){
+        entry_rw(entry,slot,worker->id*STRESS_SLOT_SIZE,STRESS_SLOT_SIZE,true);
+        entry_put_write(entry);
+    }
+    if(entry == NULL){
+        _error(worker,"lost file","/SHARED/CNT.DAT");
+    }
+}
+
+/*!
+ * @note increase the counter of all threads,the increments are lost
+ *       if two threads hold the write lock of file at same time.
+ */
+static void _op_shared_add(stress_worker_t * worker){
+    uint32_t total = 0;
+    entry_t * entry = parse_path_write(stress.fs,"/SHARED/CNT.DAT");
+    if(entry!=NULL){
+        entry_rw(entry,&total,STRESS_TOTAL_OFFSET,sizeof(total),false);
+        total++;
+        entry_rw(entry,&total,STRESS_TOTAL_OFFSET,sizeof(total),true);
+        entry_put_write(entry);
+    }
+    if(entry == NULL){
+        _error(worker,"lost file","/SHARED/CNT.DAT");
+        return;
+    }
+    worker->total_cnt++;
+}
+
+/*!
+ * @note read a file of other thread while it may be written,removed
+ *       or it`s dir is locked to create and remove,
+ *       the file may be missing or be partly written.
+ */
+static void _op_peek(stress_worker_t * worker, uint32_t thread_cnt){
+    char path[32];
+    uint32_t id = _rand(worker)%thread_cnt;
+    uint32_t name_cnt = __atomic_load_n(&stress.workers[id].next_name,__ATOMIC_RELAXED);
+    if(name_cnt == 0){
+        return;
+    }
+    _private_path(path,id,_rand(worker)%name_cnt);
+    entry_t * entry = parse_path_read(stress.fs,path);
+    if(entry!=NULL){
+        uint32_t size = entry->file_size;
+        if(size>STRESS_FILE_MAX){
+            _error(worker,"wrong size of",path);
+        }
+        else{
+            entry_rw(entry,worker->buffer,0,size,false);
+        }
+        entry_put_read(entry);
+    }
+}
+
+/*!
+ * @note create or remove a file in shared dir.
+ */
+static void _op_shared_dir(stress_worker_t * worker){
+    char name[16];
+    bool create = worker->shared_name_cnt == 0||
+                  (worker->shared_name_cnt<STRESS_PRIVATE_FILES&&_rand(worker)%2 == 0);
+    uint32_t number;
+    if(create){
+        number = __atomic_fetch_add(&worker->next_name,1,__ATOMIC_RELAXED);
+    }
+    else{
+        number = worker->shared_names[--worker->shared_name_cnt];
+    }
+    sprintf(name,"X%02u%05u.TXT",worker->id,number%100000);
+    bool ok = false;
+    entry_t * dir = parse_path_write(stress.fs,"/SHARED");
+    if(dir!=NULL){
+        if(create){
+            entry_t * entry = entry_create_write(dir,name,ENTRY_ATTR_ARCHIVE);
+            if(entry!=NULL){
+                entry_put_write(entry);
+                ok = true;
+            }
+        }
+        else{
+            ok = entry_rm_sub(dir,name);
+        }
+        entry_put_write(dir);
+    }
+    if(!ok){
+        _error(worker,create?"fail to create":"fail to remove",name);
+    }
+    else if(create){
+        worker->shared_names[worker->shared_name_cnt++] = number;
+    }
+}
+
+static void * _worker_main(void * arg){
+    stress_worker_t * worker = arg;
+    uint32_t thread_cnt = stress.thread_cnt;
+    while(!__atomic_load_n(&stress.stop,__ATOMIC_RELAXED)){
+        uint32_t choice = _rand(worker)%100;
+        stress_file_t * file = &worker->files[_rand(worker)%STRESS_PRIVATE_FILES];
+        if(choice<10){
+            _op_shared_write(worker);
+        }
+        else if(choice<15){
+            _op_shared_add(worker);
+        }
+        else if(choice<25){
+            _op_shared_dir(worker);
+        }
+        else if(choice<35){
+            _op_peek(worker,thread_cnt);
+        }
+        else if(!file->used){
+            _op_create(worker,file);
+        }
+        else if(choice<65){
+            _op_read(worker,file);
+        }
+        else if(choice<85){
+            _op_write(worker,file);
+        }
+        else{
+            _op_remove(worker,file);
+        }
+        __atomic_add_fetch(&worker->ops,1,__ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*!
+ * @note check all files and slots after remount.
+ * @return count of errors.
+ */
+static uint32_t _verify(uint32_t thread_cnt){
+    uint32_t errors = 0;
+    uint32_t slot[STRESS_SLOT_SIZE/sizeof(uint32_t)];
+    uint32_t total = 0;
+    uint32_t expected_total = 0;
+    entry_t * shared = parse_path_read(stress.fs,"/SHARED/CNT.DAT");
+    entry_rw(shared,&total,STRESS_TOTAL_OFFSET,sizeof(total),false);
+    for(uint32_t t = 0;t<thread_cnt;t++){
+        stress_worker_t * worker = &stress.workers[t];
+        expected_total+=worker->total_cnt;
+        entry_rw(shared,slot,t*STRESS_SLOT_SIZE,STRESS_SLOT_SIZE,false);
+        if(worker->shared_cnt>0&&(slot[0]!=t||slot[1]!=worker->shared_cnt||slot[2]!=~t)){
+            fprintf(stderr,"thread %u: lost update of shared slot,%u is expected but %u\n",t,worker->shared_cnt,slot[1]);
+            errors++;
+        }
+        for(uint32_t i = 0;i<STRESS_PRIVATE_FILES;i++){
+            if(worker->files[i].used){
+                uint32_t errors_before = worker->errors;
+                _op_read(worker,&worker->files[i]);
+                errors+=worker->errors-errors_before;
+            }
+        }
+        for(uint32_t i = 0;i<worker->shared_name_cnt;i++){
+            char path[32];
+            sprintf(path,"/SHARED/X%02u%05u.TXT",t,worker->shared_names[i]%100000);
+            entry_t * entry = parse_path_read(stress.fs,path);
+            if(entry == NULL){
+                fprintf(stderr,"thread %u: lost file %s\n",t,path);
+                errors++;
+            }
+            else{
+                entry_put_read(entry);
+            }
+        }
+        errors+=worker->errors;
+    }
+    if(total!=expected_total){
+        fprintf(stderr,"lost update of total counter,%u is expected but %u\n",expected_total,total);
+        errors++;
+    }
+    entry_put_read(shared);
+    return errors;
+}
+
+/*!
+ * @note format volume and create the dirs of workers.
+ */
+static bool _setup(uint32_t thread_cnt){
+    mkfs_param_t param;
+    memset(&param,0,sizeof(param));
+    if(!fat32_mkfs_dev(stress.dev_no,&param)){
+        return false;
+    }
+    stress.fs = fat32_mount_dev(stress.dev_no);
+    if(stress.fs == NULL){
+        return false;
+    }
+    entry_t * root = stress.fs->root;
+    entry_t * shared = entry_create_write(root,"SHARED.",ENTRY_ATTR_DIR);
+    entry_t * cnt = entry_create_write(shared,"CNT.DAT",ENTRY_ATTR_ARCHIVE);
+    static const byte zero[STRESS_TOTAL_OFFSET+STRESS_SLOT_SIZE];
+    entry_rw(cnt,(void *)zero,0,sizeof(zero),true);
+    entry_put_write(cnt);
+    entry_put_write(shared);
+    for(uint32_t t = 0;t<thread_cnt;t++){
+        char name[16];
+        sprintf(name,"T%02u.",t);
+        entry_t * dir = entry_create_write(root,name,ENTRY_ATTR_DIR);
+        if(dir == NULL){
+            return false;
+        }
+        entry_put_write(dir);
+        stress_worker_t * worker = &stress.workers[t];
+        memset(worker,0,sizeof(stress_worker_t));
+        worker->id = t;
+        worker->rand_state = 0x2021041700000001ULL+t*0x9E3779B97F4A7C15ULL;
+    }
+    return true;
+}
+
+/*!
+ * @return false when the run is stalled or files are wrong.
+ */
+static bool _run(uint32_t thread_cnt){
+    if(!_setup(thread_cnt)){
+        printf("can`t setup volume for %u threads!\n",thread_cnt);
+        return false;
+    }
+    stress.stop = false;
+    stress.thread_cnt = thread_cnt;
+    for(uint32_t t = 0;t<thread_cnt;t++){
+        pthread_create(&stress.workers[t].thread,NULL,_worker_main,&stress.workers[t]);
+    }
+    // watchdog: a deadlock or a panic in FS stops the threads in it,
+    // so every thread is watched even if the others go on.
+    double start = _now();
+    double last_progress[STRESS_MAX_THREADS];
+    unsigned long long last_ops[STRESS_MAX_THREADS];
+    unsigned long long ops = 0;
+    for(uint32_t t = 0;t<thread_cnt;t++){
+        last_progress[t] = start;
+        last_ops[t] = 0;
+    }
+    while(_now()-start<stress.seconds){
+        usleep(50000);
+        double now = _now();
+        uint32_t stalled_cnt = 0;
+        for(uint32_t t = 0;t<thread_cnt;t++){
+            unsigned long long thread_ops = __atomic_load_n(&stress.workers[t].ops,__ATOMIC_RELAXED);
+            if(thread_ops!=last_ops[t]){
+                last_ops[t] = thread_ops;
+                last_progress[t] = now;
+            }
+            else if(now-last_progress[t]>stress.stall_seconds){
+                fprintf(stderr,"thread %u: no progress in %u seconds,after %llu ops\n",t,stress.stall_seconds,thread_ops);
+                stalled_cnt++;
+            }
+        }
+        if(stalled_cnt>0){
+            ops = 0;
+            for(uint32_t t = 0;t<thread_cnt;t++){
+                ops+=last_ops[t];
+            }
+            printf("{\"threads\": %u, \"stalled\": %u, \"ops\": %llu}\n",thread_cnt,stalled_cnt,ops);
+            fflush(stdout);
+            return false;
+        }
+    }
+    __atomic_store_n(&stress.stop,true,__ATOMIC_RELAXED);
+    for(uint32_t t = 0;t<thread_cnt;t++){
+        pthread_join(stress.workers[t].thread,NULL);
+    }
+    double seconds = _now()-start;
+    ops = 0;
+    for(uint32_t t = 0;t<thread_cnt;t++){
+        ops+=stress.workers[t].ops;
+    }
+    // the files must survive umount and mount.
+    fat32_umount(stress.fs);
+    stress.fs = fat32_mount_dev(stress.dev_no);
+    uint32_t errors = stress.fs == NULL?1:_verify(thread_cnt);
+    double ops_per_sec = ops/seconds;
+    if(thread_cnt == 1){
+        stress.base_ops_per_sec = ops_per_sec;
+    }
+    printf("{\"threads\": %u, \"ops\": %llu, \"seconds\": %.3f, \"ops_per_sec\": %.1f, \"scaling\": %.2f, \"errors\": %u}\n",
+           thread_cnt,ops,seconds,ops_per_sec,ops_per_sec/stress.base_ops_per_sec,errors);
+    fflush(stdout);
+    if(stress.fs!=NULL){
+        fat32_umount(stress.fs);
+    }
+    return errors == 0;
+}
+
+static void _usage(const char * name){
+    printf("usage: %s [--threads max] [--seconds s] [--stall s]\n",name);
+}
+
+int main(int argc, char ** argv){
+    uint32_t max_threads = STRESS_MAX_THREADS;
+    stress.seconds = 1.0;
+    stress.stall_seconds = 10;
+    for(int i = 1;i<argc;i++){
+        if(i+1<argc&&strcmp(argv[i],"--threads") == 0){
+            max_threads = atoi(argv[++i]);
+        }
+        else if(i+1<argc&&strcmp(argv[i],"--seconds") == 0){
+            stress.seconds = atof(argv[++i]);
+        }
+        else if(i+1<argc&&strcmp(argv[i],"--stall") == 0){
+            stress.stall_seconds = atoi(argv[++i]);
+        }
+        else{
+            _usage(argv[0]);
+            return 1;
+        }
+    }
+    if(max_threads == 0||max_threads>STRESS_MAX_THREADS){
+        max_threads = STRESS_MAX_THREADS;
+    }
+    block_module_init();
+    fat32_module_init();
+    stress.dev_no = ram_disk_create(STRESS_RAM_SECTORS,0);
+    if(stress.dev_no == DISK_NO_ERROR){
+        printf("can`t create ram disk!\n");
+        return 1;
+    }
+    bool ok = true;
+    for(uint32_t thread_cnt = 1;thread_cnt<=max_threads&&ok;thread_cnt*=2){
+        ok = _run(thread_cnt);
+    }
+    if(!ok){
+        // the stalled threads can`t be joined.
+        _exit(2);
+    }
+    disk_close(stress.dev_no);
+    return 0;
+}
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../fs/fat32.h"
+#include "../fs/block.h"
+#include "../fs/virtul_disk.h"
+#include "../fs/ram_disk.h"
+#include "../fs/mkfs.h"
+#include "../fs/fsck.h"
+#include "../elf64/elf64.h"
+
+#define TEST_IMAGE "openBHOS_fs_test.img"
+#define TEST_FILE_SIZE (64*1024)
+
+// the cases are run by name from ctest,one process each,
+// so a case which hangs or panics doesn`t hide the others.
+
+#define TEST_CHECK(cond) do{ \
+    if(!(cond)){ \
+        printf("%s:%d: check fail: %s\n",__FILE__,__LINE__,#cond); \
+        return false; \
+    } \
+}while(0)
+
+typedef
+struct {
+    const char * name;
+    bool (*run)();
+} test_case_t;
+
+static void _fill(byte * buffer, uint32_t length, uint32_t seed){
+    for(uint32_t i = 0;i<length;i++){
+        buffer[i] = (byte)(i*31+seed);
+    }
+}
+
+/*!
+ * @note write a file to a new volume,and read it back after remount.
+ */
+static bool _test_volume_rw(const char * path){
+    byte * data = malloc(TEST_FILE_SIZE);
+    byte * back = malloc(TEST_FILE_SIZE);
+    TEST_CHECK(data!=NULL&&back!=NULL);
+    _fill(data,TEST_FILE_SIZE,7);
+    fs_t * fs = fat32_mount(path,0);
+    TEST_CHECK(fs!=NULL);
+    entry_t * file = entry_create_write(fs->root,"DATA.BIN",ENTRY_ATTR_ARCHIVE);
+    TEST_CHECK(file!=NULL);
+    entry_rw(file,data,0,TEST_FILE_SIZE,true);
+    entry_put_write(file);
+    fat32_umount(fs);
+    fs = fat32_mount(path,0);
+    TEST_CHECK(fs!=NULL);
+    file = parse_path_read(fs,"/DATA.BIN");
+    TEST_CHECK(file!=NULL&&file->file_size == TEST_FILE_SIZE);
+    entry_rw(file,back,0,TEST_FILE_SIZE,false);
+    entry_put_read(file);
+    fat32_umount(fs);
+    TEST_CHECK(memcmp(data,back,TEST_FILE_SIZE) == 0);
+    free(data);
+    free(back);
+    return true;
+}
+
+/*!
+ * @note every geometry mkfs accepts must be mounted.
+ *       the volume of each geometry is a bit bigger than
+ *       the least FAT32,so the size doesn`t reject it.
+ */
+static bool _test_mkfs_geometry(){
+    static const uint16_t byts_per_secs[] = {512,1024,2048,4096};
+    static const uint8_t fat_cnts[] = {1,2};
+    static const uint16_t rsvd_sec_cnts[] = {8,32};
+    uint32_t accepted = 0;
+    for(uint32_t i = 0;i<sizeof(byts_per_secs)/sizeof(byts_per_secs[0]);i++){
+        for(uint32_t spc = 1;spc<=128;spc<<=1){
+            for(uint32_t j = 0;j<sizeof(fat_cnts)/sizeof(fat_cnts[0]);j++){
+                for(uint32_t k = 0;k<sizeof(rsvd_sec_cnts)/sizeof(rsvd_sec_cnts[0]);k++){
+                    mkfs_param_t param;
+                    memset(&param,0,sizeof(param));
+                    // the sectors of metadata fit in 2048 sectors.
+                    param.size = ((size_t)(MKFS_FAT32_MIN_CLUS+1024)*spc+2048)*byts_per_secs[i];
+                    param.byts_per_sec = byts_per_secs[i];
+                    param.sec_per_clus = spc;
+                    param.fat_cnt = fat_cnts[j];
+                    param.rsvd_sec_cnt = rsvd_sec_cnts[k];
+                    if(!fat32_mkfs(TEST_IMAGE,&param)){
+                        continue;
+                    }
+                    printf("mkfs -s %u -c %u -f %u -r %u\n",param.byts_per_sec,param.sec_per_clus,param.fat_cnt,param.rsvd_sec_cnt);
+                    accepted++;
+                    TEST_CHECK(_test_volume_rw(TEST_IMAGE));
+                }
+            }
+        }
+    }
+    TEST_CHECK(accepted>0);
+    return true;
+}
+
+/*!
+ * @note a volume of 4096 bytes sector is refused by mount.
+ *       mkfs only makes sectors of block size,so the boot sector
+ *       of a new volume is changed to 4096 bytes sector with same
+ *       bytes of reserved region,FAT and volume.
+ */
+static bool _test_mount_sector_4096(){
+    mkfs_param_t param;
+    memset(&param,0,sizeof(param));
+    param.size = 64*1024*1024;
+    TEST_CHECK(fat32_mkfs(TEST_IMAGE,&param));
+    int fd = open(TEST_IMAGE,O_RDWR);
+    TEST_CHECK(fd>=0);
+    byte boot[CONFIG_FS_BLOCK_SIZE];
+    TEST_CHECK(pread(fd,boot,sizeof(boot),0) == sizeof(boot));
+    uint32_t const scale = 4096/CONFIG_FS_BLOCK_SIZE;
+    *(uint16_t *)(boot+0x0B) = 4096;
+    *(uint16_t *)(boot+0x0E) /= scale;      // reserved sectors
+    *(uint32_t *)(boot+0x20) /= scale;      // total sectors
+    *(uint32_t *)(boot+0x24) /= scale;      // sectors of a FAT
+    TEST_CHECK(pwrite(fd,boot,sizeof(boot),0) == sizeof(boot));
+    close(fd);
+    TEST_CHECK(fat32_mount(TEST_IMAGE,0) == NULL);
+    // the refused volume leaves nothing in cache.
+    TEST_CHECK(fat32_mkfs(TEST_IMAGE,&param));
+    TEST_CHECK(_test_volume_rw(TEST_IMAGE));
+    return true;
+}
+
+/*!
+ * @note the clusters reserved by fallocate after the size
+ *       are not a problem,and repair keeps them.
+ */
+static bool _test_fsck_fallocate(){
+    mkfs_param_t param;
+    memset(&param,0,sizeof(param));
+    param.size = 64*1024*1024;
+    TEST_CHECK(fat32_mkfs(TEST_IMAGE,&param));
+    byte data[1000];
+    _fill(data,sizeof(data),3);
+    fs_t * fs = fat32_mount(TEST_IMAGE,0);
+    TEST_CHECK(fs!=NULL);
+    entry_t * file = entry_create_write(fs->root,"PRE.BIN",ENTRY_ATTR_ARCHIVE);
+    TEST_CHECK(file!=NULL);
+    entry_rw(file,data,0,sizeof(data),true);
+    entry_fallocate(file,TEST_FILE_SIZE);
+    entry_put_write(file);
+    file = entry_create_write(fs->root,"EMPTY.BIN",ENTRY_ATTR_ARCHIVE);
+    TEST_CHECK(file!=NULL);
+    entry_fallocate(file,TEST_FILE_SIZE);
+    entry_put_write(file);
+    fat32_umount(fs);
+    uint32_t const flags[] = {0,FSCK_REPAIR,0};
+    for(uint32_t i = 0;i<sizeof(flags)/sizeof(flags[0]);i++){
+        fsck_report_t report;
+        TEST_CHECK(fat32_fsck(TEST_IMAGE,flags[i],2,NULL,NULL,&report));
+        TEST_CHECK(report.file_cnt == 2);
+        TEST_CHECK(report.size_cnt == 0&&report.leak_clus_cnt == 0&&report.fixed_cnt == 0);
+        TEST_CHECK(report.cross_cnt == 0&&report.broken_cnt == 0);
+        // root dir and the clusters reserved for both files.
+        TEST_CHECK(report.used_clus_cnt == report.reach_clus_cnt);
+        TEST_CHECK(report.reach_clus_cnt>=1+2*TEST_FILE_SIZE/CONFIG_FS_BLOCK_SIZE);
+    }
+    byte back[sizeof(data)];
+    fs = fat32_mount(TEST_IMAGE,0);
+    TEST_CHECK(fs!=NULL);
+    file = parse_path_read(fs,"/PRE.BIN");
+    TEST_CHECK(file!=NULL&&file->file_size == sizeof(data));
+    entry_rw(file,back,0,sizeof(back),false);
+    entry_put_read(file);
+    fat32_umount(fs);
+    TEST_CHECK(memcmp(data,back,sizeof(data)) == 0);
+    return true;
+}
+
+/*!
+ * @note the appends to two files take turns,
+ *       so both of them are fragmented.
+ */
+static bool _test_write_fragmented(fs_t * fs, const char * path_a, const char * path_b){
+    byte data[CONFIG_FS_BLOCK_SIZE];
+    for(uint32_t i = 0;i<16;i++){
+        const char * path = i%2?path_b:path_a;
+        entry_t * file = parse_path_write(fs,path);
+        TEST_CHECK(file!=NULL);
+        _fill(data,sizeof(data),i);
+        entry_rw(file,data,file->file_size,sizeof(data),true);
+        entry_put_write(file);
+    }
+    return true;
+}
+
+/*!
+ * @note a file held by others is skipped by defrag instead of waited,
+ *       and a file not fragmented is not made dirty.
+ */
+static bool _test_defrag_busy(){
+    mkfs_param_t param;
+    memset(&param,0,sizeof(param));
+    param.size = 64*1024*1024;
+    TEST_CHECK(fat32_mkfs(TEST_IMAGE,&param));
+    fs_t * fs = fat32_mount(TEST_IMAGE,0);
+    TEST_CHECK(fs!=NULL);
+    const char * const names[] = {"A.BIN","B.BIN","C.BIN"};
+    for(uint32_t i = 0;i<sizeof(names)/sizeof(names[0]);i++){
+        entry_t * file = entry_create_write(fs->root,(char *)names[i],ENTRY_ATTR_ARCHIVE);
+        TEST_CHECK(file!=NULL);
+        entry_put_write(file);
+    }
+    TEST_CHECK(_test_write_fragmented(fs,"/A.BIN","/B.BIN"));
+    byte data[CONFIG_FS_BLOCK_SIZE*4];
+    _fill(data,sizeof(data),9);
+    entry_t * file = parse_path_write(fs,"/C.BIN");
+    TEST_CHECK(file!=NULL);
+    entry_rw(file,data,0,sizeof(data),true);
+    entry_put_write(file);
+    entry_flush_all();
+    // A is held like an opened ELF file,in same thread,so a wait never ends.
+    entry_t * held = parse_path_read(fs,"/A.BIN");
+    TEST_CHECK(held!=NULL&&entry_extent_cnt(held)>1);
+    defrag_t defrag;
+    memset(&defrag,0,sizeof(defrag));
+    fat32_defrag(fs,&defrag);
+    TEST_CHECK(defrag.busy_file_cnt == 1&&defrag.moved_file_cnt == 1);
+    TEST_CHECK(!held->dirty&&entry_extent_cnt(held)>1);
+    entry_put_read(held);
+    file = parse_path_read(fs,"/C.BIN");
+    TEST_CHECK(file!=NULL&&!file->dirty);
+    entry_put_read(file);
+    memset(&defrag,0,sizeof(defrag));
+    fat32_defrag(fs,&defrag);
+    TEST_CHECK(defrag.busy_file_cnt == 0&&defrag.moved_file_cnt == 1&&defrag.file_cnt == 3);
+    for(uint32_t i = 0;i<sizeof(names)/sizeof(names[0]);i++){
+        char path[16];
+        snprintf(path,sizeof(path),"/%s",names[i]);
+        file = parse_path_read(fs,path);
+        TEST_CHECK(file!=NULL&&entry_extent_cnt(file) == 1);
+        entry_put_read(file);
+    }
+    fat32_umount(fs);
+    return true;
+}
+
+#define TEST_ELF_BASE 0x400000
+#define TEST_ELF_STRTAB 0x100
+#define TEST_ELF_SYMTAB 0x110
+#define TEST_ELF_SHDRS 0x140
+#define TEST_ELF_SIZE 0x200
+
+/*!
+ * @note an executable of one segment holding whole file,
+ *       with a .symtab of one symbol named alpha.
+ */
+static void _test_elf_make(byte * image){
+    memset(image,0,TEST_ELF_SIZE);
+    elf64_ehdr_t * ehdr = (elf64_ehdr_t *)image;
+    memcpy(ehdr->ident,"\x7F" "ELF\x02\x01\x01",7);
+    ehdr->type = ELF64_ET_EXEC;
+    ehdr->version = 1;
+    ehdr->entry = TEST_ELF_BASE+0x80;
+    ehdr->phoff = sizeof(elf64_ehdr_t);
+    ehdr->shoff = TEST_ELF_SHDRS;
+    ehdr->ehsize = sizeof(elf64_ehdr_t);
+    ehdr->phentsize = sizeof(elf64_phdr_t);
+    ehdr->phnum = 1;
+    ehdr->shentsize = sizeof(elf64_shdr_t);
+    ehdr->shnum = 3;
+    elf64_phdr_t * phdr = (elf64_phdr_t *)(image+ehdr->phoff);
+    phdr->type = ELF64_PT_LOAD;
+    phdr->flags = ELF64_PF_R|ELF64_PF_X;
+    phdr->vaddr = TEST_ELF_BASE;
+    phdr->filesz = TEST_ELF_SIZE;
+    phdr->memsz = TEST_ELF_SIZE;
+    phdr->align = ELF64_PAGE_SIZE;
+    memcpy(image+TEST_ELF_STRTAB,"\0alpha",7);
+    elf64_sym_t * sym = (elf64_sym_t *)(image+TEST_ELF_SYMTAB)+1;
+    sym->name = 1;
+    sym->shndx = 1;
+    sym->value = TEST_ELF_BASE+0x80;
+    elf64_shdr_t * shdrs = (elf64_shdr_t *)(image+TEST_ELF_SHDRS);
+    shdrs[1].type = ELF64_SHT_SYMTAB;
+    shdrs[1].offset = TEST_ELF_SYMTAB;
+    shdrs[1].size = 2*sizeof(elf64_sym_t);
+    shdrs[1].link = 2;
+    shdrs[1].entsize = sizeof(elf64_sym_t);
+    shdrs[2].type = 3;      // SHT_STRTAB
+    shdrs[2].offset = TEST_ELF_STRTAB;
+    shdrs[2].size = 7;
+}
+
+/*!
+ * @note an opened ELF file holds only the ref of entry,
+ *       so it can be written and the remove of it fails
+ *       without waiting,and the symbols are looked up
+ *       in the index rebuilt after the write.
+ */
+static bool _test_elf_open_unlocked(){
+    mkfs_param_t param;
+    memset(&param,0,sizeof(param));
+    param.size = 64*1024*1024;
+    TEST_CHECK(fat32_mkfs(TEST_IMAGE,&param));
+    elf64_module_init();
+    fs_t * fs = fat32_mount(TEST_IMAGE,0);
+    TEST_CHECK(fs!=NULL);
+    char name[] = "PROG.ELF";
+    byte image[TEST_ELF_SIZE];
+    _test_elf_make(image);
+    entry_t * file = entry_create_write(fs->root,name,ENTRY_ATTR_ARCHIVE);
+    TEST_CHECK(file!=NULL);
+    entry_rw(file,image,0,sizeof(image),true);
+    entry_put_write(file);
+    elf_file_t * elf = elf64_open(fs,"/PROG.ELF");
+    TEST_CHECK(elf!=NULL);
+    const elf64_sym_t * alpha = elf64_sym_lookup(elf,"alpha");
+    TEST_CHECK(alpha!=NULL&&alpha->value == TEST_ELF_BASE+0x80);
+    // in same thread,so a wait for the opened file never ends.
+    file = parse_path_write(fs,"/PROG.ELF");
+    TEST_CHECK(file!=NULL);
+    entry_rw(file,"bravo",TEST_ELF_STRTAB+1,5,true);
+    entry_put_write(file);
+    TEST_CHECK(elf64_sym_lookup(elf,"alpha") == NULL);
+    const elf64_sym_t * bravo = elf64_sym_lookup(elf,"bravo");
+    TEST_CHECK(bravo!=NULL&&bravo!=alpha);
+    // the symbol got before the write is valid until close.
+    TEST_CHECK(strcmp(elf64_sym_name(elf,alpha),"alpha") == 0);
+    TEST_CHECK(strcmp(elf64_sym_name(elf,bravo),"bravo") == 0);
+    byte page[ELF64_PAGE_SIZE];
+    uint32_t flags;
+    TEST_CHECK(elf64_page_load(elf,TEST_ELF_BASE,page,&flags));
+    TEST_CHECK(memcmp(page+TEST_ELF_STRTAB+1,"bravo",5) == 0);
+    TEST_CHECK(!entry_rm_sub(fs->root,name));
+    elf64_close(elf);
+    // the closed file is reused from cache,with the new index.
+    elf = elf64_open(fs,"/PROG.ELF");
+    TEST_CHECK(elf!=NULL&&elf64_sym_lookup(elf,"bravo")!=NULL);
+    elf64_close(elf);
+    elf64_cache_drop(fs);
+    TEST_CHECK(entry_rm_sub(fs->root,name));
+    fat32_umount(fs);
+    return true;
+}
+
+static const test_case_t test_cases[] = {
+        {"mkfs_geometry",_test_mkfs_geometry},
+        {"mount_sector_4096",_test_mount_sector_4096},
+        {"fsck_fallocate",_test_fsck_fallocate},
+        {"defrag_busy",_test_defrag_busy},
+        {"elf_open_unlocked",_test_elf_open_unlocked},
+};
+
+static void _usage(const char * name){
+    printf("usage: %s <case>\n",name);
+    for(uint32_t i = 0;i<sizeof(test_cases)/sizeof(test_cases[0]);i++){
+        printf("    %s\n",test_cases[i].name);
+    }
+}
+
+int main(int argc, char ** argv){
+    if(argc!=2){
+        _usage(argv[0]);
+        return 1;
+    }
+    for(uint32_t i = 0;i<sizeof(test_cases)/sizeof(test_cases[0]);i++){
+        if(strcmp(argv[1],test_cases[i].name) == 0){
+            block_module_init();
+            fat32_module_init();
+            bool ok = test_cases[i].run();
+            unlink(TEST_IMAGE);
+            printf("%s: %s\n",test_cases[i].name,ok?"ok":"FAILED");
+            return ok?0:1;
+        }
+    }
+    _usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../fs/fsck.h"
+#include "../fs/block.h"
+
+static void _usage(const char * name){
+    printf("usage: %s <image> [-r] [-j workers]\n",name);
+}
+
+static void _print_problem(void * data, fsck_kind_t kind, const char * path, uint32_t clus, uint32_t arg){
+    (void)data;
+    switch(kind){
+        case FSCK_LEAK:
+            printf("leaked: %u clusters from %u\n",arg,clus);
+            break;
+        case FSCK_CROSS:
+            printf("cross-linked: %s at cluster %u\n",path,clus);
+            break;
+        case FSCK_BROKEN:
+            printf("broken chain: %s after cluster %u\n",path,clus);
+            break;
+        case FSCK_SIZE:
+            printf("size mismatch: %s has %u clusters\n",path,arg);
+            break;
+    }
+}
+
+/*!
+ * @return 0 when volume is clean,1 when problems are repaired,
+ *         4 when problems are left and 8 when fail to check.
+ */
+int main(int argc, char ** argv){
+    if(argc<2){
+        _usage(argv[0]);
+        return 8;
+    }
+    uint32_t flags = 0;
+    uint32_t worker_cnt = 0;
+    for(int i = 2;i<argc;i++){
+        if(strcmp(argv[i],"-r") == 0){
+            flags|=FSCK_REPAIR;
+        }
+        else if(strcmp(argv[i],"-j") == 0&&i+1<argc){
+            worker_cnt = atoi(argv[++i]);
+        }
+        else{
+            _usage(argv[0]);
+            return 8;
+        }
+    }
+    block_module_init();
+    fsck_report_t report;
+    if(!fat32_fsck(argv[1],flags,worker_cnt,_print_problem,NULL,&report)){
+        printf("fail to check %s: not a FAT32 volume,out of memory or I/O error.\n",argv[1]);
+        return 8;
+    }
+    uint32_t problem_cnt = report.cross_cnt+report.broken_cnt+report.size_cnt+(report.leak_clus_cnt>0);
+    printf("%u dirs,%u files,%u/%u clusters reachable,%u leaked,%u cross-linked,%u broken,%u size mismatched,%u fixed\n",
+           report.dir_cnt,report.file_cnt,report.reach_clus_cnt,report.used_clus_cnt,report.leak_clus_cnt,
+           report.cross_cnt,report.broken_cnt,report.size_cnt,report.fixed_cnt);
+    if(problem_cnt == 0){
+        return 0;
+    }
+    return (flags&FSCK_REPAIR)?1:4;
+}
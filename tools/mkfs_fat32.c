@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../fs/mkfs.h"
+
+static void _usage(const char * name){
+    printf("usage: %s <image> <size>[K|M|G] [-s sector_size] [-c sectors_per_cluster]"
+           " [-r reserved_sectors] [-f fat_count] [-n label]\n",name);
+}
+
+/*!
+ * @return bytes of size string,0 when invalid.
+ */
+static size_t _parse_size(const char * str){
+    char * end;
+    size_t size = strtoull(str,&end,10);
+    switch(*end){
+        case 'k':
+        case 'K':
+            size<<=10;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            size<<=20;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            size<<=30;
+            end++;
+            break;
+        default:
+            break;
+    }
+    return *end == '\0'?size:0;
+}
+
+int main(int argc, char ** argv){
+    if(argc<3){
+        _usage(argv[0]);
+        return 1;
+    }
+    mkfs_param_t param;
+    memset(&param,0,sizeof(param));
+    param.size = _parse_size(argv[2]);
+    param.vol_id = 0x20210415;
+    for(int i = 3;i+1<argc;i+=2){
+        if(strcmp(argv[i],"-s") == 0){
+            param.byts_per_sec = atoi(argv[i+1]);
+        }
+        else if(strcmp(argv[i],"-c") == 0){
+            param.sec_per_clus = atoi(argv[i+1]);
+        }
+        else if(strcmp(argv[i],"-r") == 0){
+            param.rsvd_sec_cnt = atoi(argv[i+1]);
+        }
+        else if(strcmp(argv[i],"-f") == 0){
+            param.fat_cnt = atoi(argv[i+1]);
+        }
+        else if(strcmp(argv[i],"-n") == 0){
+            memset(param.label,' ',11);
+            size_t len = strlen(argv[i+1]);
+            memcpy(param.label,argv[i+1],len>11?11:len);
+        }
+        else{
+            _usage(argv[0]);
+            return 1;
+        }
+    }
+    if(param.size == 0){
+        _usage(argv[0]);
+        return 1;
+    }
+    if(!fat32_mkfs(argv[1],&param)){
+        printf("fail to format %s: geometry is invalid for FAT32,not supported or write error.\n",argv[1]);
+        return 1;
+    }
+    return 0;
+}